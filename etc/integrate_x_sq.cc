@@ -6,7 +6,8 @@
 #include <stdlib.h>
 
 double f(double d) {
-    return 8.0 * pow(d, 1.0/3.0);
+    // Inverse of the CDF x^3/8 of pdf() below, so f(random_double()) is distributed by pdf()
+    return 2.0 * pow(d, 1.0/3.0);
 }
 
 double pdf(double x) {
@@ -17,7 +18,7 @@ int main() {
     int N = 1;
     auto sum = 0.0;
     for (int i = 0; i < N; i++) {
-        auto x = f(random_double()));
+        auto x = f(random_double());
         sum += x*x / pdf(x);
     }
     std::cout << std::fixed << std::setprecision(12);
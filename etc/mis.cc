@@ -0,0 +1,62 @@
+#include "rtweekend.h"
+
+#include <iostream>
+#include <iomanip>
+
+// One dimensional model of direct lighting, for comparing multiple importance sampling
+// heuristics. The integrand is a "BSDF" lobe b(x) = (n+1) x^n times a "light" L(x) of width w
+// around x = 0.9, over [0,1]. Sampling the lobe suits wide lights and sharp lobes, sampling the
+// light suits narrow lights and broad lobes. Every estimator takes two samples: two of one
+// strategy, or one of each combined with a heuristic.
+// Build with e.g. g++ -O2 -Iutils etc/mis.cc
+
+const double light_center = 0.9;
+
+double lobe_pdf(double x, double n) { return (x < 0 || x > 1) ? 0 : (n + 1) * pow(x, n); }
+
+double light_pdf(double x, double w) { return fabs(x - light_center) < w/2 ? 1 / w : 0; }
+
+double integrand(double x, double n, double w) { return lobe_pdf(x, n) * light_pdf(x, w); }
+
+int main() {
+    const int N = 1000000;
+
+    std::cout << std::fixed << std::setprecision(4);
+    std::cout << "   n     w | variance:  lobe      light    balance      power\n";
+
+    // (lobe exponent, light width): broad lobe, medium lobe, and a near mirror whose peak
+    // the wide light covers
+    double cases[][2] = { {1, 0.01}, {1, 0.2}, {20, 0.01}, {20, 0.2}, {500, 0.2} };
+    for (auto& c : cases) {
+        double n = c[0], w = c[1];
+        double sum[4] = {0, 0, 0, 0}, sum_sq[4] = {0, 0, 0, 0};
+        for (int i = 0; i < N; i++) {
+            auto xb = pow(random_double(), 1 / (n + 1));               // lobe samples
+            auto xb2 = pow(random_double(), 1 / (n + 1));
+            auto xl = light_center + w * (random_double() - 0.5);    // light samples
+            auto xl2 = light_center + w * (random_double() - 0.5);
+
+            auto fb = integrand(xb, n, w), pb = lobe_pdf(xb, n), qb = light_pdf(xb, w);
+            auto fl = integrand(xl, n, w), pl = light_pdf(xl, w),  ql = lobe_pdf(xl, n);
+
+            double estimate[4] = {
+                (fb / pb + integrand(xb2, n, w) / lobe_pdf(xb2, n)) / 2,
+                (fl / pl + integrand(xl2, n, w) / light_pdf(xl2, w)) / 2,
+                fb / (pb + qb) + fl / (pl + ql),
+                fb * pb / (pb*pb + qb*qb) + fl * pl / (pl*pl + ql*ql)
+            };
+            for (int k = 0; k < 4; k++) {
+                sum[k] += estimate[k];
+                sum_sq[k] += estimate[k] * estimate[k];
+            }
+        }
+
+        std::cout << std::setw(4) << int(n) << ' ' << std::setw(5) << std::setprecision(2) << w
+                  << std::setprecision(4) << " |";
+        for (int k = 0; k < 4; k++) {
+            auto mean = sum[k] / N;
+            std::cout << ' ' << std::setw(10) << sum_sq[k] / N - mean * mean;
+        }
+        std::cout << "   (I = " << sum[3] / N << ")\n";
+    }
+}
@@ -0,0 +1,60 @@
+#include "rtweekend.h"
+
+#include <cstdio>
+#include <iostream>
+
+// Writes sky.hdr, a small lat-long HDR environment for testing environment lights: a blue sky
+// fading to a pale horizon, a dim brown ground, and a sun a few degrees across that is much
+// brighter than everything else. Radiance .hdr format, uncompressed scanlines.
+// Build with e.g. g++ -O2 -Iutils etc/sky_hdr.cc, then run from where main reads images.
+
+const int width = 1024, height = 512;
+
+void write_rgbe(FILE* f, vec3 c) {
+    // Shared exponent: the largest component is stored with 8 bits of mantissa
+    auto m = fmax(c.x(), fmax(c.y(), c.z()));
+    unsigned char rgbe[4] = { 0, 0, 0, 0 };
+    if (m > 1e-32) {
+        int e;
+        auto scale = frexp(m, &e) * 256.0 / m;
+        rgbe[0] = (unsigned char)(c.x() * scale);
+        rgbe[1] = (unsigned char)(c.y() * scale);
+        rgbe[2] = (unsigned char)(c.z() * scale);
+        rgbe[3] = (unsigned char)(e + 128);
+    }
+    fwrite(rgbe, 1, 4, f);
+}
+
+int main() {
+    auto sun_direction = unit_vector(vec3(-0.6, 0.55, -0.55));
+    auto sun_cos_radius = cos(degrees_to_radians(1.5));
+    auto sun = vec3(1.0, 0.9, 0.75) * 800;
+
+    FILE* f = fopen("sky.hdr", "wb");
+    if (!f) {
+        std::cerr << "Could not write sky.hdr\n";
+        return 1;
+    }
+    fprintf(f, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height, width);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            // Same direction for pixel (x, y) as environment_light
+            auto theta = pi * (y + 0.5) / height;
+            auto phi = 2*pi * (x + 0.5) / width;
+            auto d = vec3(-cos(phi) * sin(theta), cos(theta), sin(phi) * sin(theta));
+
+            vec3 c;
+            if (d.y() < 0)
+                c = vec3(0.25, 0.2, 0.15);
+            else
+                c = (1 - d.y()) * vec3(0.9, 0.95, 1.0) + d.y() * vec3(0.3, 0.5, 1.0);
+            if (dot(d, sun_direction) > sun_cos_radius)
+                c = sun;
+            write_rgbe(f, c);
+        }
+    }
+
+    fclose(f);
+    std::clog << "Wrote sky.hdr (" << width << "x" << height << ")\n";
+}
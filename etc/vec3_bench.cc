@@ -0,0 +1,116 @@
+#include "rtweekend.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+// Microbenchmark for the vec3 kernels. Times each operator on the SIMD vec3 against the old
+// three-double scalar version, and checks that both give the same bits.
+// Build with e.g. g++ -O2 -Iutils etc/vec3_bench.cc (add -mavx2 for the AVX2 kernels).
+
+struct vec3_scalar {
+    double e[3];
+};
+
+inline vec3_scalar add_scalar(const vec3_scalar& u, const vec3_scalar& v) {
+    return { u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2] };
+}
+
+inline vec3_scalar mul_scalar(const vec3_scalar& u, const vec3_scalar& v) {
+    return { u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2] };
+}
+
+inline double dot_scalar(const vec3_scalar& u, const vec3_scalar& v) {
+    return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+}
+
+inline vec3_scalar cross_scalar(const vec3_scalar& u, const vec3_scalar& v) {
+    return { u.e[1] * v.e[2] - u.e[2] * v.e[1],
+             u.e[2] * v.e[0] - u.e[0] * v.e[2],
+             u.e[0] * v.e[1] - u.e[1] * v.e[0] };
+}
+
+inline vec3_scalar unit_scalar(const vec3_scalar& v) {
+    auto t = 1 / sqrt(dot_scalar(v, v));
+    return { t * v.e[0], t * v.e[1], t * v.e[2] };
+}
+
+template <typename F>
+double time_ns(int n, F f) {
+    // Returns the average nanoseconds per call of f over n calls.
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        f(i);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+int main() {
+    const int N = 1 << 10;
+    const int reps = 20000;
+
+    std::vector<vec3> a(N), b(N), out(N);
+    std::vector<vec3_scalar> sa(N), sb(N), sout(N);
+    std::vector<double> d(N), sd(N);
+
+    for (int i = 0; i < N; i++) {
+        a[i] = vec3::random(-1, 1);
+        b[i] = vec3::random(-1, 1);
+        sa[i] = { a[i].x(), a[i].y(), a[i].z() };
+        sb[i] = { b[i].x(), b[i].y(), b[i].z() };
+    }
+
+    auto same = [&](const char* name) {
+        // Check the SIMD results against the scalar ones, bit for bit.
+        for (int i = 0; i < N; i++)
+            for (int c = 0; c < 3; c++)
+                if (out[i][c] != sout[i].e[c]) {
+                    std::cout << name << " MISMATCH at " << i << '\n';
+                    return;
+                }
+    };
+
+    auto row = [](const char* name, double scalar_ns, double simd_ns) {
+        std::cout << std::left << std::setw(16) << name << std::right
+                  << std::setw(10) << scalar_ns << std::setw(10) << simd_ns
+                  << std::setw(9) << scalar_ns / simd_ns << "x\n";
+    };
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << std::left << std::setw(16) << "op" << std::right
+              << std::setw(10) << "scalar" << std::setw(10) << "simd" << std::setw(10) << "speedup"
+              << "   (ns per op)\n";
+
+    double s, v;
+
+    s = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) sout[i] = add_scalar(sa[i], sb[i]); });
+    v = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) out[i] = a[i] + b[i]; });
+    row("operator+", s / N, v / N); same("operator+");
+
+    s = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) sout[i] = mul_scalar(sa[i], sb[i]); });
+    v = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) out[i] = a[i] * b[i]; });
+    row("operator*", s / N, v / N); same("operator*");
+
+    s = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) sd[i] = dot_scalar(sa[i], sb[i]); });
+    v = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) d[i] = dot(a[i], b[i]); });
+    row("dot", s / N, v / N);
+    for (int i = 0; i < N; i++)
+        if (d[i] != sd[i]) { std::cout << "dot MISMATCH at " << i << '\n'; break; }
+
+    s = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) sout[i] = cross_scalar(sa[i], sb[i]); });
+    v = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) out[i] = cross(a[i], b[i]); });
+    row("cross", s / N, v / N); same("cross");
+
+    s = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) sout[i] = unit_scalar(sa[i]); });
+    v = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) out[i] = unit_vector(a[i]); });
+    row("unit_vector", s / N, v / N); same("unit_vector");
+
+    v = time_ns(reps, [&](int) { for (int i = 0; i < N; i++) out[i] = fast_unit_vector(a[i]); });
+    row("fast_unit_vector", s / N, v / N);
+
+    double max_err = 0;
+    for (int i = 0; i < N; i++)
+        max_err = fmax(max_err, fabs(out[i].length() - 1));
+    std::cout << "fast_unit_vector max length error = " << std::scientific << max_err << '\n';
+}
@@ -12,30 +12,35 @@
 #include "utils\texture.h"
 #include "utils\quad.h"
 #include "utils\constant_medium.h"
+#include "utils\heterogeneous_medium.h"
+#include "utils\scene.h"
+#include "utils\environment.h"
+#include "utils\perlin.h"
+#include "utils\scene_file.h"
+#include "utils\render_queue.h"
 
+#include <functional>
 
-void world_1()
+void world_1(scene& scn, camera& cam)
 {
     // Make World
-    hittable_list world;
+    auto& world = scn.world;
 
     // Materials
-    auto material_ground = make_shared<lambertian>(color(0.2, 0.6, 0.2));
-    auto material_center = make_shared<lambertian>(color(0.5, 0.1, 0.2));
-    auto material_left = make_shared<dielectric>(1.7);
-    auto material_right = make_shared<metal>(color(0.7, 0.2, 0.7), 0.05);
+    auto material_ground = scn.materials.add<lambertian>(color(0.2, 0.6, 0.2));
+    auto material_center = scn.materials.add<lambertian>(color(0.5, 0.1, 0.2));
+    auto material_left = scn.materials.add<dielectric>(1.7);
+    auto material_right = scn.materials.add<metal>(color(0.7, 0.2, 0.7), 0.05);
 
     // Objects
-    world.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<sphere>(point3(0.0, 0.0, -1.0), 0.5, material_center));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
-    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), -0.4, material_left));
-    world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_right));
+    world.add(scn.make<sphere>(point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(scn.make<sphere>(point3(0.0, 0.0, -1.0), 0.5, material_center));
+    world.add(scn.make<sphere>(point3(-1.0, 0.0, -1.0), 0.5, material_left));
+    world.add(scn.make<sphere>(point3(-1.0, 0.0, -1.0), -0.4, material_left));
+    world.add(scn.make<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_right));
 
     // Camera
-    world = hittable_list(make_shared<bvh_node>(world));
-    camera cam;
-
+    world = hittable_list(scn.make<bvh_node>(world, scn.arena));
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 1000;
     cam.samples_per_pixel = 500;
@@ -49,25 +54,22 @@ void world_1()
 
     cam.defocus_angle = 0.0;
     cam.focus_dist = (cam.lookfrom - cam.lookat).length();
-
-    cam.render(world);
 }
 
-void world_2()
+void world_2(scene& scn, camera& cam)
 {
     // Make World
-    hittable_list world;
+    auto& world = scn.world;
 
     // Materials
-    auto material_ground = make_shared<lambertian>(color(0.1, 0.1, 0.1));
-    auto checker_ground = make_shared<checker_texture>(1, color(.1, .1, .1), color(.9, .9, .9));
-    auto checker = make_shared<lambertian>(checker_ground);
+    auto checker_ground = scn.textures.add<checker_texture>(1, color(.1, .1, .1), color(.9, .9, .9));
+    auto checker = scn.materials.add<lambertian>(checker_ground);
 
-    world.add(make_shared<sphere>(point3(0.0, -1000.0, -1.0), 1000.0, checker));
+    world.add(scn.make<sphere>(point3(0.0, -1000.0, -1.0), 1000.0, checker));
 
-    auto matte_white = make_shared<lambertian>(color(0.5, 0.2, 0.2));
-    auto mat_glass = make_shared<dielectric>(1.7);
-    auto blue_metal = make_shared<metal>(color(0.7, 0.7, 0.8), 0.05);
+    auto matte_white = scn.materials.add<lambertian>(color(0.5, 0.2, 0.2));
+    auto mat_glass = scn.materials.add<dielectric>(1.7);
+    auto blue_metal = scn.materials.add<metal>(color(0.7, 0.7, 0.8), 0.05);
 
     // Objects
     for (double y = 0.0; y < 30; ++y)
@@ -76,47 +78,45 @@ void world_2()
         {
             double mat = random_double();
 
-            shared_ptr<material> material_temp;
+            material_id material_temp;
 
             if (mat < 0.6)
             {
-                material_temp = make_shared<lambertian>(color(random_double(), random_double(), random_double()));
+                material_temp = scn.materials.add<lambertian>(color(random_double(), random_double(), random_double()));
             }
             else if (mat < 0.85)
             {
-                material_temp = make_shared<metal>(color(random_double(), random_double(), random_double()), 0.05);
+                material_temp = scn.materials.add<metal>(color(random_double(), random_double(), random_double()), 0.05);
             }
             else
             {
-                material_temp = make_shared<dielectric>(1.7);
+                material_temp = scn.materials.add<dielectric>(1.7);
             }
 
             double offshift = random_double();
             double offshift2 = random_double() * 0.2;
-            world.add(make_shared<sphere>(point3(sin(y * 6.1 + offshift) * rad, 1.5 * y + 1, cos(y * 6.1 + offshift) * rad), 0.4 + offshift2, material_temp));
+            world.add(scn.make<sphere>(point3(sin(y * 6.1 + offshift) * rad, 1.5 * y + 1, cos(y * 6.1 + offshift) * rad), 0.4 + offshift2, material_temp));
 
             offshift = random_double();
             offshift2 = random_double() * 0.3;
-            world.add(make_shared<sphere>(point3(sin(y * 6.1 + offshift + 2 * pi / 3) * rad, 1.5 * y + 1, cos(y * 6.1 + offshift + 2 * pi / 3) * rad), 0.4 + offshift2, material_temp));
+            world.add(scn.make<sphere>(point3(sin(y * 6.1 + offshift + 2 * pi / 3) * rad, 1.5 * y + 1, cos(y * 6.1 + offshift + 2 * pi / 3) * rad), 0.4 + offshift2, material_temp));
 
             offshift = random_double();
             offshift2 = random_double() * 0.3;
-            world.add(make_shared<sphere>(point3(sin(y * 6.1 + offshift + 4 * pi / 3) * rad, 1.5 * y + 1, cos(y * 6.1 + offshift + 4 * pi / 3) * rad), 0.4 + offshift2, material_temp));
+            world.add(scn.make<sphere>(point3(sin(y * 6.1 + offshift + 4 * pi / 3) * rad, 1.5 * y + 1, cos(y * 6.1 + offshift + 4 * pi / 3) * rad), 0.4 + offshift2, material_temp));
         }
     }
 
-    // world.add(make_shared<sphere>(point3(0.0, 5, 0.0), point3(5, 5, 0.0), 5, matte_white));
-    // world.add(make_shared<sphere>(point3(0.0, 15, 0.0), point3(5, 5, 0.0), 5, blue_metal));
-    // world.add(make_shared<sphere>(point3(0.0, 25, 0.0), point3(5, 5, 0.0), 5, mat_glass));
+    // world.add(scn.make<sphere>(point3(0.0, 5, 0.0), point3(5, 5, 0.0), 5, matte_white));
+    // world.add(scn.make<sphere>(point3(0.0, 15, 0.0), point3(5, 5, 0.0), 5, blue_metal));
+    // world.add(scn.make<sphere>(point3(0.0, 25, 0.0), point3(5, 5, 0.0), 5, mat_glass));
 
-    world.add(make_shared<sphere>(point3(0.0, 5, 0.0), 5, matte_white));
-    world.add(make_shared<sphere>(point3(0.0, 15, 0.0), 5, blue_metal));
-    world.add(make_shared<sphere>(point3(0.0, 25, 0.0), 5, mat_glass));
+    world.add(scn.make<sphere>(point3(0.0, 5, 0.0), 5, matte_white));
+    world.add(scn.make<sphere>(point3(0.0, 15, 0.0), 5, blue_metal));
+    world.add(scn.make<sphere>(point3(0.0, 25, 0.0), 5, mat_glass));
 
     // Camera
-    world = hittable_list(make_shared<bvh_node>(world));
-    camera cam;
-
+    world = hittable_list(scn.make<bvh_node>(world, scn.arena));
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 2000;
     cam.samples_per_pixel = 50;
@@ -130,21 +130,16 @@ void world_2()
     cam.defocus_angle = 0.0;
     cam.focus_dist = (cam.lookfrom - cam.lookat).length();
     cam.background = color(0.70, 0.80, 1.00);
-
-    cam.render(world);
 }
 
-void world_2_checkered_spheres()
+void world_2_checkered_spheres(scene& scn, camera& cam)
 {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    auto& world = scn.world;
 
-    world.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    auto checker = scn.textures.add<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
 
-    camera cam;
+    world.add(scn.make<sphere>(point3(0, -10, 0), 10, scn.materials.add<lambertian>(checker)));
+    world.add(scn.make<sphere>(point3(0, 10, 0), 10, scn.materials.add<lambertian>(checker)));
 
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 1000;
@@ -158,17 +153,15 @@ void world_2_checkered_spheres()
     cam.background = color(0.70, 0.80, 1.00);
 
     cam.defocus_angle = 0;
-
-    cam.render(world);
 }
 
-void earth()
+void earth(scene& scn, camera& cam)
 {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
 
-    camera cam;
+    auto earth_texture = scn.textures.add<image_texture>("earthmap.jpg");
+    auto earth_surface = scn.materials.add<lambertian>(earth_texture);
+    auto globe = scn.make<sphere>(point3(0, 0, 0), 2, earth_surface);
+    scn.world.add(globe);
 
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 1200;
@@ -182,19 +175,15 @@ void earth()
 
     cam.defocus_angle = 0;
     cam.background = color(0.70, 0.80, 1.00);
-
-    cam.render(hittable_list(globe));
 }
 
-void perlin_spheres()
+void perlin_spheres(scene& scn, camera& cam)
 {
-    hittable_list world;
+    auto& world = scn.world;
 
-    auto pertext = make_shared<noise_texture>(4);
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-
-    camera cam;
+    auto pertext = scn.textures.add<noise_texture>(4);
+    world.add(scn.make<sphere>(point3(0, -1000, 0), 1000, scn.materials.add<lambertian>(pertext)));
+    world.add(scn.make<sphere>(point3(0, 2, 0), 2, scn.materials.add<lambertian>(pertext)));
 
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 800;
@@ -208,27 +197,23 @@ void perlin_spheres()
 
     cam.defocus_angle = 0;
     cam.background = color(0.70, 0.80, 1.00);
-
-    cam.render(world);
 }
 
-void quads() {
-    hittable_list world;
+void quads(scene& scn, camera& cam) {
+    auto& world = scn.world;
 
-    auto left_red     = make_shared<lambertian>(color(1.0, 0.2, 0.2));
-    auto back_green   = make_shared<lambertian>(color(0.2, 1.0, 0.2));
-    auto right_blue   = make_shared<lambertian>(color(0.2, 0.2, 1.0));
-    auto upper_orange = make_shared<lambertian>(color(1.0, 0.5, 0.0));
-    auto lower_teal   = make_shared<lambertian>(color(0.2, 0.8, 0.8));
+    auto left_red     = scn.materials.add<lambertian>(color(1.0, 0.2, 0.2));
+    auto back_green   = scn.materials.add<lambertian>(color(0.2, 1.0, 0.2));
+    auto right_blue   = scn.materials.add<lambertian>(color(0.2, 0.2, 1.0));
+    auto upper_orange = scn.materials.add<lambertian>(color(1.0, 0.5, 0.0));
+    auto lower_teal   = scn.materials.add<lambertian>(color(0.2, 0.8, 0.8));
 
     // Quads
-    world.add(make_shared<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
-    world.add(make_shared<quad>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
-    world.add(make_shared<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
-    world.add(make_shared<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-    world.add(make_shared<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
-
-    camera cam;
+    world.add(scn.make<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
+    world.add(scn.make<quad>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+    world.add(scn.make<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+    world.add(scn.make<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
+    world.add(scn.make<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
 
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 400;
@@ -242,21 +227,17 @@ void quads() {
     cam.background = color(0.70, 0.80, 1.00);
 
     cam.defocus_angle = 0;
-
-    cam.render(world);
 }
 
-void simple_light() {
-    hittable_list world;
-
-    auto pertext = make_shared<noise_texture>(4);
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
+void simple_light(scene& scn, camera& cam) {
+    auto& world = scn.world;
 
-    auto difflight = make_shared<diffuse_light>(color(4,4,4));
-    world.add(make_shared<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
+    auto pertext = scn.textures.add<noise_texture>(4);
+    world.add(scn.make<sphere>(point3(0,-1000,0), 1000, scn.materials.add<lambertian>(pertext)));
+    world.add(scn.make<sphere>(point3(0,2,0), 2, scn.materials.add<lambertian>(pertext)));
 
-    camera cam;
+    auto difflight = scn.materials.add<diffuse_light>(color(4,4,4));
+    world.add(scn.make<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
 
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
@@ -270,38 +251,216 @@ void simple_light() {
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
+}
+
+void motion_blur(scene& scn, camera& cam) {
+    auto& world = scn.world;
+
+    auto checker = scn.textures.add<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(scn.make<sphere>(point3(0,-1000,0), 1000, scn.materials.add<lambertian>(checker)));
+
+    // Small spheres all moving in different directions during the shutter interval
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto center1 = point3(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+            auto center2 = center1 + vec3(random_double(-1,1), random_double(0,0.5), random_double(-1,1));
+            auto albedo = color::random() * color::random();
+            world.add(scn.make<sphere>(center1, center2, 0.2, scn.materials.add<lambertian>(albedo)));
+        }
+    }
+
+    // A box sliding through the scene, moved by an instance transform
+    const hittable* crate = box(scn.arena, point3(-1,0,-1), point3(1,2,1), scn.materials.add<metal>(color(0.7, 0.6, 0.5), 0.1));
+    world.add(scn.make<moving_translate>(crate, vec3(-2,0,-3), vec3(2,0,-3)));
+
+    world = hittable_list(scn.make<bvh_node>(world, scn.arena));
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+    cam.background        = color(0.70, 0.80, 1.00);
+
+    cam.vfov     = 20;
+    cam.lookfrom = point3(13,2,3);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
+
+void glossy_plates(scene& scn, camera& cam) {
+    // Four metal plates of decreasing fuzz reflecting four sphere lights of increasing size
+    // and equal power, after Veach's multiple importance sampling test scene. Light sampling
+    // does best on the rough plates and small lights, scattering on the smooth plates and
+    // large lights.
+    auto& world = scn.world;
+
+    auto floor = scn.materials.add<lambertian>(color(.4, .4, .4));
+    world.add(scn.make<quad>(point3(-10,-4,-4), vec3(20,0,0), vec3(0,0,24), floor));
+    world.add(scn.make<quad>(point3(-10,-4,-4), vec3(20,0,0), vec3(0,14,0), floor));
+
+    point3 lookfrom(0, 6, 14);
+    point3 light_row(0, 2, 0);
+    double radii[] = { 0.05, 0.15, 0.4, 1.0 };
+    for (int i = 0; i < 4; i++) {
+        auto r = radii[i];
+        auto light = scn.materials.add<diffuse_light>(color(1, 1, 1) * (0.8 / (r*r)));
+        world.add(scn.make<sphere>(light_row + vec3(-3.75 + 2.5*i, 0, 0), r, light));
+    }
+
+    double fuzz[] = { 0.5, 0.2, 0.07, 0.02 };
+    for (int i = 0; i < 4; i++) {
+        // Tilt each plate so that it reflects the row of lights toward the camera
+        auto center = point3(0, -2.8 + 0.5*i, 3.5 + 1.9*i);
+        auto normal = unit_vector(unit_vector(light_row - center) + unit_vector(lookfrom - center));
+        auto across = vec3(8, 0, 0);
+        auto along = 1.8 * unit_vector(cross(normal, across));
+        auto plate = scn.materials.add<metal>(color(.8, .8, .8), fuzz[i]);
+        world.add(scn.make<quad>(center - across/2 - along/2, across, along, plate));
+    }
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 10;
+    cam.background        = color(0,0,0);
+
+    cam.vfov     = 40;
+    cam.lookfrom = lookfrom;
+    cam.lookat   = point3(0, 0, 4);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
 
-    cam.render(world);
+void sky_lit(scene& scn, camera& cam) {
+    // A few spheres under an HDR sky with a small, bright sun, lit only by the environment.
+    // sky.hdr comes from etc/sky_hdr.cc; any lat-long .hdr image works.
+    auto& world = scn.world;
+
+    scn.environment = scn.make<environment_light>("sky.hdr");
+
+    auto ground = scn.materials.add<lambertian>(color(.5, .5, .5));
+    world.add(scn.make<sphere>(point3(0,-1000,0), 1000, ground));
+
+    auto diffuse = scn.materials.add<lambertian>(color(.7, .3, .2));
+    auto glossy  = scn.materials.add<metal>(color(.8, .8, .8), 0.15);
+    auto glass   = scn.materials.add<dielectric>(1.5);
+    world.add(scn.make<sphere>(point3(-2.2, 1, 0), 1, diffuse));
+    world.add(scn.make<sphere>(point3( 0,   1, 0), 1, glossy));
+    world.add(scn.make<sphere>(point3( 2.2, 1, 0), 1, glass));
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 20;
+
+    cam.vfov     = 30;
+    cam.lookfrom = point3(0, 3, 10);
+    cam.lookat   = point3(0, 0.8, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
 }
 
-void cornell_box() {
-    hittable_list world;
+void city_lights(scene& scn, camera& cam) {
+    // A city block grid at night, lit by thousands of small window lights and a few street
+    // lamps. Most lights are far away or face away from any given point, which is what the
+    // light BVH is for.
+    auto& world = scn.world;
+
+    auto asphalt  = scn.materials.add<lambertian>(color(.2, .2, .22));
+    auto concrete = scn.materials.add<lambertian>(color(.5, .48, .45));
+    material_id window_lights[] = {
+        scn.materials.add<diffuse_light>(color(4, 3.2, 2)),
+        scn.materials.add<diffuse_light>(color(3, 3.2, 4)),
+        scn.materials.add<diffuse_light>(color(5, 4.5, 3.5)),
+    };
+    auto lamp = scn.materials.add<diffuse_light>(color(60, 45, 25));
+
+    world.add(scn.make<quad>(point3(-200,0,-200), vec3(400,0,0), vec3(0,0,400), asphalt));
+
+    // 12 x 12 blocks of 6 x 6 buildings, with 4 wide streets between them
+    const int blocks = 12;
+    const double size = 6, spacing = 10, floor_height = 2.5;
+    for (int bx = 0; bx < blocks; bx++) {
+        for (int bz = 0; bz < blocks; bz++) {
+            auto x0 = (bx - blocks/2) * spacing;
+            auto z0 = (bz - blocks/2) * spacing;
+            auto height = random_double(8, 30);
+            world.add(box(scn.arena, point3(x0, 0, z0), point3(x0 + size, height, z0 + size), concrete));
+
+            // Lit windows on all four faces, slightly in front of the wall
+            int floors = int(height / floor_height) - 1;
+            for (int face = 0; face < 4; face++) {
+                for (int f = 0; f < floors; f++) {
+                    for (int c = 0; c < 3; c++) {
+                        if (random_double() > 0.35)
+                            continue;
+                        auto mat = window_lights[random_int(0, 2)];
+                        auto y = 1.0 + f * floor_height;
+                        auto s = 0.6 + c * 1.9;
+                        auto across = vec3(0.9, 0, 0), up = vec3(0, 1.2, 0);
+                        point3 corner;
+                        switch (face) {
+                            case 0: corner = point3(x0 + s, y, z0 - 0.05); break;
+                            case 1: corner = point3(x0 + s, y, z0 + size + 0.05); break;
+                            case 2: corner = point3(x0 - 0.05, y, z0 + s); across = vec3(0, 0, 0.9); break;
+                            default: corner = point3(x0 + size + 0.05, y, z0 + s); across = vec3(0, 0, 0.9); break;
+                        }
+                        world.add(scn.make<quad>(corner, across, up, mat));
+                    }
+                }
+            }
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+            // Street lamp at the corner
+            world.add(scn.make<sphere>(point3(x0 - 2, 4, z0 - 2), 0.25, lamp));
+        }
+    }
 
-    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), red)); //left
-    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), green)); //right
-    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light)); //light
-    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
-    world.add(make_shared<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
-    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world = hittable_list(scn.make<bvh_node>(world, scn.arena));
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 10;
+    cam.background        = color(0.01, 0.01, 0.02);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(-25, 22, 95);
+    cam.lookat   = point3(0, 4, 20);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
+
+void cornell_box(scene& scn, camera& cam) {
+    auto& world = scn.world;
+
+    auto red   = scn.materials.add<lambertian>(color(.65, .05, .05));
+    auto white = scn.materials.add<lambertian>(color(.73, .73, .73));
+    auto green = scn.materials.add<lambertian>(color(.12, .45, .15));
+    auto light = scn.materials.add<diffuse_light>(color(15, 15, 15));
+
+    world.add(scn.make<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), red)); //left
+    world.add(scn.make<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), green)); //right
+    world.add(scn.make<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light)); //light
+    world.add(scn.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(scn.make<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
 
     //Instance translations and rotations
-    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    const hittable* box1 = box(scn.arena, point3(0,0,0), point3(165,330,165), white);
+    box1 = scn.make<rotate_y>(box1, 15);
+    box1 = scn.make<translate>(box1, vec3(265,0,295));
     world.add(box1);
 
-    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    const hittable* box2 = box(scn.arena, point3(0,0,0), point3(165,165,165), white);
+    box2 = scn.make<rotate_y>(box2, -18);
+    box2 = scn.make<translate>(box2, vec3(130,0,65));
     world.add(box2);
 
-    camera cam;
-
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 600;
     cam.samples_per_pixel = 64;
@@ -314,37 +473,126 @@ void cornell_box() {
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
+}
+
+void cornell_glass(scene& scn, camera& cam) {
+    // The Cornell box with a glass ball in place of the short box, and the caustic it focuses
+    // onto the floor, which only the photon map resolves
+    auto& world = scn.world;
+
+    auto red   = scn.materials.add<lambertian>(color(.65, .05, .05));
+    auto white = scn.materials.add<lambertian>(color(.73, .73, .73));
+    auto green = scn.materials.add<lambertian>(color(.12, .45, .15));
+    auto light = scn.materials.add<diffuse_light>(color(15, 15, 15));
+    auto glass = scn.materials.add<dielectric>(1.5);
+
+    world.add(scn.make<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), red)); //left
+    world.add(scn.make<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), green)); //right
+    world.add(scn.make<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105), light)); //light
+    world.add(scn.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(scn.make<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    const hittable* box1 = box(scn.arena, point3(0,0,0), point3(165,330,165), white);
+    box1 = scn.make<rotate_y>(box1, 15);
+    box1 = scn.make<translate>(box1, vec3(265,0,295));
+    world.add(box1);
+
+    world.add(scn.make<sphere>(point3(190,90,190), 90, glass));
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 50;
+    cam.background        = color(0,0,0);
+    cam.caustic_photons   = 2000000;
 
-    cam.render(world);
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
 }
 
-void cornell_smoke() {
-    hittable_list world;
+void light_leak(scene& scn, camera& cam) {
+    // A closed room lit only through a slit in its ceiling, from a lamp in the space above.
+    // Shadow rays toward the lamp almost always hit the ceiling and scattered rays rarely find
+    // the slit, so most of the light arrives by paths that path guiding learns to follow.
+    auto& world = scn.world;
+
+    auto white = scn.materials.add<lambertian>(color(.73, .73, .73));
+    auto red   = scn.materials.add<lambertian>(color(.65, .05, .05));
+    auto green = scn.materials.add<lambertian>(color(.12, .45, .15));
+    auto light = scn.materials.add<diffuse_light>(color(40, 40, 40));
+
+    // Room
+    world.add(scn.make<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(scn.make<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(scn.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    world.add(scn.make<quad>(point3(0,0,-801), vec3(555,0,0), vec3(0,555,0), white)); // behind the camera
+
+    // Ceiling with a 12 unit slit along z, near the red wall
+    world.add(scn.make<quad>(point3(0,555,-801), vec3(420,0,0), vec3(0,0,1356), white));
+    world.add(scn.make<quad>(point3(432,555,-801), vec3(123,0,0), vec3(0,0,1356), white));
+    world.add(scn.make<quad>(point3(0,0,-801), vec3(0,555,0), vec3(0,0,801), green));
+    world.add(scn.make<quad>(point3(555,0,-801), vec3(0,555,0), vec3(0,0,801), red));
+    world.add(scn.make<quad>(point3(0,0,-801), vec3(555,0,0), vec3(0,0,801), white));
+
+    // Lamp space above, lit from its top
+    world.add(scn.make<quad>(point3(0,555,-801), vec3(0,60,0), vec3(0,0,1356), white));
+    world.add(scn.make<quad>(point3(555,555,-801), vec3(0,60,0), vec3(0,0,1356), white));
+    world.add(scn.make<quad>(point3(0,555,-801), vec3(555,0,0), vec3(0,60,0), white));
+    world.add(scn.make<quad>(point3(0,555,555), vec3(555,0,0), vec3(0,60,0), white));
+    world.add(scn.make<quad>(point3(100,614,-200), vec3(300,0,0), vec3(0,0,500), light));
+    world.add(scn.make<quad>(point3(0,615,-801), vec3(555,0,0), vec3(0,0,1356), white));
+
+    const hittable* box1 = box(scn.arena, point3(0,0,0), point3(165,330,165), white);
+    box1 = scn.make<rotate_y>(box1, 15);
+    box1 = scn.make<translate>(box1, vec3(265,0,295));
+    world.add(box1);
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 256;
+    cam.max_depth         = 50;
+    cam.background        = color(0,0,0);
+    cam.path_guiding      = true;
 
-    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
-    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
-    world.add(make_shared<quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
-    world.add(make_shared<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
-    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
-    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -780);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
 
-    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    cam.defocus_angle = 0;
+}
 
-    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+void cornell_smoke(scene& scn, camera& cam) {
+    auto& world = scn.world;
 
-    world.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
-    world.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
+    auto red   = scn.materials.add<lambertian>(color(.65, .05, .05));
+    auto white = scn.materials.add<lambertian>(color(.73, .73, .73));
+    auto green = scn.materials.add<lambertian>(color(.12, .45, .15));
+    auto light = scn.materials.add<diffuse_light>(color(7, 7, 7));
 
-    camera cam;
+    world.add(scn.make<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(scn.make<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(scn.make<quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
+    world.add(scn.make<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    const hittable* box1 = box(scn.arena, point3(0,0,0), point3(165,330,165), white);
+    box1 = scn.make<rotate_y>(box1, 15);
+    box1 = scn.make<translate>(box1, vec3(265,0,295));
+
+    const hittable* box2 = box(scn.arena, point3(0,0,0), point3(165,165,165), white);
+    box2 = scn.make<rotate_y>(box2, -18);
+    box2 = scn.make<translate>(box2, vec3(130,0,65));
+
+    world.add(scn.make<constant_medium>(box1, 0.01, scn.materials.add<isotropic>(color(0,0,0))));
+    world.add(scn.make<constant_medium>(box2, 0.01, scn.materials.add<isotropic>(color(1,1,1))));
 
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 600;
@@ -358,13 +606,77 @@ void cornell_smoke() {
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
+}
 
-    cam.render(world);
+density_grid* smoke_grid(scene& scn, int n) {
+    // Loads smoke_<version>_<n>.raw (n^3 floats) if it exists. Otherwise bakes a few sparse
+    // puffs of turbulent smoke and saves them there, so later runs take the file loading path.
+    // Bump smoke_version when the baking below changes, so old files are not picked up.
+    const int smoke_version = 1;
+    auto file = "smoke_" + std::to_string(smoke_version) + "_" + std::to_string(n) + ".raw";
+    auto grid = scn.make<density_grid>();
+    if (grid->load_raw(file, n, n, n))
+        return grid;
+
+    grid->resize(n, n, n);
+    perlin noise;
+    point3 puffs[] = { point3(0.3, 0.25, 0.35), point3(0.65, 0.55, 0.6), point3(0.4, 0.8, 0.5) };
+    for (int z = 0; z < n; z++)
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < n; x++) {
+                auto p = point3(x + 0.5, y + 0.5, z + 0.5) / n;
+                double d = 0;
+                for (const auto& c : puffs) {
+                    auto falloff = 1 - (p - c).length() / 0.2;
+                    if (falloff > 0)
+                        d += falloff * noise.turb(6 * p, 5);
+                }
+                grid->set(x, y, z, float(d));
+            }
+    grid->build_majorants();
+    grid->save_raw(file);
+    return grid;
 }
 
-void final_scene(int image_width, int samples_per_pixel, int max_depth) {
+void cornell_smoke_grid(scene& scn, camera& cam) {
+    // cornell_smoke with the two constant density boxes replaced by one box of sparse,
+    // heterogeneous smoke. Used to benchmark the majorant grid.
+    auto& world = scn.world;
+
+    auto red   = scn.materials.add<lambertian>(color(.65, .05, .05));
+    auto white = scn.materials.add<lambertian>(color(.73, .73, .73));
+    auto green = scn.materials.add<lambertian>(color(.12, .45, .15));
+    auto light = scn.materials.add<diffuse_light>(color(7, 7, 7));
+
+    world.add(scn.make<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(scn.make<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(scn.make<quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
+    world.add(scn.make<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(scn.make<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    auto smoke_bounds = aabb(point3(80,0,80), point3(480,480,480));
+    world.add(scn.make<heterogeneous_medium>(smoke_bounds, smoke_grid(scn, 64), 0.3, scn.materials.add<isotropic>(color(.8,.8,.8))));
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 200;
+    cam.max_depth         = 50;
+    cam.background        = color(0,0,0);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
+
+void final_scene(scene& scn, camera& cam, int image_width, int samples_per_pixel, int max_depth) {
+    auto& world = scn.world;
+
     hittable_list boxes1;
-    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    auto ground = scn.materials.add<lambertian>(color(0.48, 0.83, 0.53));
 
     int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
@@ -377,53 +689,49 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
             auto y1 = random_double(1,101);
             auto z1 = z0 + w;
 
-            boxes1.add(box(point3(x0,y0,z0), point3(x1,y1,z1), ground));
+            boxes1.add(box(scn.arena, point3(x0,y0,z0), point3(x1,y1,z1), ground));
         }
     }
 
-    hittable_list world;
-
-    world.add(make_shared<bvh_node>(boxes1));
+    world.add(scn.make<bvh_node>(boxes1, scn.arena));
 
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
-    world.add(make_shared<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
+    auto light = scn.materials.add<diffuse_light>(color(7, 7, 7));
+    world.add(scn.make<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
 
     auto center1 = point3(400, 400, 200);
     auto center2 = center1 + vec3(30,0,0);
-    auto sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    world.add(make_shared<sphere>(center1, center2, 50, sphere_material));
+    auto sphere_material = scn.materials.add<lambertian>(color(0.7, 0.3, 0.1));
+    world.add(scn.make<sphere>(center1, center2, 50, sphere_material));
 
-    world.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    world.add(make_shared<sphere>(
-        point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
+    world.add(scn.make<sphere>(point3(260, 150, 45), 50, scn.materials.add<dielectric>(1.5)));
+    world.add(scn.make<sphere>(
+        point3(0, 150, 145), 50, scn.materials.add<metal>(color(0.8, 0.8, 0.9), 1.0)
     ));
 
-    auto boundary = make_shared<sphere>(point3(360,150,145), 70, make_shared<dielectric>(1.5));
+    auto boundary = scn.make<sphere>(point3(360,150,145), 70, scn.materials.add<dielectric>(1.5));
     world.add(boundary);
-    world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0,0,0), 5000, make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, .0001, color(1,1,1)));
+    world.add(scn.make<constant_medium>(boundary, 0.2, scn.materials.add<isotropic>(color(0.2, 0.4, 0.9))));
 
-    auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-    world.add(make_shared<sphere>(point3(400,200,400), 100, emat));
-    auto pertext = make_shared<noise_texture>(0.2);
-    world.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
+    auto emat = scn.materials.add<lambertian>(scn.textures.add<paged_texture>("earthmap.jpg"));
+    world.add(scn.make<sphere>(point3(400,200,400), 100, emat));
+    auto pertext = scn.textures.add<noise_texture>(0.2);
+    world.add(scn.make<sphere>(point3(220,280,300), 80, scn.materials.add<lambertian>(pertext)));
 
     hittable_list boxes2;
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto white = scn.materials.add<lambertian>(color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
+        boxes2.add(scn.make<sphere>(point3::random(0,165), 10, white));
     }
 
-    world.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2), 15),
+    world.add(scn.make<translate>(
+        scn.make<rotate_y>(
+            scn.make<bvh_node>(boxes2, scn.arena), 15),
             vec3(-100,270,395)
         )
     );
 
-    camera cam;
+    world = hittable_list(scn.make<bvh_node>(world, scn.arena));
 
     cam.aspect_ratio      = 1.0;
     cam.image_width       = image_width;
@@ -431,28 +739,72 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     cam.max_depth         = max_depth;
     cam.background        = color(0,0,0);
 
+    // Thin fog over the whole scene
+    cam.atmosphere_density = .0001;
+    cam.atmosphere_albedo  = color(1,1,1);
+    cam.atmosphere_radius  = 5000;
+
     cam.vfov     = 40;
     cam.lookfrom = point3(478, 278, -600);
     cam.lookat   = point3(278, 278, 0);
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-
-    cam.render(world);
 }
 
 
-int main()
+bool render_scene(const std::function<void(scene&, camera&)>& build) {
+    // Builds a scene and renders it once; false if the image could not be written
+    scene scn;
+    camera cam;
+    build(scn, cam);
+    scn.collect_lights();
+    return cam.render(scn);
+}
+
+int main(int argc, char* argv[])
 {
-    // world_1();
-    // world_2();
-    // world_2_checkered_spheres();
-    // earth();
-    // perlin_spheres();
-    // quads();
-    // simple_light();
-    cornell_box();
-    // cornell_smoke();
-    // final_scene(800, 1000, 50);
-    return 0;
+    if (argc > 1) {
+        // A job file (see utils/render_queue.h): many renders of these scenes in one process
+        render_queue queue;
+        queue.add_scene("world_1", world_1);
+        queue.add_scene("world_2", world_2);
+        queue.add_scene("world_2_checkered_spheres", world_2_checkered_spheres);
+        queue.add_scene("earth", earth);
+        queue.add_scene("perlin_spheres", perlin_spheres);
+        queue.add_scene("quads", quads);
+        queue.add_scene("simple_light", simple_light);
+        queue.add_scene("motion_blur", motion_blur);
+        queue.add_scene("glossy_plates", glossy_plates);
+        queue.add_scene("sky_lit", sky_lit);
+        queue.add_scene("city_lights", city_lights);
+        queue.add_scene("cornell_box", cornell_box);
+        queue.add_scene("cornell_glass", cornell_glass);
+        queue.add_scene("light_leak", light_leak);
+        queue.add_scene("cornell_smoke", cornell_smoke);
+        queue.add_scene("cornell_smoke_grid", cornell_smoke_grid);
+        queue.add_scene("final_scene", [](scene& scn, camera& cam) { final_scene(scn, cam, 800, 1000, 50); });
+        return queue.run(argv[1]) ? 0 : 1;
+    }
+
+    bool written = true;
+    // written = render_scene(world_1);
+    // written = render_scene(world_2);
+    // written = render_scene(world_2_checkered_spheres);
+    // written = render_scene(earth);
+    // written = render_scene(perlin_spheres);
+    // written = render_scene(quads);
+    // written = render_scene(simple_light);
+    // written = render_scene(motion_blur);
+    // written = render_scene(glossy_plates);
+    // written = render_scene(sky_lit);
+    // written = render_scene(city_lights);
+    written = render_scene(cornell_box);
+    // written = render_scene(cornell_glass);
+    // written = render_scene(light_leak);
+    // written = render_scene(cornell_smoke);
+    // written = render_scene(cornell_smoke_grid);
+    // written = render_scene([](scene& scn, camera& cam) { final_scene(scn, cam, 800, 1000, 50); });
+    // written = render_scene([](scene& scn, camera& cam) { load_scene_file("scenes/cornell_box.txt", scn, cam); });
+    return written ? 0 : 1;
 }
@@ -102,5 +102,14 @@ aabb operator+(const vec3& offset, const aabb& bbox) {
     return bbox + offset;
 }
 
+aabb lerp(const aabb& a, const aabb& b, double t) {
+    // Box whose bounds are linearly interpolated from a (t=0) to b (t=1). If the contents of
+    // a and b move linearly between the two, this bounds them at every t in between.
+    auto mix = [t](const interval& i0, const interval& i1) {
+        return interval(i0.min + t * (i1.min - i0.min), i0.max + t * (i1.max - i0.max));
+    };
+    return aabb(mix(a.x, b.x), mix(a.y, b.y), mix(a.z, b.z));
+}
+
 
 #endif
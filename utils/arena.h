@@ -0,0 +1,90 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <iostream>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class scene_arena {
+  // Bump allocator that owns every object in a scene: primitives, instances, BVH nodes and
+  // textures. Objects are placed one after another in large blocks, so a scene is a few
+  // contiguous regions instead of thousands of small heap blocks with reference counts, and
+  // BVH nodes built together end up next to each other in memory.
+  //
+  // make() returns a plain typed pointer. Blocks never move, so it stays valid until the arena
+  // is destroyed, which runs the objects' destructors (newest first) and frees everything.
+  public:
+    explicit scene_arena(size_t block_size = 256 * 1024) : block_size(block_size) {}
+
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    ~scene_arena() {
+        for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+            it->destroy(it->object);
+        for (auto& b : blocks)
+            ::operator delete(b.data, std::align_val_t(block_align));
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible<T>::value)
+            destructors.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+        return object;
+    }
+
+    void* allocate(size_t size, size_t align) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || offset + size > blocks.back().size) {
+            // Objects bigger than a block get a block of their own
+            size_t bytes = size + align > block_size ? size + align : block_size;
+            blocks.push_back({static_cast<std::byte*>(::operator new(bytes, std::align_val_t(block_align))), bytes});
+            reserved += bytes;
+            offset = 0;
+        }
+        used = offset + size;
+        allocated += size;
+        count++;
+        return blocks.back().data + offset;
+    }
+
+    size_t allocations() const { return count; }
+    size_t bytes_allocated() const { return allocated; }
+    size_t bytes_reserved() const { return reserved; }
+
+    void report(std::ostream& out) const {
+        // Printed with the render counters, so only in RT_STATS builds (see stats.h)
+#ifdef RT_STATS
+        out << "Scene objects:       " << count << " in " << blocks.size() << " block(s)\n"
+            << "Scene memory:        " << allocated / 1024 << " KB used, "
+            << reserved / 1024 << " KB reserved\n";
+#endif
+    }
+
+  private:
+    static const size_t block_align = 64;  // Cache line; covers the 32 byte aligned vec3
+
+    struct block {
+        std::byte* data;
+        size_t size;
+    };
+
+    struct destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    size_t block_size;
+    std::vector<block> blocks;
+    std::vector<destructor> destructors;
+    size_t used = 0;       // Bytes used in the newest block
+    size_t allocated = 0;  // Bytes handed out, over all blocks
+    size_t reserved = 0;
+    size_t count = 0;
+};
+
+#endif
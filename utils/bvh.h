@@ -6,18 +6,21 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "arena.h"
+#include "stats.h"
 
 #include <algorithm>
 
 class bvh_node : public hittable
 { // Bounding volume hierarchy
 public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
+    // Child nodes are allocated in arena, depth first, so a subtree sits in one stretch of memory
+    bvh_node(hittable_list list, scene_arena &arena) : bvh_node(list.objects, 0, list.objects.size(), arena)
     {
         // Implicit copy of hittable list
     }
 
-    bvh_node(std::vector<shared_ptr<hittable>> &objects, size_t start, size_t end)
+    bvh_node(std::vector<const hittable*> &objects, size_t start, size_t end, scene_arena &arena)
     {
         //Choose longest axis
         bbox = aabb::empty;
@@ -42,16 +45,29 @@ public:
             std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
             auto mid = start+object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            left = arena.make<bvh_node>(objects, start, mid, arena);
+            right = arena.make<bvh_node>(objects, mid, end, arena);
         }
 
         // bbox = aabb(left->bounding_box(), right->bounding_box());
+
+        // If anything below moves, also keep the bounds at each time key. Between keys the node
+        // bounds are interpolated, which stays conservative for linear motion.
+        moving = left->has_motion() || right->has_motion();
+        depth = std::max(left->instance_depth(), right->instance_depth());
+        if (moving) {
+            for (int k = 0; k < time_keys; k++) {
+                auto time = double(k) / (time_keys - 1);
+                key_bbox[k] = aabb(left->bounding_box_at(time), right->bounding_box_at(time));
+            }
+        }
     }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     { // return hit in which subtree
-        if (!bbox.hit(r, ray_t))
+        RT_STAT(bvh_node_visits);
+
+        if (moving ? !bounding_box_at(r.time()).hit(r, ray_t) : !bbox.hit(r, ray_t))
             return false;
 
         bool hit_left = left->hit(r, ray_t, rec);
@@ -62,28 +78,54 @@ public:
 
     aabb bounding_box() const override { return bbox; }
 
+    void collect_lights(light_list& lights) const override {
+        left->collect_lights(lights);
+        if (right != left)
+            right->collect_lights(lights);
+    }
+
+    bool has_motion() const override { return moving; }
+
+    int instance_depth() const override { return depth; }
+
+    aabb bounding_box_at(double time) const override
+    {
+        if (!moving)
+            return bbox;
+
+        // Find the time segment and blend its two key boxes
+        auto segment_time = interval(0, 1).clamp(time) * (time_keys - 1);
+        int k = std::min(int(segment_time), time_keys - 2);
+        return lerp(key_bbox[k], key_bbox[k + 1], segment_time - k);
+    }
+
 private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
+    static const int time_keys = 5; // Bounds kept at times 0, 1/4, 1/2, 3/4 and 1
+
+    const hittable* left;
+    const hittable* right;
+    aabb bbox;     // Bounds over the whole shutter interval
+    bool moving = false;
+    int depth;     // Of instances below
+    aabb key_bbox[time_keys];
 
     static bool box_compare(
-        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
+        const hittable* a, const hittable* b, int axis_index
     ) {
         auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
         auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
         return a_axis_interval.min < b_axis_interval.min;
     }
 
-    static bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool box_x_compare (const hittable* a, const hittable* b) {
         return box_compare(a, b, 0);
     }
 
-    static bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool box_y_compare (const hittable* a, const hittable* b) {
         return box_compare(a, b, 1);
     }
 
-    static bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool box_z_compare (const hittable* a, const hittable* b) {
         return box_compare(a, b, 2);
     }
 };
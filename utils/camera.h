@@ -4,10 +4,28 @@
 #include "rtweekend.h"
 
 #include "color.h"
+#include "denoise.h"
+#include "guiding.h"
 #include "hittable.h"
+#include "image_writer.h"
+#include "irradiance_cache.h"
 #include "material.h"
-
+#include "onb.h"
+#include "photon_map.h"
+#include "sampler.h"
+#include "scene.h"
+#include "stats.h"
+#include "texture_cache.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <string>
+#include <vector>
 
 class camera
 {
@@ -18,7 +36,14 @@ public:
     int image_width = 100;     // Width in pixels
     int samples_per_pixel = 10; // Number of samples per pixel
     int max_depth = 10; // Maximum number of bounces for each ray
-    color background = color(0, 0, 0); // Background color
+    color background = color(0, 0, 0); // Background color, for scenes without an environment light
+
+    // Global homogeneous atmosphere, sampled analytically along every ray instead of being
+    // a huge constant_medium in the BVH. It fills a sphere around atmosphere_center.
+    double atmosphere_density = 0.0; // Scattering events per unit length, 0 for no atmosphere
+    color atmosphere_albedo = color(1, 1, 1);
+    point3 atmosphere_center = point3(0, 0, 0);
+    double atmosphere_radius = infinity;
 
     double vfov = 90.0; // Vertical field of view in degrees
     point3 lookfrom = point3(0, 0, 0);
@@ -28,48 +53,108 @@ public:
     double defocus_angle = 0.0;
     double focus_dist = 10;
 
-    void render(const hittable &world)
+    // The part of the scene's time, 0 to 1, that the shutter is open for; rays get times in it
+    double shutter_open = 0.0;
+    double shutter_close = 1.0;
+
+    // Upper bound on the tiles the paged texture cache keeps (see texture_cache.h). The cache is
+    // shared by the whole process; each render sets it to its camera's.
+    int texture_memory_mb = 256;
+
+    // Where the image goes; with denoise, the unfiltered one goes next to it, as name_noisy.ppm
+    std::string output_file = "output.ppm";
+
+    // Where sample values come from (see sampler.h). samples_per_pixel is used as given.
+    sampler_type sample_pattern = sampler_type::sobol;
+    unsigned int seed = 0;
+
+    // Path guiding (see guiding.h). The samples are rendered in passes of 1, 2, 4, ... spp;
+    // every pass but the last also trains the guide the next one samples with. All passes
+    // count toward the image.
+    bool path_guiding = false;
+    double guiding_memory_mb = 64; // Upper bound on the guide's size
+
+    // Runs the finished image through the denoiser (see denoise.h), guided by the albedo,
+    // normal and depth of what each camera ray first hit. The unfiltered image is also kept
+    // (see output_file).
+    bool denoise = false;
+
+    // Caustics from a photon map (see photon_map.h), shot before rendering: the number of
+    // photons to shoot from the lights, 0 for none, and an upper bound on the map's size.
+    // Paths then no longer find lights through glass or mirrors once they have left a diffuse
+    // surface; the photon map accounts for that light. The map is kept for the next render of
+    // the same scene with the same settings.
+    size_t caustic_photons = 0;
+    double caustic_memory_mb = 64;
+
+    // Irradiance cache (see irradiance_cache.h), built before rendering. Paths that reach a
+    // diffuse surface after a diffuse bounce take the light arriving there from the cache
+    // instead of tracing on, wherever a record is close enough. A smaller error places records
+    // closer together; each record gathers irradiance_cache_rays rays.
+    bool irradiance_caching = false;
+    double irradiance_cache_error = 0.25;
+    int irradiance_cache_rays = 256;
+
+    bool render(const scene &scn)
     {
+        // Renders scn into output_file; false if the image could not be written
         initialize();
+        scn.textures.finish_loading();
+        texture_cache::shared().set_memory_limit(size_t(texture_memory_mb) * 1024 * 1024);
         
-        freopen("output.ppm", "w", stdout); // Redirects the output to a file
-        std::cout << "P3\n"
-                  << image_width << ' ' << image_height << "\n255\n"; //I have no idea what P3 means for ppm but it works
+        // Rows are written out by the writer's thread as they are finished (see image_writer.h)
+        image_writer out(output_file, image_width, image_height);
+
+        auto smp = make_sampler(sample_pattern, samples_per_pixel, seed);
+        photon_settings wanted = { scn.serial, caustic_photons, caustic_memory_mb, max_depth, shutter_open, shutter_close };
+        if (caustic_photons == 0) {
+            caustics.reset();
+        } else if (!caustics || !(caustics_settings == wanted)) {
+            std::clog << "Shooting photons..." << std::flush;
+            caustics = std::make_unique<photon_map>(
+                scn, caustic_photons, size_t(caustic_memory_mb * 1024 * 1024), max_depth, shutter_open, shutter_close);
+            caustics_settings = wanted;
+            std::clog << "\rCaustic photons: " << caustics->size() << " kept of " << caustics->landed()
+                      << ", " << caustics->bytes() / 1024 << " KB\n";
+        }
+        if (irradiance_caching)
+            build_irradiance_cache(scn);
+        if (denoise)
+            filter = std::make_unique<denoiser>(image_width, image_height);
+
+        if (path_guiding) {
+            auto written = render_guided(scn, *smp, out);
+            return finish_render(scn, out) && written;
+        }
 
+        std::vector<color> image;
         for (int j = 0; j < image_height; ++j)
         {
             std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush; //progress
+            std::vector<color> row(image_width);
             for (int i = 0; i < image_width; ++i)
             {
 
                 color pixel_color(0, 0, 0); //Get the color of the pixel
 
-                //stratify the ray location
-                for(int s_j = 0; s-j < sqrt_spp; s_j++){
-                    for (int s_i = 0; s_i < sqrt_spp; s_i++) {
-                        ray r = get_ray(i, j, s_i, s_j);
-                        pixel_color += ray_color(r, max_depth, world);
-                    }
-                }
-
-                //Non stratified
-                // for (int sample = 0; sample < samples_per_pixel; ++sample){
-                //     ray r = get_ray(i,j);
-                //     pixel_color += ray_color(r, max_depth, world);
-                // }
+                for (int sample = 0; sample < samples_per_pixel; ++sample)
+                    pixel_color += sample_pixel(i, j, sample, scn, *smp);
 
-                write_color(std::cout, pixel_color, samples_per_pixel);
+                row[i] = pixel_color;
             }
+
+            if (filter)
+                image.insert(image.end(), row.begin(), row.end()); // Written once the whole image is there
+            else
+                out.add_rows(j, std::move(row), samples_per_pixel);
         }
 
-        std::clog << "\rDone.                 \n";
+        auto written = filter ? write_image(std::move(image), out) : true;
+        return finish_render(scn, out) && written;
     }
 
 private:
     int image_height;
-    double pixel_samples_scale;
-    int    sqrt_spp;             // Square root of number of samples per pixel
-    double recip_sqrt_spp;       // 1 / sqrt_spp
     point3 center;
     point3 pixel00_loc;
     vec3 pixel_delta_u;
@@ -79,15 +164,281 @@ private:
     vec3 defocus_disk_u;
     vec3 defocus_disk_v;
 
+    std::unique_ptr<guiding_tree> guide; // While rendering with path guiding
+    bool guide_training = false;         // Record paths into the guide
+    std::unique_ptr<denoiser> filter;    // While rendering with denoise
+    std::unique_ptr<photon_map> caustics; // While rendering with caustic photons, and until the scene or settings change
+
+    struct photon_settings {
+        // What the photon map was shot for
+        std::uint64_t scene_serial;
+        size_t photons;
+        double memory_mb;
+        int depth;
+        double shutter_open, shutter_close;
+
+        bool operator==(const photon_settings& o) const {
+            return scene_serial == o.scene_serial && photons == o.photons && memory_mb == o.memory_mb && depth == o.depth
+                && shutter_open == o.shutter_open && shutter_close == o.shutter_close;
+        }
+    };
+    photon_settings caustics_settings = {};
+    std::unique_ptr<irradiance_cache> irradiance; // While rendering with irradiance caching
+
+    struct first_hit {
+        // What a camera ray first hit, for the denoiser. Mirrors and glass are looked through:
+        // the albedo, normal and emission are those of what they show, tinted by them. Light
+        // from the environment counts as emitted by nothing: black albedo, infinite depth.
+        color emitted = color(0,0,0);
+        color albedo = color(0,0,0);
+        vec3 normal = vec3(0,0,0);
+        double depth = infinity;
+    };
+
+    struct ray_differential {
+        // Rays through the points next to a camera sample, toward the next pixel right and
+        // down, for the footprint of the sample on what it hits
+        ray dx, dy;
+    };
+
+    color sample_pixel(int i, int j, int sample, const scene &scn, sampler &smp) {
+        // Traces one camera sample of pixel (i, j), recording its first hit for the denoiser
+        smp.start_pixel_sample(i, j, sample);
+        ray_differential differential;
+        ray r = get_ray(i, j, smp, &differential);
+        if (!filter)
+            return ray_color(r, max_depth, scn, smp, 0, vec3(0,0,0), nullptr, false, &differential);
+
+        first_hit hit;
+        auto c = ray_color(r, max_depth, scn, smp, 0, vec3(0,0,0), &hit, false, &differential);
+        filter->add_sample(i, j, c, hit.emitted, hit.albedo, hit.normal, hit.depth);
+        return c;
+    }
+
+    bool write_image(std::vector<color> image, image_writer &out) {
+        // The summed samples of every pixel, in scanline order, denoised if asked for. Returns
+        // false if the unfiltered copy could not be written; out reports its own failure on close.
+        if (!filter) {
+            out.add_rows(0, std::move(image), samples_per_pixel);
+            return true;
+        }
+
+        // The unfiltered image is written while the denoiser runs
+        auto noisy_file = std::filesystem::path(output_file);
+        noisy_file.replace_filename(noisy_file.stem().string() + "_noisy" + noisy_file.extension().string());
+        image_writer noisy(noisy_file.string(), image_width, image_height);
+        noisy.add_rows(0, std::move(image), samples_per_pixel);
+
+        std::clog << "\rDenoising...                              " << std::flush;
+        out.add_rows(0, filter->filter(), 1);
+        filter.reset();
+        return noisy.close();
+    }
+
+    bool finish_render(const scene &scn, image_writer &out) {
+        auto written = out.close();
+        irradiance.reset();
+        std::clog << "\rDone.                 \n";
+        texture_cache::shared().report(std::clog);
+        stats::report(std::clog);
+        scn.arena.report(std::clog);
+        return written;
+    }
+
+    struct cache_point {
+        point3 p;
+        vec3 normal;
+    };
+
+    static constexpr size_t cache_candidates = 65536; // Points the cache's records are chosen from, about
+    static constexpr size_t cache_checks = 256;       // Of those, kept back to measure the cache's error
+
+    void build_irradiance_cache(const scene &scn) {
+        // Records go where camera paths make their second diffuse hit, which is where the cache
+        // is looked up. Candidate points are visited in random order, so the first records
+        // spread out, and in batches: a batch takes the candidates no record covers yet and
+        // gathers their irradiance in parallel. Gathering paths use the records of earlier
+        // batches in turn.
+        std::clog << "Building irradiance cache..." << std::flush;
+        irradiance = std::make_unique<irradiance_cache>(scn.world.bounding_box(), irradiance_cache_error);
+
+        auto candidates = find_cache_candidates(scn);
+        std::shuffle(candidates.begin(), candidates.end(), std::mt19937(seed));
+        auto checks = std::min(cache_checks, candidates.size() / 2);
+        std::vector<cache_point> check(candidates.end() - checks, candidates.end());
+        candidates.resize(candidates.size() - checks);
+
+        for (size_t next = 0; next < candidates.size();) {
+            std::vector<cache_point> batch;
+            auto batch_size = std::clamp<size_t>(irradiance->size() / 4, 64, 4096);
+            for (; next < candidates.size() && batch.size() < batch_size; next++)
+                if (!irradiance->covers(candidates[next].p, candidates[next].normal))
+                    batch.push_back(candidates[next]);
+
+            auto first = irradiance->size();
+            std::vector<color> irradiances(batch.size());
+            std::vector<double> distances(batch.size());
+            parallel_for(batch.size(), [&](size_t k) {
+                irradiances[k] = gather_irradiance(batch[k], 0, first + k, irradiance_cache_rays, scn, distances[k]);
+            });
+            for (size_t k = 0; k < batch.size(); k++)
+                irradiance->add(batch[k].p, batch[k].normal, irradiances[k], distances[k]);
+        }
+
+        // The error: how far the cache is from fresh estimates with more rays, at points it
+        // was not built from
+        std::vector<color> cached(check.size()), fresh(check.size());
+        std::vector<char> covered(check.size());
+        parallel_for(check.size(), [&](size_t k) {
+            covered[k] = irradiance->lookup(check[k].p, check[k].normal, cached[k]);
+            double unused;
+            if (covered[k])
+                fresh[k] = gather_irradiance(check[k], 1, k, 4 * irradiance_cache_rays, scn, unused);
+        });
+        double error = 0;
+        int measured = 0;
+        for (size_t k = 0; k < check.size(); k++) {
+            if (!covered[k] || luminance(fresh[k]) <= 0)
+                continue;
+            error += std::fabs(luminance(cached[k]) - luminance(fresh[k])) / luminance(fresh[k]);
+            measured++;
+        }
+
+        std::clog << "\rIrradiance cache: " << irradiance->size() << " records, " << irradiance->bytes() / 1024
+                  << " KB, " << (measured ? 100 * error / measured : 0.0) << "% mean error at "
+                  << measured << " points\n";
+    }
+
+    std::vector<cache_point> find_cache_candidates(const scene &scn) const {
+        // Follows camera paths through mirrors and glass to their first hit that is not
+        // specular, bounces once, and keeps the next hit if it is diffuse
+        std::vector<cache_point> out;
+        auto pixels = size_t(image_width) * image_height;
+        auto per_pixel = int(std::max<size_t>(1, cache_candidates / pixels));
+        sobol_sampler smp(per_pixel, seed);
+        for (int j = 0; j < image_height; ++j) {
+            for (int i = 0; i < image_width; ++i) {
+                for (int sample = 0; sample < per_pixel; ++sample) {
+                    smp.start_pixel_sample(i, j, sample);
+                    ray r = get_ray(i, j, smp);
+                    bool bounced = false;
+                    for (int depth = 0; depth < max_depth; depth++) {
+                        hit_record rec;
+                        if (!scn.world.hit(r, interval(0.001, infinity), rec))
+                            break;
+                        finalize_hit(r, rec);
+                        const material &mat = scn.materials[rec.mat];
+                        if (bounced) {
+                            if (mat.is_diffuse())
+                                out.push_back(cache_point{rec.p, rec.normal});
+                            break;
+                        }
+                        scatter_record srec;
+                        auto uc = smp.get_1d();
+                        if (!mat.sample(r, rec, uc, smp.get_2d(), srec))
+                            break;
+                        bounced = !srec.is_specular;
+                        r = srec.scattered;
+                    }
+                }
+            }
+        }
+        return out;
+    }
+
+    color gather_irradiance(
+        const cache_point &c, int stream, size_t index, int rays, const scene &scn, double &harmonic_distance
+    ) const {
+        // Irradiance at c from cosine distributed rays, with the lights sampled as a white
+        // diffuse surface there would. Also returns the harmonic mean distance of what the rays
+        // hit. stream and index pick the sample values.
+        const material white(std::in_place_type<lambertian>, color(1,1,1));
+        hit_record rec;
+        rec.p = c.p;
+        rec.normal = c.normal;
+        rec.front_face = true;
+        onb basis(c.normal);
+        bool sample_lights = !scn.lights.empty();
+        sobol_sampler smp(rays, seed);
+
+        color sum(0,0,0);
+        double inverse_distance = 0;
+        for (int k = 0; k < rays; k++) {
+            smp.start_pixel_sample(int(index), stream, k);
+            auto bs = draw_bounce_samples(smp);
+            ray arriving(c.p + c.normal, -c.normal, smp.get_1d()); // Only its time matters
+            if (sample_lights)
+                sum += sample_light(arriving, rec, white, scn, bs, nullptr);
+
+            auto direction = basis.transform(sample_cosine_hemisphere(bs.scatter));
+            first_hit seen;
+            sum += ray_color(ray(c.p, direction, arriving.time()), max_depth - 1, scn, smp,
+                             sample_lights ? white.pdf(arriving, rec, direction) : 0, c.normal, &seen,
+                             false, nullptr, true);
+            inverse_distance += 1 / seen.depth;
+        }
+        if (caustics)
+            sum += rays * caustics->radiance(ray(c.p + c.normal, -c.normal, 0.0), rec, white);
+
+        harmonic_distance = inverse_distance > 0 ? rays / inverse_distance : infinity;
+        return sum * (pi / rays); // Radiance off a white diffuse surface is irradiance over pi
+    }
+
+    template <typename F>
+    static void parallel_for(size_t n, const F &f) {
+        // f(0) .. f(n - 1), spread over the shared thread pool
+        auto workers = thread_pool::shared().size();
+        std::vector<std::future<void>> jobs;
+        for (size_t w = 0; w < std::min(workers, n); w++)
+            jobs.push_back(thread_pool::shared().submit([&, w] {
+                for (auto k = w; k < n; k += workers)
+                    f(k);
+            }));
+        for (auto& job : jobs)
+            job.get();
+    }
+
+    bool render_guided(const scene &scn, sampler &smp, image_writer &out) {
+        auto bounds = scn.world.bounding_box();
+        guide = std::make_unique<guiding_tree>(bounds, size_t(guiding_memory_mb * 1024 * 1024));
+
+        std::vector<color> image(size_t(image_width) * image_height, color(0,0,0));
+        int done = 0;
+        for (int pass_spp = 1; done < samples_per_pixel; pass_spp *= 2) {
+            // The last pass takes whatever is left, if doubling again would overshoot
+            auto remaining = samples_per_pixel - done;
+            auto n = (remaining - pass_spp < 2 * pass_spp) ? remaining : pass_spp;
+            guide_training = done + n < samples_per_pixel;
+
+            for (int j = 0; j < image_height; ++j) {
+                std::clog << "\rGuided pass of " << n << " spp, scanlines remaining: "
+                          << (image_height - j) << ' ' << std::flush;
+                for (int i = 0; i < image_width; ++i) {
+                    for (int sample = done; sample < done + n; ++sample)
+                        image[size_t(j) * image_width + i] += sample_pixel(i, j, sample, scn, smp);
+                }
+            }
+
+            if (guide_training)
+                guide->refine(n);
+            done += n;
+        }
+
+        std::clog << "\rPath guiding: " << guide->leaf_count() << " regions, "
+                  << guide->bytes() / 1024 << " KB                    \n";
+        guide.reset();
+        guide_training = false;
+
+        return write_image(std::move(image), out);
+    }
+
     void initialize()
     {
         // Calculate the camera basis vectors.
         image_height = static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
-        sqrt_spp = int(sqrt(samples_per_pixel));
-        pixel_samples_scale = 1.0 / (sqrt_spp * sqrt_spp);
-        recip_sqrt_spp = 1.0 / sqrt_spp;
+        samples_per_pixel = (samples_per_pixel < 1) ? 1 : samples_per_pixel;
 
         center = lookfrom;
 
@@ -117,64 +468,367 @@ private:
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
     }
-    point3 defocus_disk_sample() const {
-        // Returns a random point in the camera defocus disk
-        auto p = random_in_unit_disk();
+    point3 defocus_disk_sample(const point2& sample) const {
+        // Returns the point of the camera defocus disk that sample maps to
+        auto p = sample_concentric_disk(sample);
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
-    color ray_color(const ray &r, int depth, const hittable &world) const
+
+    struct bounce_samples {
+        // Sample values for one bounce. Every bounce draws all of them, used or not, so each
+        // decision keeps its own sampler dimension whatever happened earlier on the path.
+        double atmosphere;      // free flight distance in the atmosphere
+        double light_pick;      // which light to sample
+        point2 light;           // point on that light
+        double shadow;          // atmosphere along the shadow ray
+        double scatter_choice;  // discrete choice in the material (reflect or refract)
+        point2 scatter;         // scattered direction
+    };
+
+    static bounce_samples draw_bounce_samples(sampler& smp) {
+        bounce_samples bs;
+        bs.atmosphere = smp.get_1d();
+        bs.light_pick = smp.get_1d();
+        bs.light = smp.get_2d();
+        bs.shadow = smp.get_1d();
+        bs.scatter_choice = smp.get_1d();
+        bs.scatter = smp.get_2d();
+        return bs;
+    }
+
+    color ray_color(
+        const ray &r, int depth, const scene &scn, sampler &smp,
+        double scatter_pdf = 0, const vec3 &scatter_normal = vec3(0,0,0), first_hit *features = nullptr,
+        bool caustic_path = false, const ray_differential *differential = nullptr,
+        bool after_diffuse = false
+    ) const
     {
+        // scatter_pdf is the solid angle density the previous hit sampled r with, when that hit
+        // also sampled the light list directly. Lights found by r are then weighted against the
+        // light sample (multiple importance sampling). It is 0 after the camera, specular
+        // bounces and the atmosphere, where r is the only way to find a light. scatter_normal
+        // is the previous hit's normal, which the light choice there depended on. features, for
+        // camera rays, receives what the ray hit. caustic_path is set on rays that left a diffuse
+        // surface and have only passed mirrors and glass since: the photon map already holds the
+        // light they could find. differential, for camera rays, sizes texture lookups at the hit.
+        // after_diffuse is set on rays scattered by a bounce that was not specular, past which
+        // the irradiance cache may stand in for the rest of the path.
         hit_record rec;
         // if exceed bounce limit, no more light is gathered
         if (depth <= 0)
             return color(0,0,0);
 
-        if (!world.hit(r, interval(0.001, infinity), rec))
-            return background;
-            
-        // if hit something, scatter the ray based on material, does not scatter if the bounce is too close
+        auto bs = draw_bounce_samples(smp);
+
+        RT_STAT(rays);
+        bool hit_surface = scn.world.hit(r, interval(0.001, infinity), rec);
+
+        // The ray may scatter in the atmosphere before it reaches the surface (or escapes)
         ray scattered;
         color attenuation;
-        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
-        if (!rec.mat->scatter(r, rec, attenuation, scattered))
-            return color_from_emission;
+        if (sample_atmosphere(r, hit_surface ? rec.t : infinity, bs.atmosphere, bs.scatter, attenuation, scattered)) {
+            if (features) {
+                features->albedo = attenuation;
+                features->depth = (scattered.origin() - r.origin()).length();
+            }
+            return attenuation * ray_color(scattered, depth - 1, scn, smp);
+        }
 
-        color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
-        return color_from_emission + color_from_scatter;
+        if (!hit_surface) {
+            auto c = environment_color(r, scn, scatter_pdf);
+            if (features)
+                features->emitted = c;
+            return c;
+        }
+
+        // Traversal only found the closest hit; fill in its point, normal, uv and material
+        finalize_hit(r, rec);
+        if (differential && scn.textures.filtered() && !rec.normal.near_zero())
+            texture_footprint(*differential, rec);
+
+        // if hit something, scatter the ray based on material, does not scatter if the bounce is too close
+        const material &mat = scn.materials[rec.mat];
+        color color_from_emission = mat.emitted(rec.u, rec.v, rec.p);
+        if (features) {
+            features->emitted = color_from_emission;
+            features->albedo = mat.albedo_at(rec);
+            features->normal = rec.normal;
+            features->depth = rec.t * r.direction().length();
+        }
+        if (scatter_pdf > 0 && rec.inst_depth == 0 && scn.lights.contains(rec.prim)) {
+            auto light_pdf = scn.lights.probability(rec.prim, r.origin(), scatter_normal)
+                           * rec.prim->pdf_value(r.origin(), r.direction(), r.time());
+            color_from_emission *= power_heuristic(scatter_pdf, light_pdf);
+        }
+        if (caustic_path && rec.inst_depth == 0 && scn.lights.contains(rec.prim))
+            color_from_emission = color(0,0,0);
+
+        if (irradiance && after_diffuse && mat.is_diffuse()) {
+            // Past a diffuse bounce, the cache stands in for the rest of the path where it can
+            RT_STAT(cache_lookups);
+            color cached;
+            if (irradiance->lookup(rec.p, rec.normal, cached)) {
+                RT_STAT(cache_hits);
+                return color_from_emission + mat.albedo_at(rec) * cached / pi;
+            }
+        }
+
+        const directional_tree* guide_here = guide ? guide->sampling_at(rec.p) : nullptr;
+
+        scatter_record srec;
+        srec.is_specular = false; // Materials that absorb every ray leave it unset
+        bool scatters = sample_scatter(r, rec, mat, guide_here, bs, srec);
+
+        if (srec.is_specular) {
+            if (!scatters) // A mirror direction below the surface
+                return color_from_emission;
+            // Coming off a surface (not a medium) that sampled lights, or already on a caustic path
+            bool through = caustics && (caustic_path || (scatter_pdf > 0 && !scatter_normal.near_zero()));
+            if (!features)
+                return color_from_emission
+                     + srec.attenuation * ray_color(srec.scattered, depth - 1, scn, smp, 0, vec3(0,0,0), nullptr, through);
+            first_hit seen;
+            auto incoming = ray_color(srec.scattered, depth - 1, scn, smp, 0, vec3(0,0,0), &seen, through);
+            features->emitted += srec.attenuation * seen.emitted;
+            features->albedo = srec.attenuation * seen.albedo;
+            features->normal = seen.normal;
+            return color_from_emission + srec.attenuation * incoming;
+        }
+
+        // Direct lighting, only where the scattered ray could still have reached a light. It does
+        // not depend on the material's own sample, so it counts even where that was absorbed (a
+        // fuzzy metal sample below the surface): the MIS weights assume both strategies always run.
+        bool sample_lights = !scn.lights.empty() && depth > 1;
+        color color_from_lights = sample_lights ? sample_light(r, rec, mat, scn, bs, guide_here) : color(0,0,0);
+        if (caustics && !rec.normal.near_zero())
+            color_from_lights += caustics->radiance(r, rec, mat);
+
+        if (!scatters || srec.attenuation.near_zero()) // Absorbed, or a guided direction into the surface
+            return color_from_emission + color_from_lights;
+
+        color incoming =
+            ray_color(srec.scattered, depth - 1, scn, smp, sample_lights ? srec.pdf : 0, rec.normal,
+                      nullptr, false, nullptr, true);
+        if (guide_training)
+            guide->record(rec.p, srec.scattered.direction(), luminance(incoming) / srec.pdf);
+
+        return color_from_emission + color_from_lights + srec.attenuation * incoming;
     }
 
-    ray get_ray(int i, int j) const { // i is the horizontal pixel index, j is the vertical pixel index
-        // Construct a camera ray originating from the defocus disk and directed at a randomly
-        // sampled point around the pixel location i, j for stratified sample square s_i, s_j.
+    static constexpr double guide_bsdf_fraction = 0.5; // Share of guided directions left to the material
+
+    bool sample_scatter(
+        const ray& r, const hit_record& rec, const material& mat, const directional_tree* guide_here,
+        const bounce_samples& bs, scatter_record& srec
+    ) const {
+        // The material's own sampling, or where a guide has been learned, a mixture of it and
+        // the guide. Mixture directions are weighted by the material's eval() over the mixture
+        // density. Specular scattering is never guided.
+        if (!guide_here)
+            return mat.sample(r, rec, bs.scatter_choice, bs.scatter, srec);
+
+        auto use_material = bs.scatter_choice < guide_bsdf_fraction;
+        auto uc = use_material ? bs.scatter_choice / guide_bsdf_fraction
+                               : (bs.scatter_choice - guide_bsdf_fraction) / (1 - guide_bsdf_fraction);
+        auto sampled = mat.sample(r, rec, uc, bs.scatter, srec);
+        if (sampled && srec.is_specular)
+            return true;
+        if (use_material && !sampled)
+            return false;
+
+        // A guided direction does not depend on the material's own sample, so it stands even
+        // where that failed (a fuzzy metal sample below the surface), as long as the material
+        // sends light along it. Dropping it would leave the guide's half of the mixture short.
+        if (!use_material)
+            srec.scattered = ray(rec.p, guide_here->sample(bs.scatter), r.time());
+        srec.is_specular = false;
+
+        auto direction = srec.scattered.direction();
+        srec.pdf = scatter_pdf(r, rec, mat, guide_here, direction);
+        if (srec.pdf <= 0)
+            return false;
+        srec.attenuation = mat.eval(r, rec, direction) / srec.pdf; // Zero where the guide points into the surface
+        return sampled || !srec.attenuation.near_zero();
+    }
 
-        auto offset = sample_square_stratified(s_i, s_j);
-        auto pixel_sample = pixel_center + pixel_sample_square();
+    double scatter_pdf(
+        const ray& r, const hit_record& rec, const material& mat, const directional_tree* guide_here,
+        const vec3& direction
+    ) const {
+        // Density sample_scatter() gives non-specular direction
+        if (!guide_here)
+            return mat.pdf(r, rec, direction);
+        return guide_bsdf_fraction * mat.pdf(r, rec, direction)
+             + (1 - guide_bsdf_fraction) * guide_here->pdf(direction);
+    }
 
-        // ray origin is center unless we have a defocus angle
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
-        auto ray_direction = unit_vector(pixel_sample - ray_origin);
+    color sample_light(
+        const ray& r, const hit_record& rec, const material& mat, const scene& scn, const bounce_samples& bs,
+        const directional_tree* guide_here
+    ) const {
+        // Next event estimation: picks a light, samples a direction toward it and traces a
+        // shadow ray. The light counts only if that ray reaches it; anything in between,
+        // including a scattering event in a medium or the atmosphere, blocks it.
+        double pick_probability;
+        const hittable* light = scn.lights.pick(bs.light_pick, rec.p, rec.normal, pick_probability);
+        if (pick_probability <= 0)
+            return color(0,0,0);
+        if (!light)
+            return sample_environment(r, rec, mat, scn, bs, guide_here, pick_probability);
 
-        // ray time is random between 0 and 1,
-        auto ray_time = random_double();
+        auto direction = light->random(rec.p, r.time(), bs.light);
+        auto light_pdf = pick_probability * light->pdf_value(rec.p, direction, r.time());
+        if (light_pdf <= 0)
+            return color(0,0,0);
 
-        return ray(ray_origin, ray_direction, ray_time);
+        color f = mat.eval(r, rec, direction);
+        if (f.near_zero())
+            return color(0,0,0);
+
+        RT_STAT(shadow_rays);
+        ray shadow(rec.p, direction, r.time());
+        hit_record light_rec;
+        if (!scn.world.hit(shadow, interval(0.001, infinity), light_rec))
+            return color(0,0,0);
+        if (light_rec.prim != light || light_rec.inst_depth != 0)
+            return color(0,0,0);
+
+        ray unused_ray;
+        color unused_color;
+        if (sample_atmosphere(shadow, light_rec.t, bs.shadow, bs.scatter, unused_color, unused_ray))
+            return color(0,0,0);
+
+        finalize_hit(shadow, light_rec);
+        color emitted = scn.materials[light_rec.mat].emitted(light_rec.u, light_rec.v, light_rec.p);
+
+        auto weight = power_heuristic(light_pdf, scatter_pdf(r, rec, mat, guide_here, direction));
+        if (guide_training)
+            guide->record(rec.p, direction, luminance(emitted) * weight / light_pdf);
+        return f * emitted * (weight / light_pdf);
+    }
+
+    color sample_environment(
+        const ray& r, const hit_record& rec, const material& mat, const scene& scn,
+        const bounce_samples& bs, const directional_tree* guide_here, double pick_probability
+    ) const {
+        // Next event estimation toward the environment: the shadow ray must leave the scene
+        double env_pdf;
+        auto direction = scn.environment->sample(bs.light, env_pdf);
+        auto light_pdf = pick_probability * env_pdf;
+        if (light_pdf <= 0)
+            return color(0,0,0);
+
+        color f = mat.eval(r, rec, direction);
+        if (f.near_zero())
+            return color(0,0,0);
+
+        RT_STAT(shadow_rays);
+        ray shadow(rec.p, direction, r.time());
+        hit_record unused_rec;
+        if (scn.world.hit(shadow, interval(0.001, infinity), unused_rec))
+            return color(0,0,0);
+
+        ray unused_ray;
+        color unused_color;
+        if (sample_atmosphere(shadow, infinity, bs.shadow, bs.scatter, unused_color, unused_ray))
+            return color(0,0,0);
+
+        auto weight = power_heuristic(light_pdf, scatter_pdf(r, rec, mat, guide_here, direction));
+        color emitted = scn.environment->value(direction);
+        if (guide_training)
+            guide->record(rec.p, direction, luminance(emitted) * weight / light_pdf);
+        return f * emitted * (weight / light_pdf);
+    }
+
+    color environment_color(const ray& r, const scene& scn, double scatter_pdf) const {
+        // What a ray that leaves the scene sees: the environment light if there is one, weighted
+        // against light sampling like an emitter hit, else the background color
+        if (!scn.environment)
+            return background;
+
+        color c = scn.environment->value(r.direction());
+        auto env_probability = scn.lights.environment_probability();
+        if (scatter_pdf > 0 && env_probability > 0)
+            c *= power_heuristic(scatter_pdf, env_probability * scn.environment->pdf(r.direction()));
+        return c;
     }
 
-    vec3 sample_square_stratified(int s_i, int s_j) const {
-        // Returns the vector to a random point in the square sub-pixel specified by grid
-        // indices s_i and s_j, for an idealized unit square pixel [-.5,-.5] to [+.5,+.5].
+    bool sample_atmosphere(
+        const ray& r, double t_max, double u_distance, const point2& u_direction,
+        color& attenuation, ray& scattered
+    ) const {
+        // Samples a free flight through the atmosphere up to t_max. If it ends first, returns an
+        // isotropic scatter from that point, like a constant_medium with an isotropic phase.
+        if (atmosphere_density <= 0)
+            return false;
+
+        auto span = interval(0.001, t_max);
+        if (atmosphere_radius < infinity) {
+            // Clip to the atmosphere sphere
+            vec3 oc = r.origin() - atmosphere_center;
+            auto a = r.direction().length_squared();
+            auto half_b = dot(oc, r.direction());
+            auto c = oc.length_squared() - atmosphere_radius * atmosphere_radius;
+            auto discriminant = half_b * half_b - a * c;
+            if (discriminant < 0)
+                return false;
+            auto sqrtd = sqrt(discriminant);
+            span = interval(fmax(span.min, (-half_b - sqrtd) / a), fmin(span.max, (-half_b + sqrtd) / a));
+            if (span.size() <= 0)
+                return false;
+        }
 
-        auto px = ((s_i + random_double()) * recip_sqrt_spp) - 0.5;
-        auto py = ((s_j + random_double()) * recip_sqrt_spp) - 0.5;
+        auto ray_length = r.direction().length();
+        auto hit_distance = -log(1 - u_distance) / atmosphere_density;
+        if (hit_distance > span.size() * ray_length)
+            return false;
 
-        return vec3(px, py, 0);
+        auto t = span.min + hit_distance / ray_length;
+        scattered = ray(r.at(t), sample_uniform_sphere(u_direction), r.time());
+        attenuation = atmosphere_albedo;
+        return true;
     }
 
-    vec3 pixel_sample_square() const {
-        // Returns a random point in the square surrounding a pixel at the origin.
-        auto px = -0.5 + random_double();
-        auto py = -0.5 + random_double();
-        return (px * pixel_delta_u) + (py * pixel_delta_v);
+    static void texture_footprint(const ray_differential& differential, hit_record& rec) {
+        // The extent in u and v around rec that the differential rays span, from where they
+        // hit the same primitive. One that misses it (past an edge) leaves it to the other.
+        for (const auto& offset : { differential.dx, differential.dy }) {
+            hit_record other;
+            if (!hit_again(offset, rec, other))
+                continue;
+            // The short way around, across the seam where a sphere's u wraps
+            auto du = std::fabs(other.u - rec.u), dv = std::fabs(other.v - rec.v);
+            rec.du = std::fmax(rec.du, std::fmin(du, 1 - du));
+            rec.dv = std::fmax(rec.dv, std::fmin(dv, 1 - dv));
+        }
+    }
+
+    ray get_ray(int i, int j, sampler& smp, ray_differential* differential = nullptr) const { // i is the horizontal pixel index, j is the vertical pixel index
+        // Construct a camera ray originating from the defocus disk and directed at a sampled
+        // point in the unit square pixel around location i, j, at a sampled time. The
+        // differential rays are a pixel apart at one sample per pixel, and closer with more:
+        // the samples filter between them.
+
+        auto offset = smp.get_2d();
+        auto pixel_sample = pixel00_loc
+                          + ((i + offset.x - 0.5) * pixel_delta_u)
+                          + ((j + offset.y - 0.5) * pixel_delta_v);
+
+        // ray origin is center unless we have a defocus angle
+        auto lens = smp.get_2d();
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(lens);
+        auto ray_direction = unit_vector(pixel_sample - ray_origin);
+
+        // ray time is between 0 and 1, within the shutter
+        auto ray_time = shutter_open + (shutter_close - shutter_open) * smp.get_1d();
+
+        if (differential) {
+            auto spacing = std::fmax(0.125, 1 / std::sqrt(double(samples_per_pixel)));
+            differential->dx = ray(ray_origin, unit_vector(pixel_sample + spacing * pixel_delta_u - ray_origin), ray_time);
+            differential->dy = ray(ray_origin, unit_vector(pixel_sample + spacing * pixel_delta_v - ray_origin), ray_time);
+        }
+
+        return ray(ray_origin, ray_direction, ray_time);
     }
 };
 
@@ -7,12 +7,22 @@
 
 using color = vec3;
 
+inline double luminance(const color& c) {
+    // Perceived brightness of a linear color (Rec. 709 weights)
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline double linear_to_gamma(double x) {
     // Gamma correction. 
     return std::sqrt(x);
 }
 
-void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
+struct rgb8 {
+    int r, g, b;
+};
+
+inline rgb8 quantize(color pixel_color, int samples_per_pixel) {
+    // The [0,255] values a summed pixel of samples_per_pixel samples is written with
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -27,12 +37,17 @@ void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
     r = linear_to_gamma(r);
     g = linear_to_gamma(g);
     b = linear_to_gamma(b);
-    
-    // Write the translated [0,255] value of each color component into ppm file.
+
     static const interval intensity(0.000, 0.999);
-    out << static_cast<int>(256 * intensity.clamp(r)) << ' '
-        << static_cast<int>(256 * intensity.clamp(g)) << ' '
-        << static_cast<int>(256 * intensity.clamp(b)) << '\n';
+    return { static_cast<int>(256 * intensity.clamp(r)),
+             static_cast<int>(256 * intensity.clamp(g)),
+             static_cast<int>(256 * intensity.clamp(b)) };
+}
+
+void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
+    // Write the translated [0,255] value of each color component into ppm file.
+    auto c = quantize(pixel_color, samples_per_pixel);
+    out << c.r << ' ' << c.g << ' ' << c.b << '\n';
 }
 
 #endif
\ No newline at end of file
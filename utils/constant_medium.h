@@ -4,16 +4,12 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
-#include "material.h"
-#include "texture.h"
 
 class constant_medium : public hittable {
     public:
-    constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex) :
-    boundary(boundary), neg_inv_density(-1/density), phase_function(make_shared<isotropic>(tex)) {}
-
-    constant_medium(shared_ptr<hittable> boundary, double density, const color& albedo) :
-    boundary(boundary), neg_inv_density(-1/density), phase_function(make_shared<isotropic>(albedo)) {}
+    // phase_function is the id of the medium's scattering material, normally an isotropic
+    constant_medium(const hittable* boundary, double density, material_id phase_function) :
+    boundary(boundary), neg_inv_density(-1/density), phase_function(phase_function) {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         const bool enableDebug = false;
@@ -46,26 +42,34 @@ class constant_medium : public hittable {
             return false;
 
         rec.t = rec1.t + hit_distance / ray_length;
-        rec.p = r.at(rec.t);
+        rec.set_primitive(this);
 
         if (debugging) {
             std::clog << "hit_distance = " <<  hit_distance << '\n'
                       << "rec.t = " <<  rec.t << '\n'
-                      << "rec.p = " <<  rec.p << '\n';
+                      << "rec.p = " <<  r.at(rec.t) << '\n';
         }
 
-        rec.normal = vec3(1,0,0);  // arbitrary
+        return true;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(0,0,0);  // none; light sampling then ignores the surface cosine
         rec.front_face = true;     // also arbitrary
+        rec.u = rec.v = 0;
         rec.mat = phase_function;
-
-        return true;
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
+
+    bool has_motion() const override { return boundary->has_motion(); }
+
+    aabb bounding_box_at(double time) const override { return boundary->bounding_box_at(time); }
     private:
-    shared_ptr<hittable> boundary;
+    const hittable* boundary;
     double neg_inv_density;
-    shared_ptr<material> phase_function;
+    material_id phase_function;
 
 };
 
@@ -0,0 +1,228 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+
+#include <algorithm>
+#include <vector>
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al., "Edge-Avoiding À-Trous Wavelet
+// Transform for fast Global Illumination Filtering"), with the variance-guided color weight of
+// SVGF (Schied et al.). Each pass blurs with a 5x5 B3 spline kernel whose taps are spread
+// 1, 2, 4, ... pixels apart, so a few passes cover a wide area at 25 taps a pixel. Taps count
+// less where what the camera ray first hit differs (normal, depth), or where the colors differ
+// by more than the noise explains.
+//
+// Light is filtered divided by the first hit's albedo, so textures stay sharp: only the
+// lighting is blurred, and the albedo is multiplied back in afterwards. Light the first hit
+// emits itself (lights, the sky) is left out of the filter altogether, which keeps their edges
+// sharp; such samples have black albedo, and pixels count in the filter only as much as their
+// samples saw anything reflect.
+
+class denoiser {
+  public:
+    int iterations = 4;          // Passes; the last one has taps 2^(iterations-1) pixels apart
+    double sigma_color = 4;      // Color difference tolerated, in standard deviations of the noise
+    double sigma_normal = 128;   // Exponent on the cosine between two normals
+    double sigma_depth = 1;      // Depth difference tolerated, relative to the local depth slope
+
+    denoiser(int width, int height) : width(width), height(height), pixels(size_t(width) * height) {}
+
+    void add_sample(
+        int i, int j, const color& radiance, const color& emitted, const color& albedo, const vec3& normal,
+        double depth
+    ) {
+        // One camera sample of pixel (i, j) and what its ray first hit: the part of radiance
+        // that hit emitted, its albedo, normal, and distance. depth is infinity when the ray hit
+        // nothing, and normal then zero.
+        auto& px = pixels[size_t(j) * width + i];
+        auto reflected = radiance - emitted;
+        px.radiance += reflected;
+        px.luminance_squared += luminance(reflected) * luminance(reflected);
+        px.emitted += emitted;
+        px.albedo += albedo;
+        if (!albedo.near_zero())
+            px.reflecting++;
+        px.normal += normal;
+        if (depth < infinity) {
+            px.depth += depth;
+            px.hits++;
+        }
+        px.samples++;
+    }
+
+    std::vector<color> filter() const {
+        // The mean radiance of every pixel, denoised, in scanline order
+        auto n = pixels.size();
+        std::vector<color> light(n), albedo(n);
+        std::vector<vec3> normal(n);
+        std::vector<double> depth(n), slope(n), variance(n), coverage(n);
+
+        for (size_t k = 0; k < n; k++) {
+            const auto& px = pixels[k];
+            auto samples = std::max(px.samples, 1);
+            auto mean = px.radiance / samples;
+            albedo[k] = px.albedo / samples;
+            normal[k] = px.normal / samples;
+            depth[k] = px.hits > 0 ? px.depth / px.hits : infinity;
+            coverage[k] = double(px.reflecting) / samples;
+
+            auto a = divisor(albedo[k]);
+            light[k] = color(mean.x() / a.x(), mean.y() / a.y(), mean.z() / a.z());
+            // Variance of the mean, scaled like the light
+            auto spread = std::fmax(0.0, px.luminance_squared / samples - luminance(mean) * luminance(mean));
+            variance[k] = spread / samples / (luminance(a) * luminance(a));
+        }
+
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+                slope[size_t(j) * width + i] = depth_slope(depth, i, j);
+
+        std::vector<color> next_light(n);
+        std::vector<double> next_variance(n);
+        for (int pass = 0; pass < iterations; pass++) {
+            auto step = 1 << pass;
+            auto blurred = blur_variance(variance);
+
+            for (int j = 0; j < height; j++) {
+                for (int i = 0; i < width; i++) {
+                    auto p = size_t(j) * width + i;
+                    if (coverage[p] == 0) {
+                        next_light[p] = light[p];
+                        next_variance[p] = variance[p];
+                        continue;
+                    }
+                    auto deviation = std::sqrt(blurred[p]);
+                    auto lum_p = luminance(light[p]);
+
+                    color sum(0,0,0);
+                    double sum_weight = 0, sum_variance = 0;
+                    for (int dy = -2; dy <= 2; dy++) {
+                        auto y = j + dy * step;
+                        if (y < 0 || y >= height)
+                            continue;
+                        for (int dx = -2; dx <= 2; dx++) {
+                            auto x = i + dx * step;
+                            if (x < 0 || x >= width)
+                                continue;
+                            auto q = size_t(y) * width + x;
+
+                            auto w = kernel[dx + 2] * kernel[dy + 2] * coverage[q];
+                            if (q != p) {
+                                auto distance = step * std::sqrt(double(dx*dx + dy*dy));
+                                w *= normal_weight(normal[p], normal[q])
+                                   * depth_weight(depth[p], depth[q], slope[p] * distance);
+                                w *= std::exp(-std::fabs(lum_p - luminance(light[q]))
+                                              / (sigma_color * deviation + 1e-10));
+                            }
+                            sum += w * light[q];
+                            sum_variance += w * w * variance[q];
+                            sum_weight += w;
+                        }
+                    }
+
+                    next_light[p] = sum / sum_weight;
+                    next_variance[p] = sum_variance / (sum_weight * sum_weight);
+                }
+            }
+
+            std::swap(light, next_light);
+            std::swap(variance, next_variance);
+        }
+
+        for (size_t k = 0; k < n; k++)
+            light[k] = light[k] * divisor(albedo[k]) + pixels[k].emitted / std::max(pixels[k].samples, 1);
+        return light;
+    }
+
+  private:
+    struct pixel {
+        color radiance = color(0,0,0);   // Without the emitted part
+        double luminance_squared = 0;
+        color emitted = color(0,0,0);
+        color albedo = color(0,0,0);
+        vec3 normal = vec3(0,0,0);
+        double depth = 0;
+        int hits = 0;        // Samples that hit something
+        int reflecting = 0;  // Samples whose first hit has an albedo
+        int samples = 0;
+    };
+
+    static constexpr double kernel[5] = { 1.0/16, 1.0/4, 3.0/8, 1.0/4, 1.0/16 };
+    static constexpr double min_albedo = 0.01;
+
+    int width, height;
+    std::vector<pixel> pixels;
+
+    static color divisor(const color& albedo) {
+        // Black surfaces would otherwise divide by zero
+        return color(std::fmax(albedo.x(), min_albedo), std::fmax(albedo.y(), min_albedo),
+                     std::fmax(albedo.z(), min_albedo));
+    }
+
+    double normal_weight(const vec3& a, const vec3& b) const {
+        // Pixels that saw nothing only blend with each other
+        auto la = a.length(), lb = b.length();
+        if (la == 0 || lb == 0)
+            return (la == 0 && lb == 0) ? 1 : 0;
+        auto c = std::fmax(0.0, dot(a, b) / (la * lb));
+        return std::pow(c, sigma_normal);
+    }
+
+    double depth_weight(double a, double b, double expected) const {
+        // expected is how much depth may change over that distance on a smooth surface
+        if (a == infinity || b == infinity)
+            return (a == infinity && b == infinity) ? 1 : 0;
+        return std::exp(-std::fabs(a - b) / (sigma_depth * expected + 1e-6 * a));
+    }
+
+    double depth_slope(const std::vector<double>& depth, int i, int j) const {
+        // Largest depth change per pixel toward a neighbor, on the same surface if possible
+        auto at = [&](int x, int y) { return depth[size_t(y) * width + x]; };
+        auto d = at(i, j);
+        if (d == infinity)
+            return 0;
+        const int offsets[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+        double smallest[2] = { infinity, infinity };
+        for (int k = 0; k < 4; k++) {
+            auto x = i + offsets[k][0], y = j + offsets[k][1];
+            if (x < 0 || x >= width || y < 0 || y >= height || at(x, y) == infinity)
+                continue;
+            // Per axis, the smaller of the two one-sided differences ignores an edge on one side
+            auto& s = smallest[k / 2];
+            s = std::fmin(s, std::fabs(at(x, y) - d));
+        }
+        double slope = 0;
+        for (auto s : smallest)
+            if (s < infinity)
+                slope = std::fmax(slope, s);
+        return slope;
+    }
+
+    std::vector<double> blur_variance(const std::vector<double>& variance) const {
+        // 3x3 Gaussian, which steadies the color weight where few samples were taken
+        static constexpr double g[3] = { 0.25, 0.5, 0.25 };
+        std::vector<double> out(variance.size());
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                double sum = 0, sum_weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        auto x = i + dx, y = j + dy;
+                        if (x < 0 || x >= width || y < 0 || y >= height)
+                            continue;
+                        auto w = g[dx + 1] * g[dy + 1];
+                        sum += w * variance[size_t(y) * width + x];
+                        sum_weight += w;
+                    }
+                }
+                out[size_t(j) * width + i] = sum / sum_weight;
+            }
+        }
+        return out;
+    }
+};
+
+#endif
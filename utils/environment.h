@@ -0,0 +1,106 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "rtw_stg_image.h"
+#include "sampler.h"
+#include "stats.h"
+
+#include <vector>
+
+class environment_light {
+  // Light arriving from infinitely far away in every direction, read from a lat-long
+  // (equirectangular) image. Uses the float pixels, so HDR images (.hdr) keep their full range.
+  // The image wraps the scene the same way image textures wrap a sphere: +y is the top row, and
+  // u = 0.5 faces +x.
+  //
+  // Directions are importance sampled: an alias table picks a pixel in proportion to its
+  // brightness times the solid angle it covers, then a point uniformly inside it. A small sun
+  // in a big sky is then found by light sampling almost every time, instead of by the odd
+  // scattered ray that happens to hit it.
+  public:
+    environment_light(const char* filename, double intensity = 1.0)
+      : image(filename), intensity(intensity)
+    {
+        width = image.width();
+        height = image.height();
+        if (width <= 0 || height <= 0)
+            return;
+
+        std::vector<double> weights(size_t(width) * height);
+        for (int y = 0; y < height; y++) {
+            // Rows near the poles cover less solid angle
+            auto sin_theta = std::sin(pi * (y + 0.5) / height);
+            for (int x = 0; x < width; x++) {
+                auto pixel = image.float_pixel_data(x, y);
+                auto brightness = luminance(color(pixel[0], pixel[1], pixel[2]));
+                weights[size_t(y) * width + x] = std::fmax(brightness, 0.0) * sin_theta;
+            }
+        }
+        pixels = alias_table(weights);
+    }
+
+    // False if the image did not load or is black; the light then neither shines nor samples
+    bool valid() const { return !pixels.empty(); }
+
+    color value(const vec3& direction) const {
+        if (width <= 0 || height <= 0)
+            return color(0,0,0);
+        int x, y;
+        pixel_of(unit_vector(direction), x, y);
+        auto pixel = image.float_pixel_data(x, y);
+        return intensity * color(pixel[0], pixel[1], pixel[2]);
+    }
+
+    vec3 sample(const point2& u, double& pdf) const {
+        // Returns a unit direction toward the environment, and its solid angle density
+        double remapped;
+        auto i = pixels.sample(u.x, remapped);
+        int x = int(i % width), y = int(i / width);
+
+        auto phi = 2*pi * (x + remapped) / width;
+        auto theta = pi * (y + u.y) / height;
+        auto sin_theta = std::sin(theta);
+        pdf = sin_theta > 0 ? pixel_pdf(i, sin_theta) : 0;
+
+        return vec3(-std::cos(phi) * sin_theta, std::cos(theta), std::sin(phi) * sin_theta);
+    }
+
+    double pdf(const vec3& direction) const {
+        // Solid angle density with which sample() returns direction
+        if (!valid())
+            return 0;
+        auto d = unit_vector(direction);
+        auto sin_theta = std::sqrt(std::fmax(0.0, 1 - d.y()*d.y()));
+        if (sin_theta <= 0)
+            return 0;
+        int x, y;
+        pixel_of(d, x, y);
+        return pixel_pdf(size_t(y) * width + x, sin_theta);
+    }
+
+  private:
+    rtw_image image;
+    double intensity;
+    int width, height;
+    alias_table pixels;
+
+    void pixel_of(const vec3& d, int& x, int& y) const {
+        // Same mapping as sphere::get_sphere_uv, with v flipped like image_texture
+        RT_STAT(transcendentals);
+        auto theta = std::acos(interval(-1, 1).clamp(d.y()));
+        auto phi = std::atan2(-d.z(), d.x()) + pi;
+        x = std::min(int(phi / (2*pi) * width), width - 1);
+        y = std::min(int(theta / pi * height), height - 1);
+    }
+
+    double pixel_pdf(size_t i, double sin_theta) const {
+        // Uniform over the pixel in (phi, theta), which spans 2pi/width by pi/height, turned
+        // into solid angle (d omega = sin theta d theta d phi)
+        return pixels.probability(i) * width * height / (2*pi*pi * sin_theta);
+    }
+};
+
+#endif
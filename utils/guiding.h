@@ -0,0 +1,302 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "interval.h"
+
+#include <cstdint>
+#include <vector>
+
+// Path guiding after Müller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation": a spatial binary tree over the scene whose leaves each hold a directional
+// quadtree of the radiance arriving in that region, learned from the paths of earlier passes.
+// Scattering then sends part of its directions where light was seen to come from, which finds
+// light through narrow gaps or off bright indirect surfaces that cosine sampling rarely hits.
+
+class directional_tree {
+  // Distribution over the sphere of directions, stored as a quadtree over the square that
+  // (cos theta, phi) maps it to. That map preserves area, so the density over the sphere is
+  // the density over the square divided by 4 pi. Each node keeps the energy recorded in each
+  // of its four quadrants; quadrants with a child node are split further.
+  public:
+    directional_tree() : nodes(1) {}
+
+    double total() const { return nodes[0].total(); }
+    std::uint64_t sample_count() const { return samples; }
+    size_t node_count() const { return nodes.size(); }
+
+    void halve_samples() { samples /= 2; }
+
+    void record(const vec3& direction, double value) {
+        // Adds value to the quadrants containing direction, at every level
+        samples++;
+        if (!(value > 0))
+            return;
+        auto p = to_square(direction);
+        std::uint32_t i = 0;
+        for (;;) {
+            auto c = quadrant(p);
+            nodes[i].sum[c] += float(value);
+            if (!nodes[i].child[c])
+                break;
+            i = nodes[i].child[c];
+        }
+    }
+
+    vec3 sample(point2 u) const {
+        // Walks down choosing quadrants in proportion to their energy (uniformly where there
+        // is none), then a uniform point in the final quadrant
+        point2 origin{0, 0};
+        double size = 1;
+        std::uint32_t i = 0;
+        for (;;) {
+            const auto& n = nodes[i];
+            int c = 0;
+            auto t = n.total();
+            auto left = t > 0 ? (n.sum[0] + n.sum[2]) / t : 0.5;
+            if (u.x < left) {
+                u.x = left > 0 ? u.x / left : 0;
+            } else {
+                u.x = (u.x - left) / (1 - left);
+                c |= 1;
+            }
+            auto column = n.sum[c] + n.sum[c | 2];
+            auto bottom = column > 0 ? n.sum[c] / column : 0.5;
+            if (u.y < bottom) {
+                u.y = bottom > 0 ? u.y / bottom : 0;
+            } else {
+                u.y = (u.y - bottom) / (1 - bottom);
+                c |= 2;
+            }
+            u.x = std::fmin(u.x, 0x1.fffffffffffffp-1);
+            u.y = std::fmin(u.y, 0x1.fffffffffffffp-1);
+
+            size /= 2;
+            origin.x += (c & 1) ? size : 0;
+            origin.y += (c & 2) ? size : 0;
+            if (!n.child[c])
+                break;
+            i = n.child[c];
+        }
+        return from_square(point2{origin.x + u.x * size, origin.y + u.y * size});
+    }
+
+    double pdf(const vec3& direction) const {
+        // Solid angle density with which sample() returns direction
+        auto p = to_square(direction);
+        double density = 1;
+        std::uint32_t i = 0;
+        for (;;) {
+            const auto& n = nodes[i];
+            auto c = quadrant(p);
+            auto t = n.total();
+            if (t > 0)
+                density *= 4 * n.sum[c] / t;
+            if (!n.child[c])
+                break;
+            i = n.child[c];
+        }
+        return density / (4*pi);
+    }
+
+    directional_tree refined(double threshold, int max_depth, size_t max_nodes) const {
+        // Empty tree shaped after this one's energy: quadrants holding more than threshold of
+        // the total are split, down to max_depth and up to max_nodes nodes. Quadrants this
+        // tree did not split yet are assumed to share their energy evenly.
+        directional_tree out;
+        out.nodes.reserve(std::min(max_nodes, nodes.size() * 2));
+        double energy[4];
+        for (int c = 0; c < 4; c++)
+            energy[c] = nodes[0].sum[c];
+        build(out, 0, 0, energy, total(), threshold, 1, max_depth, max_nodes);
+        return out;
+    }
+
+    static point2 to_square(const vec3& direction) {
+        auto d = unit_vector(direction);
+        auto cos_theta = interval(-1, 1).clamp(d.z());
+        auto phi = std::atan2(d.y(), d.x());
+        if (phi < 0)
+            phi += 2*pi;
+        return point2{
+            std::fmin((cos_theta + 1) / 2, 0x1.fffffffffffffp-1),
+            std::fmin(phi / (2*pi), 0x1.fffffffffffffp-1)
+        };
+    }
+
+    static vec3 from_square(const point2& p) {
+        auto cos_theta = 2 * p.x - 1;
+        auto sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+        auto phi = 2*pi * p.y;
+        return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+    }
+
+  private:
+    struct node {
+        float sum[4] = { 0, 0, 0, 0 };        // Energy per quadrant: x halves in bit 0, y in bit 1
+        std::uint32_t child[4] = { 0, 0, 0, 0 };  // Node splitting the quadrant, 0 if none
+        double total() const { return double(sum[0]) + sum[1] + sum[2] + sum[3]; }
+    };
+
+    std::vector<node> nodes;
+    std::uint64_t samples = 0;
+
+    static int quadrant(point2& p) {
+        // Quadrant of the unit square holding p, and p rescaled to that quadrant
+        int c = 0;
+        if (p.x >= 0.5) { c |= 1; p.x -= 0.5; }
+        if (p.y >= 0.5) { c |= 2; p.y -= 0.5; }
+        p.x *= 2;
+        p.y *= 2;
+        return c;
+    }
+
+    void build(
+        directional_tree& out, std::uint32_t out_index, std::int64_t index, const double energy[4],
+        double total, double threshold, int depth, int max_depth, size_t max_nodes
+    ) const {
+        for (int c = 0; c < 4; c++) {
+            if (!(total > 0) || energy[c] <= threshold * total || depth >= max_depth)
+                continue;
+            if (out.nodes.size() >= max_nodes)
+                return;
+
+            auto child = std::uint32_t(out.nodes.size());
+            out.nodes.emplace_back();
+            out.nodes[out_index].child[c] = child;
+
+            double child_energy[4];
+            std::int64_t old_child = index >= 0 ? nodes[index].child[c] : 0;
+            for (int k = 0; k < 4; k++)
+                child_energy[k] = old_child ? nodes[old_child].sum[k] : energy[c] / 4;
+            build(out, child, old_child ? old_child : -1, child_energy, total, threshold,
+                  depth + 1, max_depth, max_nodes);
+        }
+    }
+};
+
+class guiding_tree {
+  // The spatial half: a binary tree that splits space at the middle of the longest axis,
+  // down to leaves that each hold two directional trees. The sampling tree guides the current
+  // pass; the building tree records it, and becomes the next sampling tree once the pass is
+  // done. Leaves that recorded many paths are split, so busy regions get finer detail.
+  //
+  // Memory is bounded: once the trees reach memory_budget bytes, refinement stops splitting.
+  public:
+    guiding_tree(const aabb& bounds, size_t memory_budget) : budget(memory_budget) {
+        nodes.push_back(spatial_node{bounds, 0, 0, 0, 0});
+        leaves.emplace_back();
+    }
+
+    const directional_tree* sampling_at(const point3& p) const {
+        // The learned distribution around p, or nullptr while there is none yet
+        const auto& l = leaves[leaf_at(p)];
+        return l.sampling.total() > 0 ? &l.sampling : nullptr;
+    }
+
+    void record(const point3& p, const vec3& direction, double value) {
+        leaves[leaf_at(p)].building.record(direction, value);
+    }
+
+    void refine(int pass_samples_per_pixel) {
+        // Call after each training pass. Splits leaves that recorded more than a threshold
+        // growing with the pass size, then turns every building tree into the sampling tree
+        // and starts a new building tree shaped by it.
+        auto threshold = spatial_threshold * std::sqrt(double(pass_samples_per_pixel));
+        auto used = bytes();
+        for (size_t i = 0, n = nodes.size(); i < n; i++)
+            if (nodes[i].is_leaf())
+                split(std::uint32_t(i), threshold, used);
+
+        auto spatial_bytes = nodes.size() * sizeof(spatial_node) + leaves.size() * sizeof(leaf);
+        auto tree_budget = budget > spatial_bytes ? (budget - spatial_bytes) / (2 * leaves.size()) : 0;
+        auto max_nodes = std::max<size_t>(1, tree_budget / node_bytes);
+
+        for (auto& l : leaves) {
+            l.sampling = l.building;
+            l.building = l.sampling.refined(energy_threshold, max_depth, max_nodes);
+        }
+    }
+
+    size_t leaf_count() const { return leaves.size(); }
+
+    size_t bytes() const {
+        size_t total = nodes.size() * sizeof(spatial_node) + leaves.size() * sizeof(leaf);
+        for (const auto& l : leaves)
+            total += (l.sampling.node_count() + l.building.node_count()) * node_bytes;
+        return total;
+    }
+
+  private:
+    struct spatial_node {
+        aabb box;
+        int axis;                 // Split axis, for interior nodes
+        std::uint32_t child;      // First child; the second follows it
+        std::uint32_t leaf;       // Index into leaves, for leaves
+        std::uint32_t is_interior;
+        bool is_leaf() const { return !is_interior; }
+        double split() const {
+            const auto& ax = box.axis_interval(axis);
+            return (ax.min + ax.max) / 2;
+        }
+    };
+
+    struct leaf {
+        directional_tree sampling, building;
+    };
+
+    static constexpr double spatial_threshold = 4000;  // Paths per leaf before it splits, at 1 spp
+    static constexpr double energy_threshold = 0.01;   // Quadrants with more energy are split
+    static constexpr int max_depth = 20;
+    static constexpr size_t node_bytes = 32;           // directional_tree node
+
+    std::vector<spatial_node> nodes;
+    std::vector<leaf> leaves;
+    size_t budget;
+
+    std::uint32_t leaf_at(const point3& p) const {
+        std::uint32_t i = 0;
+        while (!nodes[i].is_leaf())
+            i = nodes[i].child + (p[nodes[i].axis] >= nodes[i].split() ? 1 : 0);
+        return nodes[i].leaf;
+    }
+
+    void split(std::uint32_t i, double threshold, size_t& used) {
+        // used tracks bytes() as leaves are added
+        const auto& l = leaves[nodes[i].leaf];
+        auto samples = l.building.sample_count();
+        auto added = 2 * sizeof(spatial_node) + sizeof(leaf)
+                   + (l.sampling.node_count() + l.building.node_count()) * node_bytes;
+        if (double(samples) <= threshold || used + added > budget)
+            return;
+        used += added;
+
+        // The children start as copies of this leaf, each with half its samples
+        auto axis = nodes[i].box.longest_axis();
+        auto box = nodes[i].box;
+        auto mid = (box.axis_interval(axis).min + box.axis_interval(axis).max) / 2;
+        aabb halves[2] = { box, box };
+        if (axis == 0) { halves[0].x.max = mid; halves[1].x.min = mid; }
+        if (axis == 1) { halves[0].y.max = mid; halves[1].y.min = mid; }
+        if (axis == 2) { halves[0].z.max = mid; halves[1].z.min = mid; }
+
+        auto first = std::uint32_t(nodes.size());
+        auto old_leaf = nodes[i].leaf;
+        leaves[old_leaf].building.halve_samples();
+        auto new_leaf = std::uint32_t(leaves.size());
+        leaves.push_back(leaves[old_leaf]);
+
+        nodes.push_back(spatial_node{halves[0], 0, 0, old_leaf, 0});
+        nodes.push_back(spatial_node{halves[1], 0, 0, new_leaf, 0});
+        nodes[i].axis = axis;
+        nodes[i].child = first;
+        nodes[i].is_interior = 1;
+
+        split(first, threshold, used);
+        split(first + 1, threshold, used);
+    }
+};
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class density_grid {
+  // A 3D grid of densities, stored in 8x8x8 bricks so the eight voxels read by a trilinear
+  // lookup are almost always in the same 2KB block. Each brick also has a majorant (the largest
+  // density its lookups can return), which the medium uses to skip empty space.
+  public:
+    static const int brick_size = 8;
+
+    density_grid() {}
+
+    density_grid(int nx, int ny, int nz) { resize(nx, ny, nz); }
+
+    void resize(int _nx, int _ny, int _nz) {
+        nx = _nx; ny = _ny; nz = _nz;
+        bx = (nx + brick_size - 1) / brick_size;
+        by = (ny + brick_size - 1) / brick_size;
+        bz = (nz + brick_size - 1) / brick_size;
+        data.assign(size_t(bx) * by * bz * brick_voxels, 0.0f);
+        majorants.assign(size_t(bx) * by * bz, 0.0f);
+    }
+
+    int width()  const { return nx; }
+    int height() const { return ny; }
+    int depth()  const { return nz; }
+
+    int bricks(int axis) const { return axis == 0 ? bx : axis == 1 ? by : bz; }
+
+    bool load_raw(const std::string& filename, int _nx, int _ny, int _nz) {
+        // Loads nx*ny*nz 32-bit floats, x varying fastest, then y, then z (the usual layout of
+        // raw voxel dumps). Returns false if the file is missing or not exactly that size, e.g.
+        // a dump of a grid of another size.
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in) return false;
+
+        std::vector<float> linear(size_t(_nx) * _ny * _nz);
+        if (size_t(in.tellg()) != linear.size() * sizeof(float)) return false;
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(linear.data()), linear.size() * sizeof(float));
+        if (size_t(in.gcount()) != linear.size() * sizeof(float)) return false;
+
+        resize(_nx, _ny, _nz);
+        size_t n = 0;
+        for (int z = 0; z < nz; z++)
+            for (int y = 0; y < ny; y++)
+                for (int x = 0; x < nx; x++)
+                    data[index(x, y, z)] = std::max(0.0f, linear[n++]);
+
+        build_majorants();
+        return true;
+    }
+
+    bool save_raw(const std::string& filename) const {
+        // Writes the grid in the same layout load_raw() reads.
+        std::ofstream out(filename, std::ios::binary);
+        if (!out) return false;
+        for (int z = 0; z < nz; z++)
+            for (int y = 0; y < ny; y++)
+                for (int x = 0; x < nx; x++)
+                    out.write(reinterpret_cast<const char*>(&data[index(x, y, z)]), sizeof(float));
+        return bool(out);
+    }
+
+    void set(int x, int y, int z, float value) { data[index(x, y, z)] = std::max(0.0f, value); }
+
+    void build_majorants() {
+        // A trilinear lookup inside a brick also reads the voxels just outside it, so the
+        // majorant covers the brick plus a one voxel border.
+        for (int k = 0; k < bz; k++)
+            for (int j = 0; j < by; j++)
+                for (int i = 0; i < bx; i++) {
+                    float m = 0;
+                    for (int z = k*brick_size - 1; z <= (k+1)*brick_size; z++)
+                        for (int y = j*brick_size - 1; y <= (j+1)*brick_size; y++)
+                            for (int x = i*brick_size - 1; x <= (i+1)*brick_size; x++)
+                                m = std::max(m, voxel(x, y, z));
+                    majorants[(size_t(k) * by + j) * bx + i] = m;
+                }
+    }
+
+    double majorant(int i, int j, int k) const { return majorants[(size_t(k) * by + j) * bx + i]; }
+
+    double max_density() const {
+        return majorants.empty() ? 0.0 : *std::max_element(majorants.begin(), majorants.end());
+    }
+
+    double lookup(const point3& g) const {
+        // Trilinear density at grid position g, in voxel units (voxel i covers [i, i+1)).
+        auto x = g.x() - 0.5, y = g.y() - 0.5, z = g.z() - 0.5;
+        auto i = int(std::floor(x)), j = int(std::floor(y)), k = int(std::floor(z));
+        auto u = x - i, v = y - j, w = z - k;
+
+        auto lerp = [](double a, double b, double t) { return a + t * (b - a); };
+        auto c00 = lerp(voxel(i, j,   k),   voxel(i+1, j,   k),   u);
+        auto c10 = lerp(voxel(i, j+1, k),   voxel(i+1, j+1, k),   u);
+        auto c01 = lerp(voxel(i, j,   k+1), voxel(i+1, j,   k+1), u);
+        auto c11 = lerp(voxel(i, j+1, k+1), voxel(i+1, j+1, k+1), u);
+        return lerp(lerp(c00, c10, v), lerp(c01, c11, v), w);
+    }
+
+  private:
+    static const int brick_voxels = brick_size * brick_size * brick_size;
+
+    int nx = 0, ny = 0, nz = 0;  // Grid size in voxels
+    int bx = 0, by = 0, bz = 0;  // Grid size in bricks
+    std::vector<float> data;      // Brick after brick, each brick x-fastest
+    std::vector<float> majorants;
+
+    size_t index(int x, int y, int z) const {
+        size_t brick = (size_t(z / brick_size) * by + y / brick_size) * bx + x / brick_size;
+        int local = ((z % brick_size) * brick_size + (y % brick_size)) * brick_size + (x % brick_size);
+        return brick * brick_voxels + local;
+    }
+
+    float voxel(int x, int y, int z) const {
+        // Density of a voxel, clamped to the edge of the grid.
+        x = std::clamp(x, 0, nx - 1);
+        y = std::clamp(y, 0, ny - 1);
+        z = std::clamp(z, 0, nz - 1);
+        return data[index(x, y, z)];
+    }
+};
+
+class heterogeneous_medium : public hittable {
+  // A participating medium whose density varies over a voxel grid stretched across a box.
+  // Free flights are sampled with delta tracking. Each brick has its own majorant, and a 3D DDA
+  // walks the ray through the bricks, so empty bricks cost one step and thin smoke is not sampled
+  // against the densest voxel in the whole grid.
+  public:
+    heterogeneous_medium(
+        const aabb& bounds, const density_grid* grid, double density_scale,
+        material_id phase_function
+    ) : bounds(bounds), grid(grid), density_scale(density_scale), phase_function(phase_function)
+    {
+        init();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto ray_length = r.direction().length();
+        bool scattered = false;
+
+        traverse(r, ray_t, [&](double t0, double t1, double majorant, double& t_hit) {
+            // Delta tracking inside one brick. Free flights are memoryless, so a flight that
+            // leaves the brick is simply restarted from the next one with its own majorant.
+            auto sigma_max = majorant * density_scale * ray_length;
+            auto t = t0;
+            while (true) {
+                t -= std::log(1 - random_double()) / sigma_max;
+                if (t >= t1)
+                    return false;
+                if (random_double() * majorant < grid->lookup(to_grid(r.at(t)))) {
+                    t_hit = t;
+                    return scattered = true;
+                }
+            }
+        }, rec.t);
+
+        if (!scattered)
+            return false;
+
+        rec.set_primitive(this);
+        return true;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.normal = vec3(0,0,0);  // none; light sampling then ignores the surface cosine
+        rec.front_face = true;     // also arbitrary
+        rec.u = rec.v = 0;
+        rec.mat = phase_function;
+    }
+
+    aabb bounding_box() const override { return bounds; }
+
+  private:
+    aabb bounds;
+    const density_grid* grid;
+    double density_scale;
+    material_id phase_function;
+
+    vec3 world_to_voxel;  // Per axis scale from world units to voxel units
+    vec3 world_to_brick;  // Per axis scale from world units to brick units
+
+    void init() {
+        auto voxels = vec3(grid->width(), grid->height(), grid->depth());
+        auto size = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size());
+        for (int a = 0; a < 3; a++) {
+            world_to_voxel[a] = voxels[a] / size[a];
+            world_to_brick[a] = world_to_voxel[a] / density_grid::brick_size;
+        }
+    }
+
+    point3 corner() const { return point3(bounds.x.min, bounds.y.min, bounds.z.min); }
+
+    point3 to_grid(const point3& p) const { return (p - corner()) * world_to_voxel; }
+
+    template <typename Step>
+    void traverse(const ray& r, interval ray_t, Step step, double& t_hit) const {
+        // Walks the ray through the majorant bricks it crosses inside ray_t, calling
+        // step(t_enter, t_exit, majorant, t_hit) for each non-empty brick until it returns true.
+        if (!clip(r, ray_t))
+            return;
+
+        auto o = (r.origin() - corner()) * world_to_brick;
+        auto d = r.direction() * world_to_brick;
+
+        int cell[3], step_dir[3], cells[3];
+        double next_t[3], delta_t[3];
+        for (int a = 0; a < 3; a++) {
+            cells[a] = grid->bricks(a);
+            cell[a] = std::clamp(int(std::floor(o[a] + ray_t.min * d[a])), 0, cells[a] - 1);
+            if (d[a] > 0) {
+                step_dir[a] = 1;
+                delta_t[a] = 1 / d[a];
+                next_t[a] = (cell[a] + 1 - o[a]) / d[a];
+            } else if (d[a] < 0) {
+                step_dir[a] = -1;
+                delta_t[a] = -1 / d[a];
+                next_t[a] = (cell[a] - o[a]) / d[a];
+            } else {
+                step_dir[a] = 0;
+                delta_t[a] = infinity;
+                next_t[a] = infinity;
+            }
+        }
+
+        auto t = ray_t.min;
+        while (t < ray_t.max) {
+            int axis = (next_t[0] < next_t[1])
+                     ? (next_t[0] < next_t[2] ? 0 : 2)
+                     : (next_t[1] < next_t[2] ? 1 : 2);
+            auto t_exit = std::min(next_t[axis], ray_t.max);
+
+            auto majorant = grid->majorant(cell[0], cell[1], cell[2]);
+            if (majorant > 0 && t_exit > t && step(t, t_exit, majorant, t_hit))
+                return;
+
+            t = t_exit;
+            cell[axis] += step_dir[axis];
+            if (cell[axis] < 0 || cell[axis] >= cells[axis])
+                return;
+            next_t[axis] += delta_t[axis];
+        }
+    }
+
+    bool clip(const ray& r, interval& ray_t) const {
+        // Shrinks ray_t to the part of the ray inside the bounds.
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = bounds.axis_interval(axis);
+            const double adinv = 1.0 / r.direction()[axis];
+            auto t0 = (ax.min - r.origin()[axis]) * adinv;
+            auto t1 = (ax.max - r.origin()[axis]) * adinv;
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -5,16 +5,41 @@
 
 #include "aabb.h"
 
-class material;
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+// Index of a material in the scene's material table. Primitives store this instead of a
+// shared_ptr, so copying hit records around in the hot loop never touches a reference count.
+using material_id = std::uint32_t;
+
+class hittable;
+class instance;
+class light_list;
+
+// Deepest nesting of instances (translate, rotate_*) a hit record can remember.
+const int max_instance_depth = 4;
 
 class hit_record { //This is a record of a hit
   public:
-    point3 p;
-    vec3 normal;
+    // Filled in by hit() while the scene is traversed. This is all a candidate hit costs, so
+    // hits later replaced by a closer one never pay for normals or texture coordinates.
     double t;
-    double u;
+    double u;   // Surface coordinates; primitives that get them for free (quads) set them here
     double v;
-    shared_ptr<material> mat;
+    const hittable* prim;                         // The primitive that was hit
+    std::uint32_t part;                           // Which of its parts, for objects that hold many primitives themselves (see scene_file.h)
+    const instance* inst[max_instance_depth];     // Instances around it, innermost first
+    int inst_depth;
+
+    // Filled in for the closest hit only, by finalize_hit().
+    point3 p;
+    vec3 normal;
+    material_id mat;
+
+    // Extent in u and v of the camera pixel around the hit, for texture filtering; 0 unless
+    // the camera fills it in
+    double du = 0, dv = 0;
 
     bool front_face; //This is used to determine if the ray comes from the outside or the inside of the object
 
@@ -24,79 +49,188 @@ class hit_record { //This is a record of a hit
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal; //If the ray comes from outside, frontface is true, else false
     }
+
+    void set_primitive(const hittable* object) {
+        prim = object;
+        inst_depth = 0;
+    }
 };
 
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record is copied by value in the hot loop");
+
 class hittable { //This is an abstract class for all hittable objects
   public:
     virtual ~hittable() = default;
 
+    // Intersection only: records t and the primitive (see hit_record), nothing else.
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    // Computes the rest of the record for a hit this primitive reported. r is the ray in the
+    // primitive's own space. Only primitives (objects that call set_primitive) need this.
+    virtual void finalize(const ray& r, hit_record& rec) const {}
+
     virtual aabb bounding_box() const = 0;
+
+    // Motion blur support. bounding_box() covers the whole shutter interval; objects that move
+    // also report their bounds at a given time in [0,1], so the BVH can keep tighter boxes per
+    // time key. Motion between the BVH time keys is assumed to be linear.
+    virtual bool has_motion() const { return false; }
+
+    virtual aabb bounding_box_at(double time) const { return bounding_box(); }
+
+    // The most instances a ray passes through inside this object on its way to a primitive
+    virtual int instance_depth() const { return 0; }
+
+    // Light sampling. Primitives that can be sampled as area lights return a direction from
+    // origin toward a point on them picked by the sample u, and the solid angle density of
+    // sampling a given direction (0 if it misses them).
+    virtual vec3 random(const point3& origin, double time, const point2& u) const { return vec3(1,0,0); }
+
+    virtual double pdf_value(const point3& origin, const vec3& direction, double time) const {
+        return 0.0;
+    }
+
+    // Photon emission. Primitives that can be sampled as area lights pick a point on their
+    // surface with the sample u, fill in rec's point, outward normal, uv and material, and
+    // return the density of that point per unit area (0 if they cannot).
+    virtual double sample_surface(const point2& u, double time, hit_record& rec) const { return 0.0; }
+
+    // Adds the samplable primitives in this object to lights (see light_list).
+    virtual void collect_lights(light_list& lights) const {}
+};
+
+class instance : public hittable {
+  // An object placed in the world by a transform. Hits only move the ray into the object's
+  // space; the point and normal are moved back out once, in finalize_hit().
+  public:
+    instance(const hittable* object) : object(object), depth(object->instance_depth() + 1) {
+        // A hit record has room for max_instance_depth instances; a deeper one would lose the
+        // transforms around it, so it is refused here rather than rendered wrong
+        if (depth > max_instance_depth)
+            throw std::length_error("instances nested more than max_instance_depth deep");
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!object->hit(to_local(r), ray_t, rec))
+            return false;
+
+        rec.inst[rec.inst_depth++] = this;
+        return true;
+    }
+
+    int instance_depth() const override { return depth; }
+
+    virtual ray to_local(const ray& r) const = 0;
+
+    // r is the ray in world space (the space this instance sits in).
+    virtual void to_world(const ray& r, hit_record& rec) const = 0;
+
+    protected:
+    const hittable* object;
+    int depth;
 };
 
-class translate: public hittable {
+inline void finalize_hit(const ray& r, hit_record& rec) {
+    // Completes the record for the closest hit: walk the ray down through the instances
+    // around the primitive, let the primitive fill in its surface, then walk back out.
+    ray rays[max_instance_depth + 1];
+    rays[rec.inst_depth] = r;
+    for (int i = rec.inst_depth - 1; i >= 0; i--)
+        rays[i] = rec.inst[i]->to_local(rays[i + 1]);
+
+    rec.prim->finalize(rays[0], rec);
+
+    for (int i = 0; i < rec.inst_depth; i++)
+        rec.inst[i]->to_world(rays[i + 1], rec);
+}
+
+inline bool hit_again(const ray& r, const hit_record& rec, hit_record& out) {
+    // Intersects r with the primitive rec is a hit on, alone, placed by the same instances,
+    // and completes out like finalize_hit(). For rays next to the one that found rec.
+    ray local = r;
+    for (int i = rec.inst_depth - 1; i >= 0; i--)
+        local = rec.inst[i]->to_local(local);
+    if (!rec.prim->hit(local, interval(0.001, infinity), out))
+        return false;
+
+    out.inst_depth = rec.inst_depth;
+    for (int i = 0; i < rec.inst_depth; i++)
+        out.inst[i] = rec.inst[i];
+    finalize_hit(r, out);
+    return true;
+}
+
+class translate: public instance {
   public:
-  translate(shared_ptr<hittable>object, const vec3& offset) : object(object), offset(offset) {
+  translate(const hittable* object, const vec3& offset) : instance(object), offset(offset) {
     bbox = object->bounding_box() + offset;
   }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  ray to_local(const ray& r) const override {
     //move ray backwards by offset
-    ray offset_r(r.origin() - offset, r.direction(), r.time());
-
-    //find intersections
-    if (!object->hit(offset_r, ray_t, rec))
-      return false;
+    return ray(r.origin() - offset, r.direction(), r.time());
+  }
 
-    //move forward by offset if intersection
+  void to_world(const ray& r, hit_record& rec) const override {
+    //move forward by offset
     rec.p += offset;
-    return true;
   }
 
   aabb bounding_box() const override { return bbox; }
 
+  aabb bounding_box_at(double time) const override {
+    return object->bounding_box_at(time) + offset;
+  }
+
   private:
-  shared_ptr<hittable> object;
   vec3 offset;
   aabb bbox;
 };
 
-class rotate_y : public hittable {
+class moving_translate : public instance {
   public:
-  rotate_y(shared_ptr<hittable> object, double angle) : object(object) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    bbox = object->bounding_box();
+  // Instance whose offset moves linearly from offset0 at time 0 to offset1 at time 1.
+  moving_translate(const hittable* object, const vec3& offset0, const vec3& offset1)
+    : instance(object), offset0(offset0), offset_vec(offset1 - offset0)
+  {
+    bbox = aabb(object->bounding_box() + offset0, object->bounding_box() + offset1);
+  }
 
-    point3 min(infinity, infinity, infinity);
-    point3 max(-infinity, -infinity, -infinity);
+  ray to_local(const ray& r) const override {
+    //move ray backwards by the offset at the ray's time
+    return ray(r.origin() - offset_at(r.time()), r.direction(), r.time());
+  }
 
-    for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
+  void to_world(const ray& r, hit_record& rec) const override {
+    rec.p += offset_at(r.time());
+  }
 
-                    auto newx =  cos_theta*x + sin_theta*z;
-                    auto newz = -sin_theta*x + cos_theta*z;
+  aabb bounding_box() const override { return bbox; }
 
-                    vec3 tester(newx, y, newz);
+  bool has_motion() const override { return true; }
 
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = fmin(min[c], tester[c]);
-                        max[c] = fmax(max[c], tester[c]);
-                    }
-                }
-            }
-        }
+  aabb bounding_box_at(double time) const override {
+    return object->bounding_box_at(time) + offset_at(time);
+  }
 
-        bbox = aabb(min, max);
-    }
+  private:
+  vec3 offset0;
+  vec3 offset_vec;
+  aabb bbox;
+
+  vec3 offset_at(double time) const { return offset0 + time * offset_vec; }
+};
+
+class rotate_y : public instance {
+  public:
+  rotate_y(const hittable* object, double angle) : instance(object) {
+    auto radians = degrees_to_radians(angle);
+    sin_theta = sin(radians);
+    cos_theta = cos(radians);
+    bbox = rotated_bounds(object->bounding_box());
+  }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  ray to_local(const ray& r) const override {
     //world to local space
     auto origin = r.origin();
     auto direction = r.direction();
@@ -107,12 +241,10 @@ class rotate_y : public hittable {
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
-
-  //find intersections
-    if (!object->hit(rotated_r, ray_t, rec))
-      return false;
+    return ray(origin, direction, r.time());
+  }
 
+  void to_world(const ray& r, hit_record& rec) const override {
     //intersection point local to world
     auto p = rec.p;
     p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
@@ -125,56 +257,59 @@ class rotate_y : public hittable {
 
     rec.p = p;
     rec.normal = normal;
-
-    return true;
   }
 
   aabb bounding_box() const override { return bbox; }
 
+  aabb bounding_box_at(double time) const override {
+    return rotated_bounds(object->bounding_box_at(time));
+  }
+
   private:
-  shared_ptr<hittable> object;
     double sin_theta;
     double cos_theta;
     aabb bbox;
 
-};
-
-class rotate_x : public hittable {
-  public:
-
-  rotate_x(shared_ptr<hittable> object, double angle) : object(object) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    bbox = object->bounding_box();
-
+  aabb rotated_bounds(const aabb& box) const {
+    // Axis aligned box around the rotated corners of box
     point3 min(infinity, infinity, infinity);
     point3 max(-infinity, -infinity, -infinity);
 
     for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                auto x = i*box.x.max + (1-i)*box.x.min;
+                auto y = j*box.y.max + (1-j)*box.y.min;
+                auto z = k*box.z.max + (1-k)*box.z.min;
 
-                    auto newy =  cos_theta*y + sin_theta*z;
-                    auto newz = -sin_theta*y + cos_theta*z;
+                auto newx =  cos_theta*x + sin_theta*z;
+                auto newz = -sin_theta*x + cos_theta*z;
 
-                    vec3 tester(x, newy, newz);
+                vec3 tester(newx, y, newz);
 
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = fmin(min[c], tester[c]);
-                        max[c] = fmax(max[c], tester[c]);
-                    }
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], tester[c]);
+                    max[c] = fmax(max[c], tester[c]);
                 }
             }
         }
-
-        bbox = aabb(min, max);
     }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+    return aabb(min, max);
+  }
+};
+
+class rotate_x : public instance {
+  public:
+
+  rotate_x(const hittable* object, double angle) : instance(object) {
+    auto radians = degrees_to_radians(angle);
+    sin_theta = sin(radians);
+    cos_theta = cos(radians);
+    bbox = rotated_bounds(object->bounding_box());
+  }
+
+  ray to_local(const ray& r) const override {
     //world to local space
     auto origin = r.origin();
     auto direction = r.direction();
@@ -185,13 +320,10 @@ class rotate_x : public hittable {
     direction[1] = cos_theta * r.direction()[1] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[1] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
-
-  //find intersections
-
-    if (!object->hit(rotated_r, ray_t, rec))
-      return false;
+    return ray(origin, direction, r.time());
+  }
 
+  void to_world(const ray& r, hit_record& rec) const override {
     //intersection point local to world
     auto p = rec.p;
     p[1] = cos_theta * rec.p[1] + sin_theta * rec.p[2];
@@ -204,55 +336,58 @@ class rotate_x : public hittable {
 
     rec.p = p;
     rec.normal = normal;
-
-    return true;
   }
 
   aabb bounding_box() const override { return bbox; }
+  aabb bounding_box_at(double time) const override {
+    return rotated_bounds(object->bounding_box_at(time));
+  }
+
   private:
-  shared_ptr<hittable> object;
     double sin_theta;
     double cos_theta;
     aabb bbox;
 
-};
-
-class rotate_z : public hittable {
-  public:
-
-  rotate_z(shared_ptr<hittable> object, double angle) : object(object) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    bbox = object->bounding_box();
-
+  aabb rotated_bounds(const aabb& box) const {
+    // Axis aligned box around the rotated corners of box
     point3 min(infinity, infinity, infinity);
     point3 max(-infinity, -infinity, -infinity);
 
     for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                auto x = i*box.x.max + (1-i)*box.x.min;
+                auto y = j*box.y.max + (1-j)*box.y.min;
+                auto z = k*box.z.max + (1-k)*box.z.min;
 
-                    auto newx =  cos_theta*x + sin_theta*y;
-                    auto newy = -sin_theta*x + cos_theta*y;
+                auto newy =  cos_theta*y + sin_theta*z;
+                auto newz = -sin_theta*y + cos_theta*z;
 
-                    vec3 tester(newx, newy, z);
+                vec3 tester(x, newy, newz);
 
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = fmin(min[c], tester[c]);
-                        max[c] = fmax(max[c], tester[c]);
-                    }
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], tester[c]);
+                    max[c] = fmax(max[c], tester[c]);
                 }
             }
         }
-
-        bbox = aabb(min, max);
     }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+    return aabb(min, max);
+  }
+};
+
+class rotate_z : public instance {
+  public:
+
+  rotate_z(const hittable* object, double angle) : instance(object) {
+    auto radians = degrees_to_radians(angle);
+    sin_theta = sin(radians);
+    cos_theta = cos(radians);
+    bbox = rotated_bounds(object->bounding_box());
+  }
+
+  ray to_local(const ray& r) const override {
     //world to local space
     auto origin = r.origin();
     auto direction = r.direction();
@@ -263,37 +398,62 @@ class rotate_z : public hittable {
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[1];
     direction[1] = sin_theta * r.direction()[0] + cos_theta * r.direction()[1];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+  }
+
+  void to_world(const ray& r, hit_record& rec) const override {
+    //intersection point local to world
+    auto p = rec.p;
+    p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[1];
+    p[1] = -sin_theta * rec.p[0] + cos_theta * rec.p[1];
 
-  //find intersections
-  
-      if (!object->hit(rotated_r, ray_t, rec))
-        return false;
-  
-      //intersection point local to world
-      auto p = rec.p;
-      p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[1];
-      p[1] = -sin_theta * rec.p[0] + cos_theta * rec.p[1];
-  
-      //normal local to world
-      auto normal = rec.normal;
-      normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[1];
-      normal[1] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[1];
-  
-      rec.p = p;
-      rec.normal = normal;
-  
-      return true;
-    }
+    //normal local to world
+    auto normal = rec.normal;
+    normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[1];
+    normal[1] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[1];
+
+    rec.p = p;
+    rec.normal = normal;
+  }
 
-    aabb bounding_box() const override { return bbox; }
+  aabb bounding_box() const override { return bbox; }
+
+  aabb bounding_box_at(double time) const override {
+    return rotated_bounds(object->bounding_box_at(time));
+  }
 
   private:
-  shared_ptr<hittable> object;
     double sin_theta;
     double cos_theta;
     aabb bbox;
 
+  aabb rotated_bounds(const aabb& box) const {
+    // Axis aligned box around the rotated corners of box
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                auto x = i*box.x.max + (1-i)*box.x.min;
+                auto y = j*box.y.max + (1-j)*box.y.min;
+                auto z = k*box.z.max + (1-k)*box.z.min;
+
+                auto newx =  cos_theta*x + sin_theta*y;
+                auto newy = -sin_theta*x + cos_theta*y;
+
+                vec3 tester(newx, newy, z);
+
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], tester[c]);
+                    max[c] = fmax(max[c], tester[c]);
+                }
+            }
+        }
+    }
+
+    return aabb(min, max);
+  }
 };
 
 #endif
\ No newline at end of file
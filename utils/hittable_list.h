@@ -4,49 +4,68 @@
 #include "aabb.h"
 #include "hittable.h"
 
-#include <memory>
+#include <algorithm>
 #include <vector>
 
-using std::shared_ptr;
-using std::make_shared;
-
 class hittable_list : public hittable {
   public:
-  //This is a list of hittable objects
+  //This is a list of hittable objects. It does not own them; they live in the scene's arena.
 
-    std::vector<shared_ptr<hittable>> objects;
+    std::vector<const hittable*> objects;
 
     hittable_list() {}
-    hittable_list(shared_ptr<hittable> object) { add(object); }
+    hittable_list(const hittable* object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() { objects.clear(); bbox = aabb(); moving = false; depth = 0; }
 
-    void add(shared_ptr<hittable> object) {
+    void add(const hittable* object) {
         objects.push_back(object);
         bbox = aabb(bbox, object->bounding_box()); //add object
+        moving = moving || object->has_motion();
+        depth = std::max(depth, object->instance_depth());
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // This function checks if the ray hits any of the objects in the list
-        hit_record temp_rec;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
 
-        // Check if the ray hits any of the objects in the list, looks for the closest object
-        // seems pretty inefficient, but it is what it is i guess
+        // Check if the ray hits any of the objects in the list, looks for the closest object.
+        // Objects only write rec when they report a hit, and a later hit is always closer, so
+        // there is no need for a temporary record.
         for (const auto& object : objects) {
-            if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+            if (object->hit(r, interval(ray_t.min, closest_so_far), rec)) {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                closest_so_far = rec.t;
             }
         }
 
         return hit_anything;
     }
     aabb bounding_box() const override { return bbox; }
+
+    void collect_lights(light_list& lights) const override {
+        for (const auto& object : objects)
+            object->collect_lights(lights);
+    }
+
+    bool has_motion() const override { return moving; }
+
+    int instance_depth() const override { return depth; }
+
+    aabb bounding_box_at(double time) const override {
+        if (!moving)
+            return bbox;
+        aabb box;
+        for (const auto& object : objects)
+            box = aabb(box, object->bounding_box_at(time));
+        return box;
+    }
+
     private:
         aabb bbox;
+        bool moving = false;
+        int depth = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+
+#include <charconv>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class image_writer {
+  // Writes a PPM file while its image is still being rendered. The renderer hands over rows as
+  // it finishes them and goes on; a thread of the writer's own quantizes them, formats them and
+  // appends them to the file, top row first, holding any that arrive before the rows above
+  // them. Once the last row is handed over, only its own writing is left for close() to wait for.
+  public:
+    image_writer(const std::string& path, int width, int height)
+      : path(path), width(width), height(height), worker([this] { work(); }) {}
+
+    image_writer(const image_writer&) = delete;
+    image_writer& operator=(const image_writer&) = delete;
+
+    ~image_writer() { close(); }
+
+    void add_rows(int first, std::vector<color> pixels, int samples_per_pixel) {
+        // Rows first, first + 1, ... of summed pixel colors of samples_per_pixel samples each,
+        // width pixels to a row
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.push_back(rows{first, std::move(pixels), samples_per_pixel});
+        }
+        wake.notify_one();
+    }
+
+    bool close() {
+        // Waits for every row handed over to be written; false if the file could not be
+        // written or rows were missing
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closing = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+        return written;
+    }
+
+  private:
+    struct rows {
+        int first;
+        std::vector<color> pixels;
+        int samples_per_pixel;
+    };
+
+    std::string path;
+    int width, height;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<rows> pending;
+    bool closing = false;
+    bool written = false;
+    std::thread worker;   // Last, so it starts once the rest is set up
+
+    void work() {
+        std::ofstream out(path);
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+
+        std::map<int, rows> early;   // By first row
+        int next = 0;                // The first row not written yet
+        std::string text;
+        for (;;) {
+            rows r;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this] { return closing || !pending.empty(); });
+                if (pending.empty())
+                    break;
+                r = std::move(pending.front());
+                pending.pop_front();
+            }
+            early.emplace(r.first, std::move(r));
+            for (auto it = early.begin(); it != early.end() && it->first == next; it = early.erase(it)) {
+                encode(it->second, text);
+                out.write(text.data(), std::streamsize(text.size()));
+                next += int(it->second.pixels.size() / size_t(width));
+            }
+        }
+
+        out.close();
+        written = out && next == height;
+        if (!out)
+            std::cerr << "ERROR: Could not write image file '" << path << "'.\n";
+    }
+
+    static void encode(const rows& r, std::string& text) {
+        // The same text as write_color(), without going through a stream for every number
+        text.resize(r.pixels.size() * 12);
+        auto p = text.data(), end = p + text.size();
+        for (const auto& pixel : r.pixels) {
+            auto c = quantize(pixel, r.samples_per_pixel);
+            p = std::to_chars(p, end, c.r).ptr;
+            *p++ = ' ';
+            p = std::to_chars(p, end, c.g).ptr;
+            *p++ = ' ';
+            p = std::to_chars(p, end, c.b).ptr;
+            *p++ = '\n';
+        }
+        text.resize(size_t(p - text.data()));
+    }
+};
+
+#endif
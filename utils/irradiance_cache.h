@@ -0,0 +1,144 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Irradiance cache, after Ward et al., "A Ray Tracing Solution for Diffuse Interreflection".
+// Light arriving at a diffuse surface from other surfaces changes slowly over it, so it is
+// computed accurately at a sparse set of records and interpolated in between, instead of
+// being estimated again, noisily, by every path that reaches the surface.
+//
+// A record is valid around its point out to a distance set by how far the surfaces it saw
+// are (their harmonic mean distance): near walls and in corners light changes faster, so
+// records there cover less and end up closer together. error is Ward's a: the interpolation
+// error a record may add, relative to its irradiance, before it no longer counts.
+
+class irradiance_cache {
+  public:
+    irradiance_cache(const aabb& bounds, double error) : error(error) {
+        auto diagonal = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length();
+        min_radius = min_radius_fraction * diagonal;
+        max_radius = max_radius_fraction * diagonal;
+
+        // Cells as wide as the widest record reaches, so lookups visit one cell
+        cell_size = error * max_radius;
+        for (int a = 0; a < 3; a++)
+            cell_size = std::fmax(cell_size, bounds.axis_interval(a).size() / max_cells);
+        for (int a = 0; a < 3; a++) {
+            origin[a] = bounds.axis_interval(a).min;
+            cells[a] = std::max(1, int(std::ceil(bounds.axis_interval(a).size() / cell_size)));
+        }
+    }
+
+    size_t size() const { return records.size(); }
+
+    size_t bytes() const {
+        size_t total = records.size() * sizeof(record);
+        for (const auto& c : grid)
+            total += sizeof(c) + c.second.size() * sizeof(std::uint32_t);
+        return total;
+    }
+
+    bool lookup(const point3& p, const vec3& normal, color& irradiance) const {
+        // The irradiance at p on a surface facing normal, interpolated from the records valid
+        // there. Returns false if there are none.
+        auto found = grid.find(key(cell_of(p, 0), cell_of(p, 1), cell_of(p, 2)));
+        if (found == grid.end())
+            return false;
+
+        color sum(0,0,0);
+        double sum_weight = 0;
+        for (auto i : found->second) {
+            const auto& rc = records[i];
+            vec3 n(rc.normal[0], rc.normal[1], rc.normal[2]);
+            auto offset = p - point3(rc.position[0], rc.position[1], rc.position[2]);
+            auto e = offset.length() / rc.radius + std::sqrt(std::fmax(0.0, 1 - dot(normal, n)));
+            if (e >= error)
+                continue;
+            if (dot(offset, normal + n) < -0.1 * rc.radius)
+                continue; // p is behind the record's surface, where its light may be shadowed
+            // Ward's weight 1/e, less its value at the edge, so records fade out instead of
+            // dropping out of the sum
+            auto w = 1 / std::fmax(e, 1e-6) - 1 / error;
+            sum += w * color(rc.irradiance[0], rc.irradiance[1], rc.irradiance[2]);
+            sum_weight += w;
+        }
+        if (sum_weight <= 0)
+            return false;
+        irradiance = sum / sum_weight;
+        return true;
+    }
+
+    bool covers(const point3& p, const vec3& normal) const {
+        color unused;
+        return lookup(p, normal, unused);
+    }
+
+    void add(const point3& p, const vec3& normal, const color& irradiance, double harmonic_distance) {
+        // A record at p of the irradiance computed there; harmonic_distance is the harmonic
+        // mean distance of what the gathering rays hit
+        record rc;
+        for (int a = 0; a < 3; a++) {
+            rc.position[a] = float(p[a]);
+            rc.normal[a] = float(normal[a]);
+            rc.irradiance[a] = float(irradiance[a]);
+        }
+        rc.radius = float(std::clamp(harmonic_distance, min_radius, max_radius));
+
+        auto index = std::uint32_t(records.size());
+        records.push_back(rc);
+
+        // Every cell the record's valid region overlaps
+        auto reach = error * rc.radius;
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = cell_of(p[a] - reach, a);
+            hi[a] = cell_of(p[a] + reach, a);
+        }
+        for (int x = lo[0]; x <= hi[0]; x++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int z = lo[2]; z <= hi[2]; z++)
+                    grid[key(x, y, z)].push_back(index);
+    }
+
+  private:
+    struct record {
+        float position[3];
+        float normal[3];
+        float irradiance[3];
+        float radius;         // Harmonic mean distance, clamped
+    };
+
+    static constexpr double min_radius_fraction = 0.005; // Of the scene's diagonal
+    static constexpr double max_radius_fraction = 0.2;
+    static constexpr int max_cells = 256;                // Per axis
+
+    double error;
+    double min_radius, max_radius;
+    double origin[3];
+    double cell_size;
+    int cells[3];
+    std::vector<record> records;
+    std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> grid; // Records per cell, only where there are some
+
+    int cell_of(const point3& p, int axis) const { return cell_of(p[axis], axis); }
+
+    int cell_of(double x, int axis) const {
+        return std::clamp(int(std::floor((x - origin[axis]) / cell_size)), 0, cells[axis] - 1);
+    }
+
+    std::uint64_t key(int x, int y, int z) const {
+        return (std::uint64_t(x) * cells[1] + y) * cells[2] + z;
+    }
+};
+
+#endif
@@ -0,0 +1,404 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "rtweekend.h"
+
+#include "environment.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct light_bounds {
+  // What the light hierarchy knows about an emitter, or a group of them: where it is, how much
+  // it emits, and which way (a cone of normals around w, plus the spread of emission about
+  // each normal).
+    aabb bounds = aabb::empty;
+    double phi = 0;                 // Emitted power, up to a constant factor
+    vec3 w = vec3(0, 0, 1);         // Axis of the cone of normals
+    double cos_theta_o = 1;         // Normals are within theta_o of w
+    double cos_theta_e = 0;         // Light leaves within theta_e of its normal (pi/2 for diffuse)
+    bool two_sided = false;         // Emits on both sides of the surface
+
+    point3 centroid() const {
+        return point3((bounds.x.min + bounds.x.max) / 2, (bounds.y.min + bounds.y.max) / 2,
+                      (bounds.z.min + bounds.z.max) / 2);
+    }
+
+    double importance(const point3& p, const vec3& n) const {
+        // Conservative estimate of the light reaching p (with surface normal n, or a zero n for
+        // points in a medium) from anything these bounds hold, after Conty Estevez and Kulla,
+        // "Importance Sampling of Many Lights with Adaptive Tree Splitting". Angles are kept as
+        // cosines and sines: theta_w is the angle between w and the direction to p, theta_b
+        // bounds the angle the box subtends from p.
+        if (phi <= 0)
+            return 0;
+
+        auto pc = centroid();
+        auto diagonal = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size());
+        auto radius2 = diagonal.length_squared() / 4;
+        auto dist2 = (p - pc).length_squared();
+        auto d2 = std::fmax(dist2, std::sqrt(radius2));
+
+        auto wi = dist2 > 0 ? (p - pc) / std::sqrt(dist2) : w;
+        auto cos_theta_w = dot(w, wi);
+        if (two_sided)
+            cos_theta_w = std::fabs(cos_theta_w);
+        auto sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+
+        auto cos_theta_b = dist2 <= radius2 ? -1.0 : std::sqrt(1 - radius2 / dist2);
+        auto sin_theta_b = dist2 <= radius2 ? 0.0 : std::sqrt(radius2 / dist2);
+
+        // theta' = max(0, theta_w - theta_o - theta_b): the smallest angle to p any normal inside
+        // the bounds can have
+        auto sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+        auto cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+        auto sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+        auto cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+        if (cos_theta_p <= cos_theta_e)
+            return 0;
+
+        auto result = phi * cos_theta_p / d2;
+
+        if (n.length_squared() > 0) {
+            // Same bound for the cosine at the receiving surface
+            auto cos_theta_i = std::fabs(dot(wi, n));
+            auto sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+            result *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+        }
+        return std::fmax(result, 0.0);
+    }
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        if (a.phi <= 0) return b;
+        if (b.phi <= 0) return a;
+
+        light_bounds m;
+        m.bounds = aabb(a.bounds, b.bounds);
+        m.phi = a.phi + b.phi;
+        merge_cones(a.w, a.cos_theta_o, b.w, b.cos_theta_o, m.w, m.cos_theta_o);
+        m.cos_theta_e = std::fmin(a.cos_theta_e, b.cos_theta_e);
+        m.two_sided = a.two_sided || b.two_sided;
+        return m;
+    }
+
+  private:
+    static double safe_sqrt(double x) { return std::sqrt(std::fmax(0.0, x)); }
+
+    // cos and sin of max(0, a - b), given those of a and b (both in [0, pi])
+    static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+    }
+    static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+    }
+
+    static void merge_cones(const vec3& wa, double cos_a, const vec3& wb, double cos_b, vec3& w, double& cos_o) {
+        // Smallest cone around both cones
+        auto theta_a = std::acos(interval(-1, 1).clamp(cos_a));
+        auto theta_b = std::acos(interval(-1, 1).clamp(cos_b));
+        auto theta_d = std::acos(interval(-1, 1).clamp(dot(wa, wb)));
+        if (std::fmin(theta_d + theta_b, pi) <= theta_a) { w = wa; cos_o = cos_a; return; }
+        if (std::fmin(theta_d + theta_a, pi) <= theta_b) { w = wb; cos_o = cos_b; return; }
+
+        auto theta_o = (theta_a + theta_d + theta_b) / 2;
+        auto axis = cross(wa, wb);
+        if (theta_o >= pi || axis.length_squared() == 0) {
+            w = wa;
+            cos_o = -1;
+            return;
+        }
+
+        // Rotate wa toward wb about their common perpendicular
+        auto theta_r = theta_o - theta_a;
+        auto k = unit_vector(axis);
+        w = unit_vector(std::cos(theta_r) * wa + std::sin(theta_r) * cross(k, wa));
+        cos_o = std::cos(theta_o);
+    }
+};
+
+class light_list {
+  // The emissive primitives the integrator samples directly (next event estimation). Filled
+  // by hittable::collect_lights(), which only reaches primitives placed straight in the world
+  // (through lists and BVH nodes, not instances). Emitters it misses, and emitters that cannot
+  // be sampled (e.g. boxes, media), are still found by rays that happen to hit them.
+  //
+  // Lights are chosen through a light BVH: a binary tree over the emitters whose nodes keep
+  // light_bounds. pick() walks down from the root, choosing each child in proportion to its
+  // importance for the shading point, so bright, close, facing lights are picked far more
+  // often than distant or back-facing ones, in O(log n) per pick. The path to each light is
+  // kept as a bit trail, so probability() can replay the same choices.
+  //
+  // The scene's environment light, if any, is picked separately (pick() returns nullptr for
+  // it), with probability 1/2 when there are other lights.
+  public:
+    // Power per unit area of each material's emission, indexed by material_id; 0 if it does
+    // not emit. Set before collecting.
+    std::vector<double> emission;
+
+    void clear() {
+        lights.clear(); bounds.clear(); index.clear(); nodes.clear(); trails.clear();
+        environment = nullptr;
+    }
+
+    void add(const hittable* prim, material_id mat, light_bounds b) {
+        // b describes the primitive's shape, with phi its emitting area (counting both sides
+        // for two sided emitters); the material supplies the rest of the power.
+        if (mat < emission.size() && emission[mat] > 0 && !contains(prim)) {
+            b.phi *= emission[mat];
+            index[prim] = lights.size();
+            lights.push_back(prim);
+            bounds.push_back(b);
+        }
+    }
+
+    void set_environment(const environment_light* env) {
+        environment = (env && env->valid()) ? env : nullptr;
+    }
+
+    void build() {
+        // Builds the light BVH over the lights added so far
+        nodes.clear();
+        trails.assign(lights.size(), 0);
+        if (lights.empty())
+            return;
+        std::vector<std::uint32_t> order(lights.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = std::uint32_t(i);
+        build_node(order, 0, order.size(), 0, 0);
+    }
+
+    bool empty() const { return size() == 0; }
+    size_t size() const { return lights.size() + (environment ? 1 : 0); }
+
+    bool contains(const hittable* prim) const { return index.count(prim) != 0; }
+
+    // The primitive lights one by one, with their power and whether they emit from both faces
+    size_t primitive_count() const { return lights.size(); }
+    const hittable* primitive(size_t i) const { return lights[i]; }
+    double power(size_t i) const { return bounds[i].phi; }
+    bool two_sided(size_t i) const { return bounds[i].two_sided; }
+
+    const hittable* pick(double u, const point3& p, const vec3& n, double& probability) const {
+        // Chooses a light for the shading point p with normal n using the sample u, and returns
+        // the probability it was chosen with (0 if no light can reach p). nullptr stands for
+        // the environment.
+        probability = 0;
+        auto p_env = environment_probability();
+        if (u < p_env) {
+            probability = p_env;
+            return nullptr;
+        }
+        if (nodes.empty())
+            return nullptr;
+        u = std::fmin((u - p_env) / (1 - p_env), 0x1.fffffffffffffp-1);
+
+        double pmf = 1 - p_env;
+        std::uint32_t i = 0;
+        while (!nodes[i].leaf) {
+            auto i0 = nodes[i].bounds_of_children[0].importance(p, n);
+            auto i1 = nodes[i].bounds_of_children[1].importance(p, n);
+            if (i0 + i1 <= 0)
+                return nullptr;
+            auto p0 = i0 / (i0 + i1);
+            if (u < p0) {
+                u = std::fmin(u / p0, 0x1.fffffffffffffp-1);
+                pmf *= p0;
+                i = i + 1;
+            } else {
+                u = std::fmin((u - p0) / (1 - p0), 0x1.fffffffffffffp-1);
+                pmf *= 1 - p0;
+                i = nodes[i].index;
+            }
+        }
+
+        // Below the root, choosing the leaf already required it to be important
+        auto light = nodes[i].index;
+        if (i == 0 && bounds[light].importance(p, n) <= 0)
+            return nullptr;
+        probability = pmf;
+        return lights[light];
+    }
+
+    double probability(const hittable* light, const point3& p, const vec3& n) const {
+        // Probability that pick() chooses light for the shading point p with normal n
+        auto it = index.find(light);
+        if (it == index.end())
+            return 0.0;
+
+        double pmf = 1 - environment_probability();
+        auto trail = trails[it->second];
+        std::uint32_t i = 0;
+        while (!nodes[i].leaf) {
+            auto i0 = nodes[i].bounds_of_children[0].importance(p, n);
+            auto i1 = nodes[i].bounds_of_children[1].importance(p, n);
+            if (i0 + i1 <= 0)
+                return 0.0;
+            if (trail & 1) {
+                pmf *= i1 / (i0 + i1);
+                i = nodes[i].index;
+            } else {
+                pmf *= i0 / (i0 + i1);
+                i = i + 1;
+            }
+            trail >>= 1;
+        }
+        if (i == 0 && bounds[it->second].importance(p, n) <= 0)
+            return 0.0;
+        return pmf;
+    }
+
+    double environment_probability() const {
+        // Probability that pick() chooses the environment
+        if (!environment)
+            return 0.0;
+        return lights.empty() ? 1.0 : 0.5;
+    }
+
+  private:
+    struct node {
+        // Interior nodes keep the bounds of both children, so a step down the tree reads one
+        // node. The first child is the next node; index is the second child, or for a leaf the
+        // light.
+        light_bounds bounds_of_children[2];
+        std::uint32_t index = 0;
+        bool leaf = false;
+    };
+
+    std::vector<const hittable*> lights;
+    std::vector<light_bounds> bounds;       // Per light
+    std::vector<std::uint64_t> trails;      // Per light: child taken at each level, root first
+    std::vector<node> nodes;
+    const environment_light* environment = nullptr;
+    std::unordered_map<const hittable*, size_t> index;
+
+    light_bounds build_node(
+        std::vector<std::uint32_t>& order, size_t start, size_t end, std::uint64_t trail, int depth
+    ) {
+        // Builds the subtree over order[start, end) at nodes.back() + 1 and returns its bounds
+        auto node_index = nodes.size();
+        nodes.emplace_back();
+
+        if (end - start == 1) {
+            auto light = order[start];
+            nodes[node_index].leaf = true;
+            nodes[node_index].index = light;
+            trails[light] = trail;
+            return bounds[light];
+        }
+
+        auto mid = split(order, start, end, depth);
+        auto b0 = build_node(order, start, mid, trail, depth + 1);
+        nodes[node_index].index = std::uint32_t(nodes.size());
+        auto b1 = build_node(order, mid, end, trail | (std::uint64_t(1) << depth), depth + 1);
+
+        nodes[node_index].bounds_of_children[0] = b0;
+        nodes[node_index].bounds_of_children[1] = b1;
+        return light_bounds::merge(b0, b1);
+    }
+
+    size_t split(std::vector<std::uint32_t>& order, size_t start, size_t end, int depth) {
+        // Surface area orientation heuristic (Conty Estevez and Kulla): over a few buckets
+        // along each axis, picks the split minimizing power times orientation measure times
+        // surface area of both sides. Falls back to a median split where that fails, and deep
+        // in the tree so trails fit in 64 bits.
+        aabb centroid_bounds = aabb::empty;
+        light_bounds all;
+        for (auto i = start; i < end; i++) {
+            auto c = bounds[order[i]].centroid();
+            centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+            all = light_bounds::merge(all, bounds[order[i]]);
+        }
+
+        const int bucket_count = 12;
+        double best_cost = infinity;
+        int best_axis = -1, best_bucket = 0;
+
+        if (depth < 48) {
+            for (int axis = 0; axis < 3; axis++) {
+                auto extent = centroid_bounds.axis_interval(axis);
+                if (extent.size() <= 1e-9)
+                    continue;
+
+                light_bounds buckets[bucket_count];
+                for (auto i = start; i < end; i++) {
+                    auto& b = bounds[order[i]];
+                    buckets[bucket_of(b, axis, extent, bucket_count)] =
+                        light_bounds::merge(buckets[bucket_of(b, axis, extent, bucket_count)], b);
+                }
+
+                // Boxes are longer along some axes; weigh splits across thin ones less
+                auto all_size = vec3(all.bounds.x.size(), all.bounds.y.size(), all.bounds.z.size());
+                auto max_size = std::fmax(all_size.x(), std::fmax(all_size.y(), all_size.z()));
+                auto kr = max_size / all_size[axis];
+
+                for (int s = 0; s < bucket_count - 1; s++) {
+                    light_bounds below, above;
+                    for (int k = 0; k <= s; k++) below = light_bounds::merge(below, buckets[k]);
+                    for (int k = s + 1; k < bucket_count; k++) above = light_bounds::merge(above, buckets[k]);
+                    auto cost = kr * (split_cost(below) + split_cost(above));
+                    if (below.phi > 0 && above.phi > 0 && cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bucket = s;
+                    }
+                }
+            }
+        }
+
+        if (best_axis >= 0) {
+            auto extent = centroid_bounds.axis_interval(best_axis);
+            auto it = std::partition(order.begin() + start, order.begin() + end, [&](std::uint32_t i) {
+                return bucket_of(bounds[i], best_axis, extent, bucket_count) <= best_bucket;
+            });
+            auto mid = size_t(it - order.begin());
+            if (mid != start && mid != end)
+                return mid;
+        }
+
+        // Median along the longest axis
+        int axis = centroid_bounds.longest_axis();
+        auto mid = (start + end) / 2;
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+            [&](std::uint32_t a, std::uint32_t b) { return bounds[a].centroid()[axis] < bounds[b].centroid()[axis]; });
+        return mid;
+    }
+
+    static int bucket_of(const light_bounds& b, int axis, const interval& extent, int bucket_count) {
+        auto f = (b.centroid()[axis] - extent.min) / extent.size();
+        return std::min(int(f * bucket_count), bucket_count - 1);
+    }
+
+    static double split_cost(const light_bounds& b) {
+        // Power times the solid angle measure of the orientation cone times surface area
+        if (b.phi <= 0)
+            return 0;
+        auto theta_o = std::acos(interval(-1, 1).clamp(b.cos_theta_o));
+        auto theta_e = std::acos(interval(-1, 1).clamp(b.cos_theta_e));
+        auto theta_w = std::fmin(theta_o + theta_e, pi);
+        auto sin_theta_o = std::sin(theta_o);
+        auto m_omega = 2*pi * (1 - b.cos_theta_o)
+                     + pi/2 * (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w)
+                               - 2 * theta_o * sin_theta_o + b.cos_theta_o);
+        auto d = vec3(b.bounds.x.size(), b.bounds.y.size(), b.bounds.z.size());
+        auto area = 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+        return b.phi * m_omega * area;
+    }
+};
+
+// Multiple importance sampling weights for a sample drawn with density f_pdf, when the same
+// direction could also have been drawn by a second strategy with density g_pdf.
+
+inline double balance_heuristic(double f_pdf, double g_pdf) {
+    return f_pdf / (f_pdf + g_pdf);
+}
+
+inline double power_heuristic(double f_pdf, double g_pdf) {
+    auto f2 = f_pdf * f_pdf;
+    auto g2 = g_pdf * g_pdf;
+    return f2 / (f2 + g2);
+}
+
+#endif
@@ -3,75 +3,157 @@
 
 #include "rtweekend.h"
 
+#include "onb.h"
 #include "texture.h"
 
+#include <utility>
+#include <variant>
+
 class hit_record;
 
-class material { //abstract material class, rays scatter off of materials differently to get different effects
+class scatter_record { // The result of sampling a material
   public:
-    virtual ~material() = default;
+    ray scattered;
+    color attenuation; // Weight of the scattered ray: eval() / pdf() for the sampled direction
+    double pdf;        // Solid angle density the direction was sampled with
+    bool is_specular;  // Mirror or glass: a single direction, which lights cannot be sampled for
+};
 
-    virtual color emitted(double u, double v, const point3& p) const {
+// The materials a scene can use form a closed set: each is a plain class, and material (at the
+// end of this file) holds one of them in a std::variant, like texture does (see texture.h).
+// material_base holds the defaults; each material hides the ones it does differently.
+
+class material_base {
+  public:
+    color emitted(double u, double v, const point3& p) const {
       return color(0, 0, 0);
     }
-    
-    virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-    ) const {
+
+    bool is_emissive() const { return false; }
+
+    // Samples a scattered ray, using the sample values uc (for discrete choices) and u (for
+    // the direction). Returns false if the ray is absorbed.
+    bool sample(const ray& r_in, const hit_record& rec, double uc, const point2& u, scatter_record& srec) const {
         return false;
     }
+
+    // How much of the light arriving from direction the material sends back along r_in, per
+    // unit solid angle (the BSDF or phase function, times the cosine). Not used for specular
+    // materials.
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return color(0, 0, 0);
+    }
+
+    // Solid angle density with which sample() picks direction.
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return 0;
+    }
+
+    // Surface color at the hit, for the denoiser's albedo buffer. Materials without one
+    // (glass, lights) leave the light they pass on unscaled.
+    color albedo_at(const hit_record& rec) const {
+        return color(1, 1, 1);
+    }
+
+    // True if the material reflects albedo_at(rec) / pi of the irradiance in every direction,
+    // so an irradiance cache can stand in for its scattering.
+    bool is_diffuse() const { return false; }
 };
 
-class lambertian : public material { // This is a diffuse or "matte" material, uses lambertian reflectance to achieve this affect
+class lambertian : public material_base { // This is a diffuse or "matte" material, uses lambertian reflectance to achieve this affect
   public:
     // Change to make a solid colour texture rather than a colour
     // lambertian(const color& a) : albedo(a) {}
 
-    lambertian(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    lambertian(shared_ptr<texture> tex) : tex(tex) {}
-
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
-        auto scatter_direction = rec.normal + random_unit_vector(); //Essentially scatters in a random direction, determined using a 
-        //unit sphere
+    // Textures are owned by the scene's texture table; a plain color is kept inline.
+    lambertian(const color& albedo) : albedo(albedo), tex(nullptr) {}
+    lambertian(const texture* tex) : tex(tex) {}
 
-        // Catch degenerate scatter direction when the random vector points against the normal
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
+    bool sample(const ray& r_in, const hit_record& rec, double uc, const point2& u, scatter_record& srec)
+    const {
+        // Cosine distribution around the normal
+        auto scatter_direction = onb(rec.normal).transform(sample_cosine_hemisphere(u));
 
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        srec.scattered = ray(rec.p, scatter_direction, r_in.time());
+        srec.attenuation = tex ? tex->value(rec.u, rec.v, rec.p, rec.du, rec.dv) : albedo;
+        srec.pdf = pdf(r_in, rec, scatter_direction);
+        srec.is_specular = false;
         return true;
     }
 
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return (tex ? tex->value(rec.u, rec.v, rec.p, rec.du, rec.dv) : albedo) * pdf(r_in, rec, direction);
+    }
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        auto cos_theta = dot(rec.normal, unit_vector(direction));
+        return cos_theta > 0 ? cos_theta / pi : 0;
+    }
+
+    color albedo_at(const hit_record& rec) const {
+        return tex ? tex->value(rec.u, rec.v, rec.p, rec.du, rec.dv) : albedo;
+    }
+
+    bool is_diffuse() const { return true; }
+
   private:
-    shared_ptr<texture> tex;
+    color albedo;
+    const texture* tex;
 };
 
-class metal : public material {// metals are reflective, and have a fuzziness factor
+class metal : public material_base {// metals are reflective, and have a fuzziness factor
     public:
     metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
+    bool sample(const ray& r_in, const hit_record& rec, double uc, const point2& u, scatter_record& srec)
+    const {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz*random_unit_vector(), r_in.time());
-        attenuation = albedo;
-        return (dot(scattered.direction(), rec.normal) > 0);
+        srec.scattered = ray(rec.p, reflected + fuzz*sample_uniform_sphere(u), r_in.time());
+        srec.attenuation = albedo;
+        srec.is_specular = fuzz <= 0;
+        srec.pdf = srec.is_specular ? 0 : pdf(r_in, rec, srec.scattered.direction());
+        return (dot(srec.scattered.direction(), rec.normal) > 0);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        // Directions below the surface are absorbed, so the weight of every sample is albedo
+        if (dot(direction, rec.normal) <= 0)
+            return color(0, 0, 0);
+        return albedo * pdf(r_in, rec, direction);
     }
 
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        // The sampled direction points at a uniform point on a sphere of radius fuzz around the
+        // unit mirror direction R. A direction d crosses that sphere at distances t1, t2 with
+        // t1 + t2 = 2c and t1 t2 = 1 - fuzz^2, where c = dot(d, R). Adding the area to solid
+        // angle factor t^2 / (4 pi fuzz^2 |cos|) of both crossings gives the density below.
+        if (fuzz <= 0)
+            return 0;
+        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+        auto c = dot(unit_vector(direction), reflected);
+        auto k = 1 - fuzz*fuzz;
+        auto disc = c*c - k;
+        if (c <= 0 || disc <= 0)
+            return 0;
+        return (2*c*c - k) / (2 * pi * fuzz * sqrt(disc));
+    }
+
+    color albedo_at(const hit_record& rec) const { return albedo; }
+
   private:
     color albedo;
     double fuzz;
 };
 
-class dielectric : public material { //Dielectrics are transparent materials
+class dielectric : public material_base { //Dielectrics are transparent materials
   public:
     dielectric(double index_of_refraction) : ir(index_of_refraction) {} 
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
-        attenuation = color(1.0, 1.0, 1.0);
+    bool sample(const ray& r_in, const hit_record& rec, double uc, const point2& u, scatter_record& srec)
+    const {
+        srec.attenuation = color(1.0, 1.0, 1.0);
+        srec.pdf = 0;
+        srec.is_specular = true;
         double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
         vec3 unit_direction = unit_vector(r_in.direction());
@@ -84,12 +166,12 @@ class dielectric : public material { //Dielectrics are transparent materials
 
         // Use Schlick's approximation for reflectance.
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > uc)
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-        scattered = ray(rec.p, direction, r_in.time());
+        srec.scattered = ray(rec.p, direction, r_in.time());
         return true;
     }
 
@@ -104,32 +186,91 @@ class dielectric : public material { //Dielectrics are transparent materials
     }
 };
 
-class diffuse_light : public material {
+class diffuse_light : public material_base {
   public:
-  diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-  diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
+  diffuse_light(const texture* tex) : tex(tex) {}
+  diffuse_light(const color& emit) : emit(emit), tex(nullptr) {}
 
-  color emitted(double u, double v, const point3& p) const override {
-    return tex->value(u, v, p);
+  color emitted(double u, double v, const point3& p) const {
+    return tex ? tex->value(u, v, p) : emit;
   }
+
+  bool is_emissive() const { return true; }
+
+  color albedo_at(const hit_record& rec) const { return color(0, 0, 0); } // Reflects nothing
   private:
-  shared_ptr<texture> tex;
+  color emit;
+  const texture* tex;
 };
 
-class isotropic : public material {
+class isotropic : public material_base {
   public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    isotropic(shared_ptr<texture> tex) : tex(tex) {}
+    isotropic(const color& albedo) : albedo(albedo), tex(nullptr) {}
+    isotropic(const texture* tex) : tex(tex) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+    bool sample(const ray& r_in, const hit_record& rec, double uc, const point2& u, scatter_record& srec)
+    const {
+        srec.scattered = ray(rec.p, sample_uniform_sphere(u), r_in.time());
+        srec.attenuation = tex ? tex->value(rec.u, rec.v, rec.p, rec.du, rec.dv) : albedo;
+        srec.pdf = 1 / (4 * pi);
+        srec.is_specular = false;
         return true;
     }
 
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return (tex ? tex->value(rec.u, rec.v, rec.p, rec.du, rec.dv) : albedo) / (4 * pi);
+    }
+
+    color albedo_at(const hit_record& rec) const {
+        return tex ? tex->value(rec.u, rec.v, rec.p, rec.du, rec.dv) : albedo;
+    }
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return 1 / (4 * pi);
+    }
+
+  private:
+    color albedo;
+    const texture* tex;
+};
+
+class material {
+  // One of the materials above. Calls go to it through std::visit, a switch on the kind of
+  // material that the compiler can inline each case of, where a virtual call cannot be.
+  public:
+    template <typename M, typename... Args>
+    explicit material(std::in_place_type_t<M> type, Args&&... args) : impl(type, std::forward<Args>(args)...) {}
+
+    color emitted(double u, double v, const point3& p) const {
+        return std::visit([&](const auto& m) { return m.emitted(u, v, p); }, impl);
+    }
+
+    bool is_emissive() const {
+        return std::visit([](const auto& m) { return m.is_emissive(); }, impl);
+    }
+
+    bool sample(const ray& r_in, const hit_record& rec, double uc, const point2& u, scatter_record& srec) const {
+        return std::visit([&](const auto& m) { return m.sample(r_in, rec, uc, u, srec); }, impl);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return std::visit([&](const auto& m) { return m.eval(r_in, rec, direction); }, impl);
+    }
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return std::visit([&](const auto& m) { return m.pdf(r_in, rec, direction); }, impl);
+    }
+
+    color albedo_at(const hit_record& rec) const {
+        return std::visit([&](const auto& m) { return m.albedo_at(rec); }, impl);
+    }
+
+    bool is_diffuse() const {
+        return std::visit([](const auto& m) { return m.is_diffuse(); }, impl);
+    }
+
   private:
-    shared_ptr<texture> tex;
+    std::variant<lambertian, metal, dielectric, diffuse_light, isotropic> impl;
 };
 
 #endif
\ No newline at end of file
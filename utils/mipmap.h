@@ -0,0 +1,177 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "rtw_stg_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Mip pyramids: an image and versions of it each half the size of the one before, every
+// texel the average of the four below it. A lookup whose footprint covers many texels reads
+// a level where it covers about one, instead of a single texel that aliases and a far apart
+// texel on the next sample that misses the cache.
+//
+// The helpers in mip build and filter pyramids whatever stores their texels; mipmap below keeps
+// one in memory, and texture_cache.h pages one in from disk.
+
+namespace mip {
+    inline int level_size(int size, int level) {
+        // Width or height of a level; odd sizes round up
+        for (; level > 0; level--)
+            size = std::max(1, (size + 1) / 2);
+        return size;
+    }
+
+    inline int level_count(int width, int height) {
+        // Levels down to and including 1x1
+        int count = 1;
+        for (; width > 1 || height > 1; count++) {
+            width = std::max(1, (width + 1) / 2);
+            height = std::max(1, (height + 1) / 2);
+        }
+        return count;
+    }
+
+    inline std::vector<unsigned char> read_image(const rtw_image& image) {
+        // The linear RGB bytes of an image loaded as rtw_image::linear_bytes, in scanline order
+        auto w = image.width(), h = image.height();
+        std::vector<unsigned char> pixels(size_t(w) * h * 3);
+        for (int y = 0; y < h; y++)
+            std::copy_n(image.pixel_data(0, y), size_t(w) * 3, &pixels[size_t(y) * w * 3]);
+        return pixels;
+    }
+
+    inline std::vector<unsigned char> downsample(const std::vector<unsigned char>& pixels, int w, int h) {
+        // The next level of RGB pixels, w by h: a box filter over 2x2 blocks, rounded, where
+        // with an odd size the last row or column is reused
+        auto nw = level_size(w, 1), nh = level_size(h, 1);
+        std::vector<unsigned char> out(size_t(nw) * nh * 3);
+        for (int y = 0; y < nh; y++) {
+            auto y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+            for (int x = 0; x < nw; x++) {
+                auto x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                for (int c = 0; c < 3; c++) {
+                    auto at = [&](int px, int py) { return int(pixels[(size_t(py) * w + px) * 3 + c]); };
+                    out[(size_t(y) * nw + x) * 3 + c] = (unsigned char)((at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1) + 2) / 4);
+                }
+            }
+        }
+        return out;
+    }
+
+    template <typename Texel>
+    color bilinear(int w, int h, double u, double v, const Texel& texel) {
+        // Filtered color of a level w by h at (u, v), v up; texel(x, y) is its color at a texel.
+        // Texel centers sit at half integers; coordinates clamp at the edges.
+        auto x = interval(0.0, 1.0).clamp(u) * w - 0.5;
+        auto y = (1.0 - interval(0.0, 1.0).clamp(v)) * h - 0.5; // Rows go down
+        auto fx = std::floor(x), fy = std::floor(y);
+        auto tx = x - fx, ty = y - fy;
+        auto x0 = std::clamp(int(fx), 0, w - 1), x1 = std::clamp(int(fx) + 1, 0, w - 1);
+        auto y0 = std::clamp(int(fy), 0, h - 1), y1 = std::clamp(int(fy) + 1, 0, h - 1);
+        return (1 - ty) * ((1 - tx) * texel(x0, y0) + tx * texel(x1, y0))
+             + ty * ((1 - tx) * texel(x0, y1) + tx * texel(x1, y1));
+    }
+
+    template <typename Texel>
+    color trilinear(int w, int h, int levels, double u, double v, double du, double dv, const Texel& texel) {
+        // Filtered color at (u, v) for a footprint du by dv wide, from the two levels around
+        // its size; texel(level, x, y) is a level's color at a texel. A footprint of 0 reads
+        // the full size image, bilinearly filtered.
+        auto at_level = [&](int level) {
+            return bilinear(level_size(w, level), level_size(h, level), u, v,
+                            [&](int x, int y) { return texel(level, x, y); });
+        };
+        auto footprint = std::fmax(du * w, dv * h);
+        auto lod = footprint > 1 ? std::log2(footprint) : 0.0;
+        if (lod >= levels - 1)
+            return at_level(levels - 1);
+
+        auto fine = int(lod);
+        auto t = lod - fine;
+        auto c = at_level(fine);
+        if (t > 0)
+            c = (1 - t) * c + t * at_level(fine + 1);
+        return c;
+    }
+}
+
+class mipmap {
+  // A pyramid of 8-bit texels in memory. Every level is stored in tiles of 8x8 texels, row by
+  // row inside a tile, so texels that are close in both directions are close in memory and a
+  // filtered lookup touches one or two tiles. The pyramid is the only copy of the image a
+  // texture keeps.
+  public:
+    mipmap() {}
+
+    explicit mipmap(const rtw_image& image) {
+        // From an image loaded as rtw_image::linear_bytes
+        auto w = image.width(), h = image.height();
+        if (w <= 0 || h <= 0)
+            return;
+
+        auto current = mip::read_image(image);
+        for (;;) {
+            add_level(w, h, current);
+            if (w == 1 && h == 1)
+                break;
+            current = mip::downsample(current, w, h);
+            w = mip::level_size(w, 1);
+            h = mip::level_size(h, 1);
+        }
+    }
+
+    bool empty() const { return levels.empty(); }
+    int width() const { return empty() ? 0 : levels[0].width; }
+    int height() const { return empty() ? 0 : levels[0].height; }
+    size_t bytes() const { return texels.size() + levels.size() * sizeof(level); }
+
+    color lookup(double u, double v, double du, double dv) const {
+        // Trilinear filtered color at (u, v), v up, for a footprint du by dv wide
+        return mip::trilinear(width(), height(), int(levels.size()), u, v, du, dv, [&](int l, int x, int y) {
+            auto p = &texels[index(levels[l], x, y)];
+            return color(p[0], p[1], p[2]) / 255.0;
+        });
+    }
+
+  private:
+    struct level {
+        int width, height;
+        int tiles_x;       // Tiles per row
+        size_t offset;     // Of the first texel in texels
+    };
+
+    static constexpr int tile = 8;
+
+    std::vector<level> levels;
+    std::vector<unsigned char> texels; // RGB, every level one after another
+
+    void add_level(int w, int h, const std::vector<unsigned char>& pixels) {
+        // Stores pixels, w by h in scanline order, as the next level
+        level lv;
+        lv.width = w;
+        lv.height = h;
+        lv.tiles_x = (w + tile - 1) / tile;
+        lv.offset = texels.size();
+        auto tiles_y = (h + tile - 1) / tile;
+        texels.resize(texels.size() + size_t(lv.tiles_x) * tiles_y * tile * tile * 3);
+        levels.push_back(lv);
+
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                for (int c = 0; c < 3; c++)
+                    texels[index(lv, x, y) + c] = pixels[(size_t(y) * w + x) * 3 + c];
+    }
+
+    static size_t index(const level& lv, int x, int y) {
+        // Offset of texel (x, y)'s red byte
+        auto t = size_t(y / tile) * lv.tiles_x + x / tile;
+        return lv.offset + (t * tile * tile + (y % tile) * tile + x % tile) * 3;
+    }
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "rtweekend.h"
+
+class onb {
+  // Orthonormal basis with w along a given direction, for sampling directions around it.
+  public:
+    onb(const vec3& n) {
+        axis[2] = unit_vector(n);
+        vec3 a = (fabs(axis[2].x()) > 0.9) ? vec3(0,1,0) : vec3(1,0,0);
+        axis[1] = unit_vector(cross(axis[2], a));
+        axis[0] = cross(axis[2], axis[1]);
+    }
+
+    const vec3& u() const { return axis[0]; }
+    const vec3& v() const { return axis[1]; }
+    const vec3& w() const { return axis[2]; }
+
+    vec3 transform(const vec3& v) const {
+        // Transform from basis coordinates to world space
+        return (v[0] * axis[0]) + (v[1] * axis[1]) + (v[2] * axis[2]);
+    }
+
+  private:
+    vec3 axis[3];
+};
+
+inline vec3 random_to_sphere(double radius, double distance_squared, const point2& u) {
+    // Uniform direction, in basis coordinates, inside the cone subtended by a sphere of the
+    // given radius whose center is distance_squared away along w.
+    auto r1 = u.x;
+    auto r2 = u.y;
+    auto z = 1 + r2*(sqrt(1 - radius*radius/distance_squared) - 1);
+
+    auto phi = 2*pi*r1;
+    auto x = cos(phi) * sqrt(1 - z*z);
+    auto y = sin(phi) * sqrt(1 - z*z);
+
+    return vec3(x, y, z);
+}
+
+#endif
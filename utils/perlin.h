@@ -3,115 +3,238 @@
 
 #include "rtweekend.h"
 
+#include "aabb.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <random>
+#include <vector>
+
+// Perlin gradient noise. Every perlin reads one lattice of gradients and permutations, built
+// once from a fixed seed, so a scene's noise textures cost no memory each and the same noise
+// comes out whatever else the scene draws from the random generator.
+//
+// A noise value blends the gradients at the 8 corners of the lattice cell around p. They are
+// evaluated 4 at a time in SSE registers, the corners with di = 0 in one and di = 1 in the
+// other, and then blended along x, z and y without leaving them. Each gradient is 4 floats,
+// so it is one aligned load. Builds without SSE2 do the same float arithmetic one corner at
+// a time.
+
 class perlin
 {
 public:
-    perlin()
-    { 
-        randvec = new vec3[point_count];
-        for (int i = 0; i < point_count; i++)
-        {
-            randvec[i] = unit_vector(vec3::random(-1,1));
-        }
-
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
-    }
-
-    ~perlin()
-    {
-        delete[] randvec;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
-    }
+    perlin() : table(&lattice::shared()) {}
 
     double noise(const point3 &p) const
     {
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());
-
-        auto i = int(floor(p.x()));
-        auto j = int(floor(p.y()));
-        auto k = int(floor(p.z()));
-        vec3 c[2][2][2];
-        for (int di=0; di < 2; di++){
-            for (int dj=0; dj <2; dj++){
-                for (int dk=0; dk < 2; dk++){
-                    c[di][dj][dk] = randvec[
-                        perm_x[(i+di) & 255] ^
-                        perm_y[(j+dj) & 255] ^
-                        perm_z[(k+dk) & 255]];
-                }
-            }
-        }
+        auto fx = lattice_floor(p.x()), fy = lattice_floor(p.y()), fz = lattice_floor(p.z());
+        auto u = float(p.x() - fx), v = float(p.y() - fy), w = float(p.z() - fz);
+        auto i = fx & 255, j = fy & 255, k = fz & 255;
+
+        int x0 = table->perm_x[i], x1 = table->perm_x[(i + 1) & 255];
+        int y0 = table->perm_y[j], y1 = table->perm_y[(j + 1) & 255];
+        int z0 = table->perm_z[k], z1 = table->perm_z[(k + 1) & 255];
+        // Gradient of corner (di, dj, dk) is at corner[4*di + 2*dj + dk]
+        int corner[8] = { x0^y0^z0, x0^y0^z1, x0^y1^z0, x0^y1^z1, x1^y0^z0, x1^y0^z1, x1^y1^z0, x1^y1^z1 };
+
+        auto uu = u*u*(3-2*u);
+        auto vv = v*v*(3-2*v);
+        auto ww = w*w*(3-2*w);
 
-        return perlin_interp(c, u, v, w);
+#if defined(RT_SIMD_AVX2) || defined(RT_SIMD_SSE2)
+        auto dv = _mm_setr_ps(v, v, v - 1, v - 1);
+        auto dw = _mm_setr_ps(w, w - 1, w, w - 1);
+        auto dots = [&](const int* c, float du) {
+            // Gradients of 4 corners dotted with the offsets from them to p: one load per
+            // gradient, then a transpose to put each component in a register of its own
+            auto gx = _mm_load_ps(table->g[c[0]]), gy = _mm_load_ps(table->g[c[1]]);
+            auto gz = _mm_load_ps(table->g[c[2]]), g3 = _mm_load_ps(table->g[c[3]]);
+            _MM_TRANSPOSE4_PS(gx, gy, gz, g3);
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, _mm_set1_ps(du)), _mm_mul_ps(gy, dv)), _mm_mul_ps(gz, dw));
+        };
+        auto n0 = dots(corner, u), n1 = dots(corner + 4, u - 1);
+        // Along x: lanes (dj, dk) = 00, 01, 10, 11
+        auto nx = _mm_add_ps(n0, _mm_mul_ps(_mm_set1_ps(uu), _mm_sub_ps(n1, n0)));
+        // Along z: lanes dj = 0, 1
+        auto lo = _mm_shuffle_ps(nx, nx, _MM_SHUFFLE(2, 0, 2, 0));
+        auto hi = _mm_shuffle_ps(nx, nx, _MM_SHUFFLE(3, 1, 3, 1));
+        auto nz = _mm_add_ps(lo, _mm_mul_ps(_mm_set1_ps(ww), _mm_sub_ps(hi, lo)));
+        float out[4];
+        _mm_storeu_ps(out, nz);
+        return out[0] + vv * (out[1] - out[0]);
+#else
+        float n[8];
+        for (int c = 0; c < 8; c++) {
+            auto g = corner[c];
+            auto du = (c & 4) ? u - 1 : u, dv = (c & 2) ? v - 1 : v, dw = (c & 1) ? w - 1 : w;
+            n[c] = table->g[g][0] * du + table->g[g][1] * dv + table->g[g][2] * dw;
+        }
+        float nz[2];
+        for (int dj = 0; dj < 2; dj++) {
+            auto a = n[2*dj] + uu * (n[4 + 2*dj] - n[2*dj]);
+            auto b = n[2*dj + 1] + uu * (n[4 + 2*dj + 1] - n[2*dj + 1]);
+            nz[dj] = a + ww * (b - a);
+        }
+        return nz[0] + vv * (nz[1] - nz[0]);
+#endif
     }
 
-    double turb(const point3& p, int depth) const {
+    double octaves(const point3& p, int first, int last) const {
+        // Octaves first..last-1 of turbulence at p, each twice the frequency and half the
+        // weight of the one before, summed with their signs
         auto accum = 0.0;
-        auto temp_p = p;
-        auto weight = 1.0;
+        auto temp_p = std::ldexp(1.0, first) * p;
+        auto weight = std::ldexp(1.0, -first);
 
-        for (int i = 0; i < depth; i++){
+        for (int i = first; i < last; i++){
             accum += weight * noise(temp_p);
             weight *= 0.5;
             temp_p *= 2;
         }
 
-        return fabs(accum);
+        return accum;
+    }
+
+    double turb(const point3& p, int depth) const {
+        return std::fabs(octaves(p, 0, depth));
     }
 
 private:
-    static const int point_count = 256;
-    vec3 *randvec;
-    int *perm_x;
-    int *perm_y;
-    int *perm_z;
+    static int lattice_floor(double x) {
+        // floor() as an int, without the library call SSE2 builds make for std::floor
+        auto i = int(x);
+        return i - (x < i);
+    }
 
-    static int *perlin_generate_perm()
-    {
-        auto p = new int[point_count];
+    struct lattice {
+        static const int point_count = 256;
+        alignas(16) float g[point_count][4]; // Unit gradients, x y z and a zero pad
+        std::uint8_t perm_x[point_count], perm_y[point_count], perm_z[point_count];
 
-        for (int i = 0; i < point_count; i++)
-        {
-            p[i] = i;
+        static const lattice& shared() {
+            static const lattice table;
+            return table;
+        }
+
+        lattice() {
+            std::mt19937 generator(0x9e1d);
+            std::uniform_real_distribution<double> unit(-1, 1);
+            for (int i = 0; i < point_count; i++) {
+                auto g = unit_vector(vec3(unit(generator), unit(generator), unit(generator)));
+                this->g[i][0] = float(g.x());
+                this->g[i][1] = float(g.y());
+                this->g[i][2] = float(g.z());
+                this->g[i][3] = 0;
+            }
+            generate_perm(perm_x, generator);
+            generate_perm(perm_y, generator);
+            generate_perm(perm_z, generator);
         }
-        permute(p, point_count);
-        return p;
-    }
 
-    static void permute(int *p, int n)
+        static void generate_perm(std::uint8_t* p, std::mt19937& generator) {
+            for (int i = 0; i < point_count; i++)
+                p[i] = std::uint8_t(i);
+            std::shuffle(p, p + point_count, generator);
+        }
+    };
+
+    const lattice* table;
+};
+
+class noise_volume {
+  // Turbulence baked into a grid of floats over a box, for scenes that look up a lot of noise
+  // in one place. The octaves whose lattice spans at least 4 grid cells are summed in the grid
+  // and read back with one trilinear lookup; the finer ones, which the grid would blur, are
+  // still computed at each lookup, as is everything outside the box. The grid is as fine as
+  // memory_budget bytes allow.
+  public:
+    noise_volume() {}
+
+    noise_volume(const perlin& noise, const aabb& region, int depth, size_t memory_budget)
+      : depth(depth)
     {
-        for (int i = n - 1; i > 0; i--)
-        {
-            int target = random_int(0, i);
-            int tmp = p[i];
-            p[i] = p[target];
-            p[target] = tmp;
+        double extent[3], volume = 1;
+        for (int a = 0; a < 3; a++) {
+            extent[a] = region.axis_interval(a).size();
+            volume *= extent[a];
+        }
+        auto cells = double(memory_budget / sizeof(float));
+        if (!(volume > 0) || cells < 8)
+            return;
+        // Samples sit on the corners of the cells, one more than cells along each axis
+        auto cell = std::cbrt(volume / cells);
+        for (;;) {
+            size_t total = 1;
+            for (int a = 0; a < 3; a++)
+                total *= size_t(std::ceil(extent[a] / cell)) + 1;
+            if (total * sizeof(float) <= memory_budget)
+                break;
+            cell *= 1.05;
+        }
+        while (baked < depth && std::ldexp(1.0, -baked) >= 4 * cell)
+            baked++;
+        if (baked == 0)
+            return; // Too coarse for any octave
+
+        for (int a = 0; a < 3; a++) {
+            origin[a] = region.axis_interval(a).min;
+            size[a] = int(std::ceil(extent[a] / cell)) + 1;
         }
+        inv_cell = 1 / cell;
+        samples.resize(size_t(size[0]) * size[1] * size[2]);
+
+        // A slab of z per job on the shared pool
+        std::vector<std::future<void>> slabs;
+        for (int z = 0; z < size[2]; z++) {
+            slabs.push_back(thread_pool::shared().submit([&, z] {
+                for (int y = 0; y < size[1]; y++)
+                    for (int x = 0; x < size[0]; x++) {
+                        auto p = point3(origin[0] + x * cell, origin[1] + y * cell, origin[2] + z * cell);
+                        samples[index(x, y, z)] = float(noise.octaves(p, 0, baked));
+                    }
+            }));
+        }
+        for (auto& s : slabs)
+            s.get();
     }
 
-    static double perlin_interp(const vec3 c[2][2][2], double u, double v, double w) {
-        auto uu = u*u*(3-2*u);
-        auto vv = v*v*(3-2*v);
-        auto ww = w*w*(3-2*w);
-
-        auto accum = 0.0;
-        for (int i = 0; i< 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++){
-                    vec3 weight_v(u-i, v-j, w-k);
-                    accum += (i*uu + (1-i)*(1-uu))
-                    * (j*vv + (1-j)*(1-vv))
-                    * (k*ww + (1-k)*(1-ww))
-                    * dot(c[i][j][k], weight_v);
-                }
-        return accum;
+    bool empty() const { return samples.empty(); }
+    size_t bytes() const { return samples.size() * sizeof(float); }
+    int baked_octaves() const { return baked; }
+
+    double turb(const perlin& noise, const point3& p) const {
+        // Same as noise.turb(p, depth), to within the grid's interpolation
+        if (empty())
+            return noise.turb(p, depth);
+        double f[3];
+        int c[3];
+        for (int a = 0; a < 3; a++) {
+            auto x = (p[a] - origin[a]) * inv_cell;
+            if (!(x >= 0 && x < size[a] - 1))
+                return noise.turb(p, depth);
+            c[a] = int(x);
+            f[a] = x - c[a];
+        }
+        auto at = [&](int dx, int dy, int dz) { return double(samples[index(c[0] + dx, c[1] + dy, c[2] + dz)]); };
+        auto lerp = [](double a, double b, double t) { return a + t * (b - a); };
+        auto y0 = lerp(lerp(at(0,0,0), at(1,0,0), f[0]), lerp(at(0,1,0), at(1,1,0), f[0]), f[1]);
+        auto y1 = lerp(lerp(at(0,0,1), at(1,0,1), f[0]), lerp(at(0,1,1), at(1,1,1), f[0]), f[1]);
+        return std::fabs(lerp(y0, y1, f[2]) + noise.octaves(p, baked, depth));
     }
+
+  private:
+    int depth = 0;
+    int baked = 0;                // Octaves in the grid
+    double origin[3];
+    double inv_cell = 0;
+    int size[3] = {0, 0, 0};      // Samples along each axis
+    std::vector<float> samples;
+
+    size_t index(int x, int y, int z) const { return (size_t(z) * size[1] + y) * size[0] + x; }
 };
 
-#endif
\ No newline at end of file
+#endif
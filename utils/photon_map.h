@@ -0,0 +1,322 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "sampler.h"
+#include "scene.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <vector>
+
+// Caustic photon map, after Jensen, "Realistic Image Synthesis Using Photon Mapping". Photons
+// leave the scene's lights, pass through glass and off mirrors, and are stored where they land
+// on the first surface that is not specular. The camera then estimates the caustic light at a
+// surface from the photons nearest to it, instead of hoping a path from that surface finds the
+// light through the glass by chance (which is what makes caustics fireflies).
+//
+// Photons are kept in a left-balanced kd-tree stored as an implicit heap: node i has children
+// 2i+1 and 2i+2, so the tree needs no pointers and a search walks through contiguous memory.
+
+class photon_map {
+  public:
+    // Shoots photon_count photons from the lights of scn, spread over the shared thread pool,
+    // following each through at most max_depth bounces. At most memory_budget bytes of photons
+    // are kept; beyond that a uniform subset stands in for the rest, with its power scaled up.
+    // Photons leave at times between shutter_open and shutter_close, like the camera's rays.
+    photon_map(const scene& scn, size_t photon_count, size_t memory_budget, int max_depth,
+               double shutter_open, double shutter_close) {
+        for (int i = 0; i < 256; i++) {
+            auto theta = pi * (i + 0.5) / 256;
+            auto phi = 2*pi * (i + 0.5) / 256;
+            cos_theta[i] = std::cos(theta);
+            sin_theta[i] = std::sin(theta);
+            cos_phi[i] = std::cos(phi);
+            sin_phi[i] = std::sin(phi);
+        }
+
+        auto bounds = scn.world.bounding_box();
+        auto diagonal = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length();
+        max_radius_squared = (max_radius_fraction * diagonal) * (max_radius_fraction * diagonal);
+
+        auto lights = scn.lights.primitive_count();
+        if (photon_count == 0 || lights == 0)
+            return;
+        std::vector<double> power(lights);
+        for (size_t i = 0; i < lights; i++)
+            power[i] = scn.lights.power(i);
+        alias_table emitters(power);
+        if (emitters.empty())
+            return;
+
+        auto workers = unsigned(thread_pool::shared().size());
+        auto capacity = std::max<size_t>(1, memory_budget / sizeof(photon) / workers);
+        std::vector<std::vector<photon>> found(workers);
+        std::vector<std::uint64_t> landed(workers, 0);
+        std::vector<std::future<void>> jobs;
+        for (unsigned w = 0; w < workers; w++) {
+            auto begin = photon_count * w / workers, end = photon_count * (w + 1) / workers;
+            jobs.push_back(thread_pool::shared().submit([&, w, begin, end] {
+                shoot(scn, emitters, photon_count, begin, end, max_depth, shutter_open, shutter_close,
+                      capacity, found[w], landed[w]);
+            }));
+        }
+        for (auto& job : jobs)
+            job.get();
+
+        std::vector<photon> all;
+        for (unsigned w = 0; w < workers; w++) {
+            // Photons a full worker had to drop are made up for by the ones it kept
+            auto scale = found[w].empty() ? 1.0f : float(double(landed[w]) / found[w].size());
+            for (auto ph : found[w]) {
+                for (auto& c : ph.power)
+                    c *= scale;
+                all.push_back(ph);
+            }
+            total_landed += landed[w];
+            std::vector<photon>().swap(found[w]);
+        }
+
+        heap.resize(all.size());
+        balance(all, 0, all.size(), 0);
+    }
+
+    size_t size() const { return heap.size(); }
+    size_t bytes() const { return heap.size() * sizeof(photon); }
+    std::uint64_t landed() const { return total_landed; }
+
+    color radiance(const ray& r, const hit_record& rec, const material& mat) const {
+        // Caustic light the surface at rec reflects back along r, estimated from the nearest
+        // photons: their power through the material, over the area of the disc they cover
+        if (heap.empty())
+            return color(0,0,0);
+
+        neighbour nearest[gather_count];
+        int count = 0;
+        auto radius_squared = max_radius_squared;
+        locate(rec.p, 0, nearest, count, radius_squared);
+        if (count == 0)
+            return color(0,0,0);
+
+        color sum(0,0,0);
+        auto thickness = 0.25 * std::sqrt(radius_squared);
+        for (int k = 0; k < count; k++) {
+            const auto& ph = heap[nearest[k].index];
+            auto offset = point3(ph.position[0], ph.position[1], ph.position[2]) - rec.p;
+            if (std::fabs(dot(offset, rec.normal)) > thickness)
+                continue; // On another surface nearby
+            auto incoming = -direction_of(ph);
+            auto cosine = dot(incoming, rec.normal);
+            if (cosine <= 0)
+                continue;
+            auto f = mat.eval(r, rec, incoming) / cosine;
+            sum += f * color(ph.power[0], ph.power[1], ph.power[2]);
+        }
+        return sum / (pi * radius_squared);
+    }
+
+  private:
+    struct photon {
+        float position[3];
+        float power[3];             // Flux it carries
+        std::uint8_t theta, phi;    // Direction it travelled, quantized
+        std::uint8_t axis;          // kd-tree split axis
+    };
+
+    struct neighbour {
+        double distance_squared;
+        size_t index;
+        bool operator<(const neighbour& o) const { return distance_squared < o.distance_squared; }
+    };
+
+    static constexpr int gather_count = 64;            // Photons per estimate
+    static constexpr double max_radius_fraction = 0.02; // Largest gather radius, of the scene's diagonal
+
+    std::vector<photon> heap;
+    std::uint64_t total_landed = 0;
+    double max_radius_squared;
+    double cos_theta[256], sin_theta[256], cos_phi[256], sin_phi[256];
+
+    vec3 direction_of(const photon& ph) const {
+        return vec3(sin_theta[ph.theta] * cos_phi[ph.phi], sin_theta[ph.theta] * sin_phi[ph.phi],
+                    cos_theta[ph.theta]);
+    }
+
+    static void shoot(
+        const scene& scn, const alias_table& emitters, size_t photon_count, size_t begin, size_t end,
+        int max_depth, double shutter_open, double shutter_close, size_t capacity, std::vector<photon>& out,
+        std::uint64_t& landed
+    ) {
+        // Photons begin..end of photon_count. Each takes its sample values from a hash of its
+        // index, so threads need no shared random state.
+        out.reserve(std::min<size_t>(capacity, 1 << 16));
+        for (auto i = begin; i < end; i++) {
+            std::uint32_t dimension = 0;
+            auto next = [&] {
+                return sampling::to_unit(sampling::hash(std::uint32_t(i), dimension++, std::uint32_t(i >> 32)));
+            };
+            auto next_2d = [&] { auto x = next(); return point2{x, next()}; };
+
+            double remapped;
+            auto light = emitters.sample(next(), remapped);
+            auto light_probability = emitters.probability(light);
+
+            hit_record rec;
+            auto time = shutter_open + (shutter_close - shutter_open) * next();
+            auto area_pdf = scn.lights.primitive(light)->sample_surface(next_2d(), time, rec);
+            if (area_pdf <= 0)
+                continue;
+            auto normal = rec.normal;
+            double side_probability = 1;
+            if (scn.lights.two_sided(light)) {
+                side_probability = 0.5;
+                if (next() < 0.5)
+                    normal = -normal;
+            }
+
+            // Cosine distributed direction: the cosine in the emitted flux cancels against its
+            // density, leaving pi
+            auto direction = onb(normal).transform(sample_cosine_hemisphere(next_2d()));
+            color power = scn.materials[rec.mat].emitted(rec.u, rec.v, rec.p) * pi
+                        / (light_probability * area_pdf * side_probability * double(photon_count));
+
+            ray r(rec.p, direction, time);
+            bool through_specular = false;
+            for (int depth = 0; depth < max_depth; depth++) {
+                if (!scn.world.hit(r, interval(0.001, infinity), rec))
+                    break;
+                finalize_hit(r, rec);
+                if (rec.normal.near_zero())
+                    break; // Inside a medium
+
+                const material& mat = scn.materials[rec.mat];
+                scatter_record srec;
+                auto uc = next();
+                if (!mat.sample(r, rec, uc, next_2d(), srec))
+                    break;
+                if (!srec.is_specular) {
+                    if (through_specular)
+                        store(rec.p, unit_vector(r.direction()), power, i, capacity, out, landed);
+                    break;
+                }
+                power = power * srec.attenuation;
+                through_specular = true;
+                r = srec.scattered;
+            }
+        }
+    }
+
+    static void store(
+        const point3& p, const vec3& direction, const color& power, size_t index, size_t capacity,
+        std::vector<photon>& out, std::uint64_t& landed
+    ) {
+        // Reservoir sampling: once out is full, each new photon replaces a random one with
+        // the probability that keeps out a uniform sample of all that landed
+        photon ph;
+        for (int a = 0; a < 3; a++) {
+            ph.position[a] = float(p[a]);
+            ph.power[a] = float(power[a]);
+        }
+        auto theta = std::acos(interval(-1, 1).clamp(direction.z()));
+        auto phi = std::atan2(direction.y(), direction.x());
+        if (phi < 0)
+            phi += 2*pi;
+        ph.theta = std::uint8_t(std::min(255, int(theta * (256 / pi))));
+        ph.phi = std::uint8_t(std::min(255, int(phi * (256 / (2*pi)))));
+        ph.axis = 0;
+
+        landed++;
+        if (out.size() < capacity) {
+            out.push_back(ph);
+            return;
+        }
+        auto slot = std::uint64_t(sampling::to_unit(sampling::hash(std::uint32_t(index), 0x51a7u)) * landed);
+        if (slot < capacity)
+            out[slot] = ph;
+    }
+
+    static size_t left_size(size_t n) {
+        // Nodes in the left subtree of a left-balanced tree of n nodes: full down to the last
+        // level, which fills from the left
+        if (n <= 1)
+            return 0;
+        size_t full = 1;
+        while (2 * full + 1 <= n)
+            full = 2 * full + 1;
+        auto last_level = n - full;
+        auto half = (full + 1) / 2;
+        return (full - 1) / 2 + std::min(last_level, half);
+    }
+
+    void balance(std::vector<photon>& photons, size_t begin, size_t end, size_t node) {
+        // Puts the median of photons[begin, end) along their widest axis at node, and the
+        // photons either side of it in the subtrees below
+        if (begin >= end)
+            return;
+
+        float lo[3] = { photons[begin].position[0], photons[begin].position[1], photons[begin].position[2] };
+        float hi[3] = { lo[0], lo[1], lo[2] };
+        for (auto i = begin; i < end; i++) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], photons[i].position[a]);
+                hi[a] = std::max(hi[a], photons[i].position[a]);
+            }
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (hi[a] - lo[a] > hi[axis] - lo[axis])
+                axis = a;
+
+        auto median = begin + left_size(end - begin);
+        std::nth_element(photons.begin() + begin, photons.begin() + median, photons.begin() + end,
+            [axis](const photon& a, const photon& b) { return a.position[axis] < b.position[axis]; });
+
+        heap[node] = photons[median];
+        heap[node].axis = std::uint8_t(axis);
+        balance(photons, begin, median, 2 * node + 1);
+        balance(photons, median + 1, end, 2 * node + 2);
+    }
+
+    void locate(const point3& p, size_t node, neighbour* nearest, int& count, double& radius_squared) const {
+        // Adds the photons below node that are closer than the current search radius to
+        // nearest, a max-heap of at most gather_count; once full, the radius shrinks to its top
+        const auto& ph = heap[node];
+        auto left = 2 * node + 1;
+        if (left < heap.size()) {
+            auto delta = p[ph.axis] - double(ph.position[ph.axis]);
+            auto near_child = delta < 0 ? left : left + 1;
+            auto far_child = delta < 0 ? left + 1 : left;
+            if (near_child < heap.size())
+                locate(p, near_child, nearest, count, radius_squared);
+            if (delta * delta < radius_squared && far_child < heap.size())
+                locate(p, far_child, nearest, count, radius_squared);
+        }
+
+        auto dx = ph.position[0] - p[0], dy = ph.position[1] - p[1], dz = ph.position[2] - p[2];
+        auto d2 = dx*dx + dy*dy + dz*dz;
+        if (d2 >= radius_squared)
+            return;
+        if (count < gather_count) {
+            // Unordered until full
+            nearest[count++] = neighbour{d2, node};
+            if (count == gather_count) {
+                std::make_heap(nearest, nearest + count);
+                radius_squared = nearest[0].distance_squared;
+            }
+        } else {
+            std::pop_heap(nearest, nearest + count);
+            nearest[count - 1] = neighbour{d2, node};
+            std::push_heap(nearest, nearest + count);
+            radius_squared = nearest[0].distance_squared;
+        }
+    }
+};
+
+#endif
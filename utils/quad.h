@@ -4,10 +4,12 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "light.h"
+#include "arena.h"
 
 class quad : public hittable {
     public:
-    quad(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat) :
+    quad(const point3& Q, const vec3& u, const vec3& v, material_id mat) :
     Q(Q), u(u), v(v), mat(mat)
     {
 
@@ -16,6 +18,7 @@ class quad : public hittable {
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n,n);
+        uv_area = n.length();
 
         set_bounding_box();
     }
@@ -29,35 +32,97 @@ class quad : public hittable {
     aabb bounding_box() const override { return bbox; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            double t, alpha, beta;
+            if (!plane_hit(Q, u, v, w, normal, D, r, ray_t, t, alpha, beta))
+                return false;
+
+            if (!is_interior(alpha, beta, rec))
+                return false;
+
+            // Hit shape, get rec (is_interior already set u and v)
+            rec.t = t;
+            rec.set_primitive(this);
+
+            return true;
+    }
+
+    static bool plane_hit(
+        const point3& Q, const vec3& u, const vec3& v, const vec3& w, const vec3& normal, double D,
+        const ray& r, interval ray_t, double& t, double& alpha, double& beta
+    ) {
+        // Where r meets the plane of Q, u and v within ray_t: its t, and its coordinates alpha
+        // and beta along u and v from Q. The shape decides whether they are inside it.
         auto denom = dot(normal, r.direction());
 
         //parallel to plane = nohit
         if (fabs(denom) < 1e-8)
             return false;
 
-            //return false if t is outside interval for ray
-            auto t = (D - dot(normal, r.origin())) / denom;
-            if (!ray_t.contains(t))
-                return false;
+        //return false if t is outside interval for ray
+        t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
 
-            //otherwise hits the plane, check for shape intersection
-            auto intersection = r.at(t);
-            vec3 planar_hitpt_vector = intersection - Q;
-            auto alpha = dot(w, cross(planar_hitpt_vector, v));
-            auto beta = dot(w, cross(u, planar_hitpt_vector));
+        //otherwise hits the plane, check for shape intersection
+        auto intersection = r.at(t);
+        vec3 planar_hitpt_vector = intersection - Q;
+        alpha = dot(w, cross(planar_hitpt_vector, v));
+        beta = dot(w, cross(u, planar_hitpt_vector));
+        return true;
+    }
 
-            if (!is_interior(alpha, beta, rec))
-                return false;
+    void finalize(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat = mat;
+        rec.set_face_normal(r, normal);
+    }
 
-            // Hit shape, get rec
-            rec.t = t;
-            rec.p = intersection;
-            rec.mat = mat;
-            rec.set_face_normal(r, normal);
-            
-            return true;
+    vec3 random(const point3& origin, double time, const point2& sample) const override {
+        double a, b;
+        sample_interior(sample.x, sample.y, a, b);
+        return Q + (a * u) + (b * v) - origin;
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+        // Uniform over the area, converted to solid angle as seen from origin
+        hit_record rec;
+        if (!hit(ray(origin, direction, time), interval(0.001, infinity), rec))
+            return 0;
+
+        auto distance_squared = rec.t * rec.t * direction.length_squared();
+        auto cosine = fabs(dot(direction, normal) / direction.length());
+
+        return distance_squared / (cosine * area());
+    }
+
+    double sample_surface(const point2& sample, double time, hit_record& rec) const override {
+        double a, b;
+        sample_interior(sample.x, sample.y, a, b);
+        is_interior(a, b, rec); // Sets the uv
+        rec.p = Q + (a * u) + (b * v);
+        rec.normal = normal;
+        rec.front_face = true;
+        rec.mat = mat;
+        return 1 / area();
+    }
+
+    void collect_lights(light_list& lights) const override {
+        // diffuse_light emits from both faces
+        light_bounds b;
+        b.bounds = bbox;
+        b.phi = 2 * area();
+        b.w = normal;
+        b.two_sided = true;
+        lights.add(this, mat, b);
+    }
+
+    virtual double area() const { return uv_area; }
 
-        return false; 
+    virtual void sample_interior(double s1, double s2, double& a, double& b) const {
+        // Maps a uniform point in the unit square to a uniform point in the shape, in the
+        // (a, b) plane coordinates is_interior() takes.
+        a = s1;
+        b = s2;
     }
 
     virtual bool is_interior(double a, double b, hit_record& rec) const {
@@ -77,16 +142,17 @@ class quad : public hittable {
     point3 Q; //origin
     vec3 u, v; //uv directions
     vec3 w;
-    shared_ptr<material> mat;
+    material_id mat;
     aabb bbox;
     vec3 normal;
     double D;
+    double uv_area; // Area of the parallelogram spanned by u and v
 
 };
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat) {
-    //Box defined by 2 opposite vertices a and b
+inline hittable_list* box(scene_arena& arena, const point3& a, const point3& b, material_id mat) {
+    //Box defined by 2 opposite vertices a and b, allocated in arena
 
-    auto sides = make_shared<hittable_list>();
+    auto sides = arena.make<hittable_list>();
 
     auto min = point3(fmin(a.x(), b.x()), fmin(a.y(),b.y()), fmin(a.z(), b.z()));
     auto max = point3(fmax(a.x(), b.x()), fmax(a.y(),b.y()), fmax(a.z(), b.z()));
@@ -95,22 +161,34 @@ inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_pt
     auto dy = vec3(0, max.y() - min.y(), 0);
     auto dz = vec3(0, 0, max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat)); // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz,  dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx,  dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat)); // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()),  dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat)); // bottom
+    sides->add(arena.make<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat)); // front
+    sides->add(arena.make<quad>(point3(max.x(), min.y(), max.z()), -dz,  dy, mat)); // right
+    sides->add(arena.make<quad>(point3(max.x(), min.y(), min.z()), -dx,  dy, mat)); // back
+    sides->add(arena.make<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat)); // left
+    sides->add(arena.make<quad>(point3(min.x(), max.y(), max.z()),  dx, -dz, mat)); // top
+    sides->add(arena.make<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat)); // bottom
 
     return sides;
 }
 
 class tri : public quad {
   public:
-    tri(const point3& o, const vec3& aa, const vec3& ab, shared_ptr<material> m)
+    tri(const point3& o, const vec3& aa, const vec3& ab, material_id m)
       : quad(o, aa, ab, m)
     {}
 
+    double area() const override { return uv_area / 2; }
+
+    void sample_interior(double s1, double s2, double& a, double& b) const override {
+        // Fold the half of the square outside the triangle back onto it
+        if (s1 + s2 > 1) {
+            s1 = 1 - s1;
+            s2 = 1 - s2;
+        }
+        a = s1;
+        b = s2;
+    }
+
     virtual bool is_interior(double a, double b, hit_record& rec) const override {
         if ((a < 0) || (b < 0) || (a + b > 1))
             return false;
@@ -124,12 +202,24 @@ class tri : public quad {
 class ellipse : public quad {
   public:
     ellipse(
-        const point3& center, const vec3& side_A, const vec3& side_B, shared_ptr<material> m
+        const point3& center, const vec3& side_A, const vec3& side_B, material_id m
     ) : quad(center, side_A, side_B, m)
-    {}
+    {
+        // The quad constructor could only call its own set_bounding_box()
+        set_bounding_box();
+    }
 
     virtual void set_bounding_box() override {
-        bbox = aabb(Q - u - v, Q + u + v);
+        bbox = aabb(aabb(Q - u - v, Q + u + v), aabb(Q - u + v, Q + u - v));
+    }
+
+    double area() const override { return pi * uv_area; }
+
+    void sample_interior(double s1, double s2, double& a, double& b) const override {
+        auto r = sqrt(s1);
+        auto phi = 2 * pi * s2;
+        a = r * cos(phi);
+        b = r * sin(phi);
     }
 
     virtual bool is_interior(double a, double b, hit_record& rec) const override {
@@ -146,12 +236,24 @@ class annulus : public quad {
   public:
     annulus(
         const point3& center, const vec3& side_A, const vec3& side_B, double _inner,
-        shared_ptr<material> m)
+        material_id m)
       : quad(center, side_A, side_B, m), inner(_inner)
-    {}
+    {
+        // The quad constructor could only call its own set_bounding_box()
+        set_bounding_box();
+    }
 
     virtual void set_bounding_box() override {
-        bbox = aabb(Q - u - v, Q + u + v);
+        bbox = aabb(aabb(Q - u - v, Q + u + v), aabb(Q - u + v, Q + u - v));
+    }
+
+    double area() const override { return pi * (1 - inner*inner) * uv_area; }
+
+    void sample_interior(double s1, double s2, double& a, double& b) const override {
+        auto r = sqrt(inner*inner + s1 * (1 - inner*inner));
+        auto phi = 2 * pi * s2;
+        a = r * cos(phi);
+        b = r * sin(phi);
     }
 
     virtual bool is_interior(double a, double b, hit_record& rec) const override {
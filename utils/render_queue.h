@@ -0,0 +1,201 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "scene.h"
+#include "scene_file.h"
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+
+// Many renders in one process, listed in a job file, one command per line ('#' starts a comment):
+//
+//   scene <name>                          Builds a scene: one added with add_scene() (main.cpp adds
+//                                         its scene functions), or the scene file name if it ends
+//                                         in .txt (see scene_file.h)
+//   camera <settings>                     Changes the camera for the renders after it; the settings
+//                                         are those of the camera line of a scene file
+//   render <file> [settings]              Renders one image into file, with settings changed for it
+//   turntable <frames> <file> [settings]  Renders frames images, the camera turned about vup around
+//                                         lookat by 360 / frames degrees from each to the next
+//   animate <frames> <file> [settings]    Renders frames images that split the shutter between
+//                                         them, each seeing the next slice of its time
+//
+// The file of turntable and animate has a printf %d for the frame number, e.g. frame_%03d.ppm.
+// A line that fails, such as an unknown scene or a bad setting, is reported and skipped, and so
+// are the renders after a scene line that failed, up to the next scene line.
+//
+// A scene is built, its textures loaded and compiled and its lights collected once, and kept
+// with its camera for every render up to the next scene line; the camera keeps its caustic
+// photon map between them. The thread pool and texture cache last for the whole process. A
+// render only sets up what depends on the view: the camera basis, and the irradiance cache and
+// path guide if they are used.
+
+class render_queue {
+  public:
+    using builder = std::function<void(scene&, camera&)>;
+
+    // Makes a scene function available to scene lines under name. It fills in the scene and
+    // the camera, like the ones in main.cpp, and leaves collecting the lights to the queue.
+    void add_scene(const std::string& name, builder build) { builders[name] = std::move(build); }
+
+    bool run(const std::string& job_path) {
+        // Runs the job file's commands in order. A command that fails is reported and skipped,
+        // and the rest still run; returns false if any failed.
+        std::ifstream in(job_path);
+        if (!in) {
+            std::cerr << "ERROR: Could not open job file '" << job_path << "'.\n";
+            return false;
+        }
+        bool all_ran = true;
+        std::string line;
+        for (int number = 1; std::getline(in, line); number++) {
+            auto comment = line.find('#');
+            if (comment != std::string::npos)
+                line.erase(comment);
+            std::istringstream words(line);
+            std::string command;
+            if (!(words >> command))
+                continue;
+            if (!run_command(command, words)) {
+                std::cerr << "ERROR: " << job_path << ":" << number << ": " << error << "\n";
+                all_ran = false;
+            }
+        }
+        return all_ran;
+    }
+
+  private:
+    std::map<std::string, builder> builders;
+    std::unique_ptr<scene> scn;
+    std::unique_ptr<camera> cam;
+    scene_file::camera_record settings;   // The camera's, between renders
+    std::string error;
+
+    bool fail(const std::string& message) {
+        error = message;
+        return false;
+    }
+
+    bool run_command(const std::string& command, std::istream& words) {
+        if (command == "scene")
+            return build(words);
+        if (command != "camera" && command != "render" && command != "turntable" && command != "animate")
+            return fail("unknown command '" + command + "'");
+        if (!scn)
+            return fail(command + " without a scene");
+
+        if (command == "camera") {
+            // All of the line or none of it
+            auto changed = settings;
+            if (!read_settings(words, changed))
+                return false;
+            settings = changed;
+            return true;
+        }
+
+        int count = 1;
+        std::string file;
+        if (command != "render" && !scene_file::read_count(words, "frames", count, error))
+            return false;
+        if (!(words >> file))
+            return fail(command + " needs a file to write");
+        auto job = settings;
+        if (!read_settings(words, job))
+            return false;
+        if (command == "render")
+            return render(file, job);
+
+        if (!frame_pattern(file))
+            return fail("'" + file + "' needs one %d for the frame number");
+        bool written = true;
+        for (int k = 0; k < count; k++) {
+            auto frame = job;
+            if (command == "turntable") {
+                auto from = scene_file::to_vec3(job.lookfrom), at = scene_file::to_vec3(job.lookat);
+                scene_file::store(frame.lookfrom, at + turn(from - at, unit_vector(scene_file::to_vec3(job.vup)), 2 * pi * k / count));
+            } else {
+                auto length = job.shutter_close - job.shutter_open;
+                frame.shutter_open = job.shutter_open + length * k / count;
+                frame.shutter_close = job.shutter_open + length * (k + 1) / count;
+            }
+            char name[4096];
+            std::snprintf(name, sizeof(name), file.c_str(), k);
+            written = render(name, frame) && written;
+        }
+        return written;
+    }
+
+    bool build(std::istream& words) {
+        // Frees the scene before, then makes the named one and its camera
+        std::string name;
+        if (!(words >> name))
+            return fail("scene needs a name");
+        cam.reset();
+        scn.reset();
+        auto next = std::make_unique<scene>();
+        auto view = std::make_unique<camera>();
+
+        auto is_file = name.size() > 4 && name.compare(name.size() - 4, 4, ".txt") == 0;
+        if (is_file) {
+            if (!load_scene_file(name, *next, *view))
+                return fail("could not load scene file '" + name + "'");
+        } else {
+            auto found = builders.find(name);
+            if (found == builders.end())
+                return fail("unknown scene '" + name + "'");
+            found->second(*next, *view);
+        }
+        next->collect_lights();
+        settings = scene_file::camera_settings(*view);
+        scn = std::move(next);
+        cam = std::move(view);
+        return true;
+    }
+
+    bool read_settings(std::istream& words, scene_file::camera_record& c) {
+        std::string key;
+        while (words >> key)
+            if (!scene_file::read_camera_setting(key, words, c, error))
+                return false;
+        return true;
+    }
+
+    bool render(const std::string& file, const scene_file::camera_record& job) {
+        scene_file::apply_camera_settings(job, *cam);
+        cam->output_file = file;
+        std::clog << "Rendering " << file << "\n";
+        if (!cam->render(*scn))
+            return fail("could not write '" + file + "'");
+        return true;
+    }
+
+    static vec3 turn(const vec3& v, const vec3& axis, double angle) {
+        // v turned about the unit vector axis by angle (Rodrigues' formula)
+        return v * cos(angle) + cross(axis, v) * sin(angle) + axis * dot(axis, v) * (1 - cos(angle));
+    }
+
+    static bool frame_pattern(const std::string& file) {
+        // True if file has one printf conversion, a %d with an optional 0 flag and width, and
+        // no other %, so it is safe to pass to snprintf with an int
+        auto first = file.find('%');
+        if (first == std::string::npos || file.find('%', first + 1) != std::string::npos)
+            return false;
+        auto i = first + 1;
+        while (i < file.size() && std::isdigit(static_cast<unsigned char>(file[i])))
+            i++;
+        return i < file.size() && file[i] == 'd';
+    }
+};
+
+#endif
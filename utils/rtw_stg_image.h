@@ -10,65 +10,84 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include <array>
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 class rtw_image {
   public:
-    rtw_image() {}
+    enum pixel_format {
+        linear_floats,  // Three floats per pixel, unclamped, so HDR images keep their range
+        linear_bytes    // Three bytes per pixel, [0,1] in 256 steps: a quarter of the memory
+    };
 
-    rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+    rtw_image() {}
 
-        auto filename = std::string(image_filename);
-        auto imagedir = getenv("RTW_IMAGES");
-
-        // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
+    rtw_image(const char* image_filename, pixel_format format = linear_floats) : format(format) {
+        // Loads image data from the specified file, found by locate(), in the given format. If
+        // the image was not loaded successfully, width() and height() will return 0.
+        for (const auto& candidate : candidates(image_filename))
+            if (load(candidate)) return;
 
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
+    static std::string locate(const char* image_filename) {
+        // Where the image file is, without loading it, or "" if it is nowhere. If the
+        // RTW_IMAGES environment variable is defined, looks only in that directory for the
+        // image file. If the image was not found, searches for the specified image file first
+        // from the current directory, then in the images/ subdirectory, then the _parent's_
+        // images/ subdirectory, and then _that_ parent, on so on, for six levels up.
+        for (const auto& candidate : candidates(image_filename))
+            if (std::ifstream(candidate, std::ios::binary)) return candidate;
+        return "";
+    }
+
     ~rtw_image() {
-        delete[] bdata;
+        STBI_FREE(bdata);
         STBI_FREE(fdata);
     }
 
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
     bool load(const std::string& filename) {
         // Loads the linear (gamma=1) image data from the given file name. Returns true if the
-        // load succeeded. The resulting data buffer contains the three [0.0, 1.0]
-        // floating-point values for the first pixel (red, then green, then blue). Pixels are
-        // contiguous, going left to right for the width of the image, followed by the next row
-        // below, for the full height of the image.
+        // load succeeded. The resulting data buffer contains the three values for the first
+        // pixel (red, then green, then blue). Pixels are contiguous, going left to right for
+        // the width of the image, followed by the next row below, for the full height of the
+        // image.
 
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        if (fdata == nullptr) return false;
+        if (format == linear_bytes && !stbi_is_hdr(filename.c_str())) {
+            // 8-bit files are decoded to bytes and linearized through a table, the same values
+            // stbi_loadf and then float_to_byte give, without a float copy of the image
+            bdata = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            if (bdata == nullptr) return false;
+            const auto& linear = byte_to_linear();
+            for (size_t i = 0, total = size_t(image_width) * image_height * bytes_per_pixel; i < total; i++)
+                bdata[i] = linear[bdata[i]];
+        } else {
+            fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            if (fdata == nullptr) return false;
+            if (format == linear_bytes)
+                convert_to_bytes();
+        }
 
         bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
         return true;
     }
 
-    int width()  const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width()  const { return (fdata == nullptr && bdata == nullptr) ? 0 : image_width; }
+    int height() const { return (fdata == nullptr && bdata == nullptr) ? 0 : image_height; }
 
     const unsigned char* pixel_data(int x, int y) const {
-        // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
-        // data, returns magenta.
+        // Return the address of the three linear RGB bytes of the pixel at x,y, in an image
+        // loaded as linear_bytes. If there is no image data, returns magenta.
         static unsigned char magenta[] = { 255, 0, 255 };
         if (bdata == nullptr) return magenta;
 
@@ -78,10 +97,37 @@ class rtw_image {
         return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
     }
 
+    const float* float_pixel_data(int x, int y) const {
+        // Return the address of the three linear RGB floats of the pixel at x,y, in an image
+        // loaded as linear_floats. They are not clamped to [0,1], so HDR images keep their full
+        // range. If there is no image data, returns black.
+        static const float black[] = { 0, 0, 0 };
+        if (fdata == nullptr) return black;
+
+        x = clamp(x, 0, image_width);
+        y = clamp(y, 0, image_height);
+
+        return fdata + y*bytes_per_scanline + x*bytes_per_pixel;
+    }
+
   private:
+    static std::vector<std::string> candidates(const char* image_filename) {
+        // Likely locations for the image file, in the order locate() tries them
+        auto filename = std::string(image_filename);
+        std::vector<std::string> out;
+        if (auto imagedir = getenv("RTW_IMAGES"))
+            out.push_back(std::string(imagedir) + "/" + filename);
+        out.push_back(filename);
+        std::string up;
+        for (int i = 0; i < 7; i++, up += "../")
+            out.push_back(up + "images/" + filename);
+        return out;
+    }
+
     const int      bytes_per_pixel = 3;
+    pixel_format   format = linear_floats;
     float         *fdata = nullptr;         // Linear floating point pixel data
-    unsigned char *bdata = nullptr;         // Linear 8-bit pixel data
+    unsigned char *bdata = nullptr;         // Linear 8-bit pixel data; only one of the two is kept
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
     int            bytes_per_scanline = 0;
@@ -101,20 +147,27 @@ class rtw_image {
         return static_cast< unsigned char >(256.0 * value);
     }
 
-    void convert_to_bytes() {
-        // Convert the linear floating point pixel data to bytes, storing the resulting byte
-        // data in the `bdata` member.
-
-        int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
+    static const std::array<unsigned char, 256>& byte_to_linear() {
+        // Linear byte for each 8-bit file value, with stb_image's gamma of 2.2
+        static const auto table = [] {
+            std::array<unsigned char, 256> t;
+            for (int i = 0; i < 256; i++)
+                t[i] = float_to_byte(float(std::pow(i / 255.0f, 2.2f)));
+            return t;
+        }();
+        return table;
+    }
 
-        // Iterate through all pixel components, converting from [0.0, 1.0] float values to
-        // unsigned [0, 255] byte values.
+    void convert_to_bytes() {
+        // Convert the linear floating point pixel data to bytes, clamped to [0,1], and free
+        // the floats
 
-        auto *bptr = bdata;
-        auto *fptr = fdata;
-        for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
-            *bptr = float_to_byte(*fptr);
+        auto total_bytes = size_t(image_width) * image_height * bytes_per_pixel;
+        bdata = static_cast<unsigned char*>(STBI_MALLOC(total_bytes));
+        for (size_t i = 0; bdata != nullptr && i < total_bytes; i++)
+            bdata[i] = float_to_byte(fdata[i]);
+        STBI_FREE(fdata);
+        fdata = nullptr;
     }
 };
 
@@ -1,7 +1,9 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <cstdlib>
@@ -24,8 +26,12 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
+    // One generator per thread, so the pre-passes that trace on worker threads (media draw
+    // their free flights from here) do not share state. The first thread to ask gets the
+    // default seed, as before.
+    static std::atomic<std::uint32_t> streams{0};
+    thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    thread_local std::mt19937 generator(std::mt19937::default_seed + streams++);
     return distribution(generator);
 }
 
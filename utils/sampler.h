@@ -0,0 +1,307 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Sample generators for the camera. A path asks its sampler for every number it needs, in
+// the same order on every path: pixel position, lens, time, then a fixed set per bounce (see
+// camera::ray_color). Each request is its own dimension, so the n-th decision of all the
+// samples in a pixel is one well spread point set, instead of independent random numbers.
+//
+// Free flights inside media and anything past the dimensions a sampler supports fall back to
+// random_double().
+
+enum class sampler_type { independent, stratified, halton, sobol };
+
+namespace sampling {
+
+inline std::uint32_t mix_bits(std::uint64_t v) {
+    // 64 to 32 bit hash (the MurmurHash3 finalizer)
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ull;
+    v ^= v >> 33;
+    return std::uint32_t(v);
+}
+
+inline std::uint32_t hash(std::uint32_t a, std::uint32_t b, std::uint32_t c = 0) {
+    return mix_bits((std::uint64_t(a) << 32 | b) ^ (std::uint64_t(c) * 0x9e3779b97f4a7c15ull));
+}
+
+inline double to_unit(std::uint32_t x) {
+    // [0, 2^32) to [0, 1)
+    return x * 0x1p-32;
+}
+
+inline std::uint32_t reverse_bits(std::uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+inline std::uint32_t owen_scramble(std::uint32_t x, std::uint32_t seed) {
+    // Hash based nested uniform (Owen) scrambling, after Laine-Karras and Burley. Each bit is
+    // flipped depending only on the bits above it, which keeps the stratification of base 2
+    // sequences while randomizing them.
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline std::uint32_t permute(std::uint32_t i, std::uint32_t n, std::uint32_t seed) {
+    // Element i of a random permutation of [0, n), without storing it (Kensler, "Correlated
+    // Multi-Jittered Sampling"). Cycle walks a hash over the next power of two.
+    std::uint32_t w = n - 1;
+    w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+    do {
+        i ^= seed;             i *= 0xe170893du;
+        i ^= seed >> 16;       i ^= (i & w) >> 4;
+        i ^= seed >> 8;        i *= 0x0929eb3fu;
+        i ^= seed >> 23;       i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;   i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;    i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;     i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;     i *= 0xc860a3dfu;
+        i &= w;                i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+inline void sobol_2d(std::uint32_t index, std::uint32_t& x, std::uint32_t& y) {
+    // First two dimensions of the Sobol sequence, as 32 bit fractions: the van der Corput
+    // sequence and its Sobol partner, which together are a (0,2)-sequence in base 2.
+    x = reverse_bits(index);
+    y = 0;
+    for (std::uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            y ^= v;
+}
+
+inline double scrambled_radical_inverse(int base, std::uint32_t index, std::uint32_t seed) {
+    // index with its base-b digits mirrored around the radix point, every digit position passed
+    // through its own random permutation of [0, base). Leading zeros are permuted too, down to
+    // the 32 bits the other samplers give.
+    double inv_base = 1.0 / base, inv_bi = inv_base, r = 0;
+    for (std::uint32_t digit = 0; index || inv_bi > 0x1p-32; digit++) {
+        r += permute(index % base, base, hash(seed, digit)) * inv_bi;
+        index /= base;
+        inv_bi *= inv_base;
+    }
+    return std::fmin(r, 0x1.fffffffffffffp-1);
+}
+
+}
+
+class alias_table {
+  // Draws index i with probability proportional to weights[i] in constant time, whatever the
+  // number of entries (Walker's alias method, built with Vose's algorithm). Each bin holds one
+  // entry's own share and the index of a single other entry that fills it up to 1/n.
+  public:
+    alias_table() {}
+
+    explicit alias_table(const std::vector<double>& weights) {
+        auto n = weights.size();
+        double total = 0;
+        for (auto w : weights)
+            total += w;
+        if (n == 0 || !(total > 0))
+            return;
+
+        bins.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<std::uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            bins[i].p = float(weights[i] / total);
+            scaled[i] = weights[i] / total * n;
+            (scaled[i] < 1 ? small : large).push_back(std::uint32_t(i));
+        }
+
+        while (!small.empty() && !large.empty()) {
+            auto s = small.back(); small.pop_back();
+            auto l = large.back();
+            bins[s].q = float(scaled[s]);
+            bins[s].alias = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever is left is 1 up to rounding
+        for (auto i : small) bins[i].q = 1;
+        for (auto i : large) bins[i].q = 1;
+    }
+
+    bool empty() const { return bins.empty(); }
+    size_t size() const { return bins.size(); }
+
+    double probability(size_t i) const { return bins[i].p; }
+
+    size_t sample(double u, double& remapped) const {
+        // Uses u both to pick a bin and to choose between its entry and the alias. remapped is
+        // what is left of u, again uniform in [0, 1), for the caller to reuse.
+        auto x = u * bins.size();
+        auto i = std::min(size_t(x), bins.size() - 1);
+        auto f = std::min(x - i, 0x1.fffffffffffffp-1);
+        const auto& b = bins[i];
+        if (f < b.q) {
+            remapped = std::min(f / b.q, 0x1.fffffffffffffp-1);
+            return i;
+        }
+        remapped = std::min((f - b.q) / (1 - b.q), 0x1.fffffffffffffp-1);
+        return b.alias;
+    }
+
+  private:
+    struct bin {
+        float q = 1;               // Chance of keeping this bin's own entry
+        std::uint32_t alias = 0;   // Entry chosen otherwise
+        float p = 0;               // This entry's probability
+    };
+    std::vector<bin> bins;
+};
+
+class sampler {
+  public:
+    virtual ~sampler() = default;
+
+    // Starts sample sample_index of pixel (i, j); dimensions count up from 0 again.
+    virtual void start_pixel_sample(int i, int j, int sample_index) {
+        pixel_seed = sampling::hash(std::uint32_t(i), std::uint32_t(j), seed);
+        index = sample_index;
+        dimension = 0;
+    }
+
+    virtual double get_1d() = 0;
+    virtual point2 get_2d() = 0;
+
+  protected:
+    sampler(int samples_per_pixel, std::uint32_t seed) : spp(samples_per_pixel), seed(seed) {}
+
+    int spp;
+    std::uint32_t seed;
+    std::uint32_t pixel_seed = 0;
+    int index = 0;
+    int dimension = 0;
+
+    std::uint32_t dimension_seed() const { return sampling::hash(pixel_seed, std::uint32_t(dimension), seed); }
+};
+
+class independent_sampler : public sampler {
+  // Plain random numbers, as before samplers existed. The baseline the others are measured by.
+  public:
+    independent_sampler(int samples_per_pixel, std::uint32_t seed = 0) : sampler(samples_per_pixel, seed) {}
+
+    double get_1d() override { return random_double(); }
+    point2 get_2d() override { return point2{random_double(), random_double()}; }
+};
+
+class stratified_sampler : public sampler {
+  // Jittered strata in every dimension. 1D dimensions use spp strata; 2D dimensions use an
+  // nx by ny grid with nx * ny == spp, as square as spp allows. The samples of a pixel visit
+  // the strata of each dimension in a different random order, so dimensions are not correlated.
+  public:
+    stratified_sampler(int samples_per_pixel, std::uint32_t seed = 0) : sampler(samples_per_pixel, seed) {
+        nx = int(std::sqrt(double(spp)));
+        while (spp % nx != 0)
+            nx--;
+        ny = spp / nx;
+    }
+
+    double get_1d() override {
+        auto stratum = sampling::permute(index, spp, dimension_seed());
+        dimension++;
+        return (stratum + random_double()) / spp;
+    }
+
+    point2 get_2d() override {
+        auto stratum = sampling::permute(index, spp, dimension_seed());
+        dimension += 2;
+        return point2{((stratum % nx) + random_double()) / nx, ((stratum / nx) + random_double()) / ny};
+    }
+
+  private:
+    int nx, ny;
+};
+
+class halton_sampler : public sampler {
+  // The Halton sequence, one prime base per dimension, restarted in every pixel with its digits
+  // randomly permuted per pixel so neighbouring pixels do not share errors. The permutation also
+  // breaks up the correlation between neighbouring large bases, and spreads the first few
+  // points of a large base over [0, 1) instead of near 0. Dimensions past the table use random
+  // numbers.
+  public:
+    halton_sampler(int samples_per_pixel, std::uint32_t seed = 0) : sampler(samples_per_pixel, seed) {}
+
+    double get_1d() override {
+        if (dimension >= prime_count)
+            return random_double();
+        auto x = sampling::scrambled_radical_inverse(primes[dimension], std::uint32_t(index), dimension_seed());
+        dimension++;
+        return x;
+    }
+
+    point2 get_2d() override {
+        auto x = get_1d();
+        return point2{x, get_1d()};
+    }
+
+  private:
+    static constexpr int prime_count = 32;
+    static constexpr int primes[prime_count] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+    };
+};
+
+class sobol_sampler : public sampler {
+  // Owen scrambled Sobol points, padded: every 2D request takes the first two Sobol
+  // dimensions (which are well stratified together), scrambled with its own seed, and in its
+  // own shuffled order so that different requests are not correlated. 1D requests use the
+  // first dimension alone. Works for any spp, and is best at powers of two.
+  public:
+    sobol_sampler(int samples_per_pixel, std::uint32_t seed = 0) : sampler(samples_per_pixel, seed) {}
+
+    double get_1d() override {
+        auto s = dimension_seed();
+        dimension++;
+        auto i = sampling::owen_scramble(std::uint32_t(index), s);
+        return sampling::to_unit(sampling::owen_scramble(sampling::reverse_bits(i), s ^ 0xa511e9b3u));
+    }
+
+    point2 get_2d() override {
+        auto s = dimension_seed();
+        dimension += 2;
+        std::uint32_t x, y;
+        sampling::sobol_2d(sampling::owen_scramble(std::uint32_t(index), s), x, y);
+        return point2{
+            sampling::to_unit(sampling::owen_scramble(x, s ^ 0xa511e9b3u)),
+            sampling::to_unit(sampling::owen_scramble(y, s ^ 0x63d83595u))
+        };
+    }
+};
+
+inline std::unique_ptr<sampler> make_sampler(sampler_type type, int samples_per_pixel, std::uint32_t seed = 0) {
+    switch (type) {
+        case sampler_type::independent: return std::make_unique<independent_sampler>(samples_per_pixel, seed);
+        case sampler_type::stratified:  return std::make_unique<stratified_sampler>(samples_per_pixel, seed);
+        case sampler_type::halton:      return std::make_unique<halton_sampler>(samples_per_pixel, seed);
+        case sampler_type::sobol:       break;
+    }
+    return std::make_unique<sobol_sampler>(samples_per_pixel, seed);
+}
+
+#endif
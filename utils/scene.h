@@ -0,0 +1,128 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "rtweekend.h"
+
+#include "arena.h"
+#include "hittable_list.h"
+#include "light.h"
+#include "material.h"
+#include "texture.h"
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class material_table {
+  // Every material in a scene, side by side in one array. Primitives refer to materials by
+  // their index in this table, which keeps hit records small and trivially copyable.
+  public:
+    template <typename M, typename... Args>
+    material_id add(Args&&... args) {
+        materials.emplace_back(std::in_place_type<M>, std::forward<Args>(args)...);
+        return material_id(materials.size() - 1);
+    }
+
+    const material& operator[](material_id id) const { return materials[id]; }
+
+    size_t size() const { return materials.size(); }
+
+  private:
+    std::vector<material> materials;
+};
+
+class texture_table {
+  // Every texture in a scene, allocated in the scene's arena. Materials and other textures
+  // hold plain pointers to them, which stay valid for the life of the scene.
+  public:
+    explicit texture_table(scene_arena& arena) : arena(arena) {}
+
+    template <typename T, typename... Args>
+    const texture* add(Args&&... args) {
+        filtering = filtering || std::is_same_v<T, image_texture> || std::is_same_v<T, paged_texture>;
+        auto t = arena.make<texture>(std::in_place_type<T>, std::forward<Args>(args)...);
+        textures.push_back(t);
+        if constexpr (std::is_same_v<T, image_texture>)
+            loading.push_back(t);
+        return t;
+    }
+
+    size_t size() const { return textures.size(); }
+
+    // Waits for the image textures decoding in the background; none may be looked up before
+    void finish_loading() const {
+        for (auto t : loading)
+            t->finish_loading();
+    }
+
+    // Flattens the textures into one program that lookups then go through (see texture.h).
+    // Textures added later are looked up directly until the next compile.
+    void compile() { program.compile(textures); }
+
+    size_t program_size() const { return program.size(); }
+
+    // True if some texture filters its lookups, so hits need their footprint (see texture.h)
+    bool filtered() const { return filtering; }
+
+  private:
+    scene_arena& arena;
+    std::vector<texture*> textures;
+    bool filtering = false;
+    std::vector<const texture*> loading;
+    texture_program program;
+};
+
+class scene {
+  // Everything the camera needs to render: the objects, and the tables their materials and
+  // textures live in, and optionally an environment light around it all. The arena owns the
+  // objects and textures and is declared first, so it is destroyed last.
+  public:
+    scene() : textures(arena), serial(next_serial()) {}
+
+    scene(const scene&) = delete;
+    scene& operator=(const scene&) = delete;
+
+    scene_arena arena;
+    hittable_list world;
+    material_table materials;
+    texture_table textures;
+    light_list lights;
+
+    // Lights rays that leave the scene, in place of camera::background. Allocate it with make().
+    const environment_light* environment = nullptr;
+
+    // Different for every scene the process makes, so what a camera keeps between renders
+    // (see camera.h) is never used with a scene it was not made for, even at the same address
+    const std::uint64_t serial;
+
+    void collect_lights() {
+        // Call once the world is complete, before rendering, to turn on light sampling. Waits
+        // for the textures to load and compiles them, as emitters are evaluated here.
+        textures.finish_loading();
+        textures.compile();
+        lights.clear();
+        lights.emission.resize(materials.size());
+        for (material_id id = 0; id < materials.size(); id++) {
+            // Textured emitters are estimated from their middle
+            auto& mat = materials[id];
+            lights.emission[id] = mat.is_emissive() ? pi * luminance(mat.emitted(0.5, 0.5, point3(0,0,0))) : 0;
+        }
+        world.collect_lights(lights);
+        lights.set_environment(environment);
+        lights.build();
+    }
+
+    // Allocates a scene object (primitive, instance, BVH node, ...) in the arena
+    template <typename T, typename... Args>
+    T* make(Args&&... args) { return arena.make<T>(std::forward<Args>(args)...); }
+
+  private:
+    static std::uint64_t next_serial() {
+        static std::atomic<std::uint64_t> count{0};
+        return ++count;
+    }
+};
+
+#endif
@@ -0,0 +1,1158 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "camera.h"
+#include "hittable.h"
+#include "quad.h"
+#include "scene.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Scenes kept in files instead of functions in main.cpp. They are written as text, one command
+// per line ('#' starts a comment):
+//
+//   camera width 600 aspect 1 spp 64 depth 50 vfov 40 from 278 278 -800 at 278 278 0 up 0 1 0
+//          defocus 0 focus 10 background 0 0 0 shutter 0 1 texture_mb 256
+//          (any of the keys, on one or more lines; texture_mb bounds the paged texture cache)
+//   texture <name> solid <r g b>
+//   texture <name> checker <scale> <even> <odd>         (each a color r g b or a texture name)
+//   texture <name> image <file>                         (paged <file> reads it through texture_cache.h)
+//   texture <name> noise <scale> [bake <a> <b> <MB>]   (bake: the turbulence in the box from a
+//                                                       to b is precomputed, see noise_volume)
+//   material <name> lambertian <color or texture>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <index of refraction>
+//   material <name> light <color or texture>
+//   sphere <material> <x y z> <radius> [to <x y z>]   (to: the center at the end of the shutter)
+//   quad <material> <Q> <u> <v>
+//   triangle <material> <Q> <u> <v>
+//   box <material> <a> <b>
+//
+// and any shape may end with rotate_x, rotate_y or rotate_z <degrees> and translate <x y z>,
+// applied in the order written, like wrapping it in those instances. They are applied to the
+// shape's points when the scene is compiled; a sphere's center moves but it is not turned, so
+// its texture coordinates stay where they were.
+//
+// compile_scene() turns the text into a binary file that is read by mapping it into memory:
+// a header, then each kind of record packed in an array of its own, every array 64 byte
+// aligned, including the BVH, built the same way bvh_node builds it and flattened depth first.
+// load_scene() reads the camera, textures and materials and the few primitives that emit
+// light, which are sampled as lights and so become ordinary objects; everything else is
+// intersected where it lies in the mapping, so a scene of any size starts rendering as soon as
+// those are read, and the OS pages its primitives in as rays reach them. The file is in the
+// machine's own byte order. Loading checks that every index in it stays within the file,
+// reading the primitive references and the BVH once, but not the shapes themselves.
+
+namespace scene_file {
+    constexpr char magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '1' };
+    constexpr std::uint32_t version = 4;
+    constexpr std::uint32_t byte_order = 0x01020304;   // Reads back differently with the other one
+    constexpr std::uint64_t section_align = 64;
+
+    enum section_id { camera_section, string_section, texture_section, material_section,
+                      sphere_section, planar_section, node_section, prim_section, emitter_section,
+                      section_count };
+
+    struct section {
+        std::uint64_t offset;   // From the start of the file
+        std::uint64_t count;    // Records, or bytes of strings
+    };
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        section sections[section_count];
+    };
+
+    struct camera_record {
+        double aspect_ratio, vfov, defocus_angle, focus_dist, shutter_open, shutter_close;
+        double background[3], lookfrom[3], lookat[3], vup[3];
+        std::int32_t image_width, samples_per_pixel, max_depth, texture_memory_mb;
+    };
+
+    enum texture_kind : std::uint32_t { solid_kind, checker_kind, image_kind, paged_kind, noise_kind };
+
+    struct texture_record {
+        std::uint32_t kind;
+        std::int32_t even, odd;   // Checkers: earlier textures, or -1 for color_a and color_b
+        std::uint32_t name;       // Images: offset of the file name in the strings
+        double scale;
+        double color_a[3], color_b[3];
+        double bake_lo[3], bake_hi[3];   // Noise: the box to bake into a noise_volume,
+        double bake_mb;                  // and the volume's budget in MB, 0 for none
+    };
+
+    enum material_kind : std::uint32_t { lambertian_kind, metal_kind, dielectric_kind, light_kind };
+
+    struct material_record {
+        std::uint32_t kind;
+        std::int32_t tex;         // A texture, or -1 for albedo
+        double albedo[3];
+        double param;             // Fuzz, or index of refraction
+    };
+
+    struct sphere_record {
+        double center[3];
+        double motion[3];         // Moving spheres: from the first center to the second
+        double radius;
+        std::uint32_t mat;
+        std::uint32_t moving;
+    };
+
+    enum planar_shape : std::uint32_t { parallelogram_shape, triangle_shape };
+
+    struct planar_record {
+        // A quad or tri, with the plane quad computes from Q, u and v
+        double Q[3], u[3], v[3], w[3], normal[3];
+        double D;
+        std::uint32_t mat;
+        std::uint32_t shape;
+    };
+
+    enum prim_kind : std::uint32_t { sphere_kind, planar_kind };
+
+    struct prim_ref {
+        std::uint32_t kind;
+        std::uint32_t index;      // In the array of its kind
+    };
+
+    struct node_record {
+        float lo[3], hi[3];       // Bounds, rounded outward
+        std::uint32_t offset;     // Leaves: first prim_ref. Inner nodes: the second child; the first is the next node
+        std::uint16_t count;      // prim_refs in a leaf, 0 in an inner node
+        std::uint16_t axis;       // Inner nodes: the axis the children were split on
+    };
+
+    static_assert(sizeof(node_record) == 32, "two nodes to a cache line");
+
+    constexpr int max_bvh_depth = 64;   // Of the nodes below the root; mapped_scene's stack holds that many
+    constexpr int max_bake_mb = 4096;   // Largest noise_volume a scene file may ask for
+
+    inline vec3 to_vec3(const double* a) { return vec3(a[0], a[1], a[2]); }
+
+    inline void store(double* a, const vec3& v) {
+        for (int i = 0; i < 3; i++)
+            a[i] = v[i];
+    }
+
+    inline aabb bounds(const sphere_record& s) {
+        auto c = to_vec3(s.center);
+        auto rvec = vec3(s.radius, s.radius, s.radius);
+        aabb box(c - rvec, c + rvec);
+        if (s.moving)
+            box = aabb(box, aabb(c + to_vec3(s.motion) - rvec, c + to_vec3(s.motion) + rvec));
+        return box;
+    }
+
+    inline aabb bounds(const planar_record& q) {
+        // As quad::set_bounding_box; a triangle keeps its parallelogram's box too
+        auto Q = to_vec3(q.Q), u = to_vec3(q.u), v = to_vec3(q.v);
+        return aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v));
+    }
+
+    inline camera_record camera_settings(const camera& cam) {
+        // The settings of cam that the text form sets
+        camera_record c = {};
+        c.aspect_ratio = cam.aspect_ratio;
+        c.vfov = cam.vfov;
+        c.defocus_angle = cam.defocus_angle;
+        c.focus_dist = cam.focus_dist;
+        c.shutter_open = cam.shutter_open;
+        c.shutter_close = cam.shutter_close;
+        store(c.background, cam.background);
+        store(c.lookfrom, cam.lookfrom);
+        store(c.lookat, cam.lookat);
+        store(c.vup, cam.vup);
+        c.image_width = cam.image_width;
+        c.samples_per_pixel = cam.samples_per_pixel;
+        c.max_depth = cam.max_depth;
+        c.texture_memory_mb = cam.texture_memory_mb;
+        return c;
+    }
+
+    inline void apply_camera_settings(const camera_record& c, camera& cam) {
+        cam.aspect_ratio      = c.aspect_ratio;
+        cam.image_width       = c.image_width;
+        cam.samples_per_pixel = c.samples_per_pixel;
+        cam.max_depth         = c.max_depth;
+        cam.texture_memory_mb = c.texture_memory_mb;
+        cam.background        = to_vec3(c.background);
+        cam.vfov              = c.vfov;
+        cam.lookfrom          = to_vec3(c.lookfrom);
+        cam.lookat            = to_vec3(c.lookat);
+        cam.vup               = to_vec3(c.vup);
+        cam.defocus_angle     = c.defocus_angle;
+        cam.focus_dist        = c.focus_dist;
+        cam.shutter_open      = c.shutter_open;
+        cam.shutter_close     = c.shutter_close;
+    }
+
+    inline bool read_number(std::istream& words, double& x, std::string& error) {
+        std::string word;
+        if (!(words >> word)) {
+            error = "missing a number";
+            return false;
+        }
+        char* end;
+        x = std::strtod(word.c_str(), &end);
+        if (*end != '\0') {
+            error = "'" + word + "' is not a number";
+            return false;
+        }
+        return true;
+    }
+
+    inline bool read_count(std::istream& words, const std::string& name, int& n, std::string& error) {
+        // A whole number of at least 1, for sizes and counts
+        double x;
+        if (!read_number(words, x, error))
+            return false;
+        if (!(x >= 1 && x <= std::numeric_limits<std::int32_t>::max() && x == std::floor(x))) {
+            error = name + " must be a whole number of at least 1";
+            return false;
+        }
+        n = int(x);
+        return true;
+    }
+
+    inline bool read_vector(std::istream& words, vec3& v, std::string& error) {
+        double x, y, z;
+        if (!read_number(words, x, error) || !read_number(words, y, error) || !read_number(words, z, error))
+            return false;
+        v = vec3(x, y, z);
+        return true;
+    }
+
+    inline bool read_camera_setting(const std::string& key, std::istream& words, camera_record& c, std::string& error) {
+        // Reads the value of one camera setting, whose key has been read, into c
+        vec3 v;
+        double x, y;
+        if (key == "from" || key == "at" || key == "up" || key == "background") {
+            if (!read_vector(words, v, error))
+                return false;
+            store(key == "from" ? c.lookfrom : key == "at" ? c.lookat : key == "up" ? c.vup : c.background, v);
+            return true;
+        }
+        if (key == "shutter") {
+            if (!read_number(words, x, error) || !read_number(words, y, error))
+                return false;
+            c.shutter_open = x;
+            c.shutter_close = y;
+            return true;
+        }
+        if (key == "width")
+            return read_count(words, key, c.image_width, error);
+        if (key == "spp")
+            return read_count(words, key, c.samples_per_pixel, error);
+        if (key == "depth")
+            return read_count(words, key, c.max_depth, error);
+        if (key == "texture_mb")
+            return read_count(words, key, c.texture_memory_mb, error);
+        if (!read_number(words, x, error))
+            return false;
+        if (key == "aspect" && !(x > 0 && std::isfinite(x))) {
+            error = "aspect must be above 0";
+            return false;
+        }
+        if (key == "aspect") c.aspect_ratio = x;
+        else if (key == "vfov") c.vfov = x;
+        else if (key == "defocus") c.defocus_angle = x;
+        else if (key == "focus") c.focus_dist = x;
+        else {
+            error = "unknown camera setting '" + key + "'";
+            return false;
+        }
+        return true;
+    }
+}
+
+class mapped_file {
+  // A whole file mapped read-only into memory. Pages are read in when first touched and are
+  // shared with the OS file cache instead of copied out of it.
+  public:
+    mapped_file() {}
+
+    explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER length;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length) || length.QuadPart == 0)
+            return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+            return;
+        auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view)
+            return;
+        bytes = static_cast<const std::byte*>(view);
+        length_bytes = size_t(length.QuadPart);
+#else
+        auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            auto view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                bytes = static_cast<const std::byte*>(view);
+                length_bytes = size_t(info.st_size);
+            }
+        }
+        close(fd); // The mapping keeps the file open
+#endif
+    }
+
+    mapped_file(mapped_file&& other) noexcept { swap(other); }
+
+    mapped_file& operator=(mapped_file&& other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+#ifdef _WIN32
+        if (bytes)
+            UnmapViewOfFile(bytes);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (bytes)
+            munmap(const_cast<std::byte*>(bytes), length_bytes);
+#endif
+    }
+
+    explicit operator bool() const { return bytes != nullptr; }
+    const std::byte* data() const { return bytes; }
+    size_t size() const { return length_bytes; }
+
+  private:
+    const std::byte* bytes = nullptr;
+    size_t length_bytes = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    void swap(mapped_file& other) {
+        std::swap(bytes, other.bytes);
+        std::swap(length_bytes, other.length_bytes);
+#ifdef _WIN32
+        std::swap(file, other.file);
+        std::swap(mapping, other.mapping);
+#endif
+    }
+};
+
+class mapped_scene : public hittable {
+  // The primitives of a compiled scene file and their BVH, intersected in place in the mapping.
+  // It is one object to the rest of the renderer: a hit records the mapped_scene as its
+  // primitive and which primitive of the file it was in rec.part.
+  public:
+    // file has passed load_scene's checks; material m of the file is base + m in the scene
+    mapped_scene(mapped_file file, material_id base) : file(std::move(file)), base(base) {
+        using namespace scene_file;
+        spheres = records<sphere_record>(sphere_section);
+        planars = records<planar_record>(planar_section);
+        nodes = records<node_record>(node_section);
+        prims = records<prim_ref>(prim_section);
+        if (node_count() > 0) {
+            const auto& root = nodes[0];
+            bbox = aabb(point3(root.lo[0], root.lo[1], root.lo[2]), point3(root.hi[0], root.hi[1], root.hi[2]));
+        } else {
+            bbox = aabb::empty;
+        }
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (node_count() == 0)
+            return false;
+
+        auto origin = r.origin(), direction = r.direction();
+        double inv[3];
+        for (int a = 0; a < 3; a++)
+            inv[a] = 1.0 / direction[a];
+
+        // Depth first, the near child first; the tree is about log2(primitives) deep
+        std::uint32_t stack[scene_file::max_bvh_depth];
+        int top = 0;
+        std::uint32_t index = 0;
+        bool hit_anything = false;
+        for (;;) {
+            RT_STAT(bvh_node_visits);
+            const auto& n = nodes[index];
+            if (slab(n, origin, inv, ray_t)) {
+                if (n.count == 0) {
+                    auto near = index + 1, far = n.offset;
+                    if (direction[n.axis] < 0)
+                        std::swap(near, far);
+                    stack[top++] = far;
+                    index = near;
+                    continue;
+                }
+                for (std::uint32_t i = n.offset; i < n.offset + n.count; i++) {
+                    if (hit_primitive(i, r, ray_t, rec)) {
+                        ray_t.max = rec.t;
+                        hit_anything = true;
+                    }
+                }
+            }
+            if (top == 0)
+                break;
+            index = stack[--top];
+        }
+        return hit_anything;
+    }
+
+    void finalize(const ray& r, hit_record& rec) const override {
+        using namespace scene_file;
+        const auto& ref = prims[rec.part];
+        rec.p = r.at(rec.t);
+        if (ref.kind == sphere_kind) {
+            const auto& s = spheres[ref.index];
+            auto center = s.moving ? to_vec3(s.center) + r.time() * to_vec3(s.motion) : to_vec3(s.center);
+            vec3 outward_normal = (rec.p - center) / s.radius;
+            rec.set_face_normal(r, outward_normal);
+            sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+            rec.mat = base + s.mat;
+        } else {
+            const auto& q = planars[ref.index];
+            rec.set_face_normal(r, to_vec3(q.normal));
+            rec.mat = base + q.mat;
+        }
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    mapped_file file;
+    material_id base;
+    aabb bbox;
+    const scene_file::sphere_record* spheres;
+    const scene_file::planar_record* planars;
+    const scene_file::node_record* nodes;
+    const scene_file::prim_ref* prims;
+
+    template <typename T>
+    const T* records(scene_file::section_id id) const {
+        auto h = reinterpret_cast<const scene_file::header*>(file.data());
+        return reinterpret_cast<const T*>(file.data() + h->sections[id].offset);
+    }
+
+    std::uint64_t node_count() const {
+        return reinterpret_cast<const scene_file::header*>(file.data())->sections[scene_file::node_section].count;
+    }
+
+    static bool slab(const scene_file::node_record& n, const point3& origin, const double* inv, interval t) {
+        // As aabb::hit, on the node's float bounds
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (n.lo[a] - origin[a]) * inv[a];
+            auto t1 = (n.hi[a] - origin[a]) * inv[a];
+            if (inv[a] < 0)
+                std::swap(t0, t1);
+            if (t0 > t.min)
+                t.min = t0;
+            if (t1 < t.max)
+                t.max = t1;
+            if (t.max <= t.min)
+                return false;
+        }
+        return true;
+    }
+
+    bool hit_primitive(std::uint32_t part, const ray& r, interval ray_t, hit_record& rec) const {
+        // The same tests as sphere::hit and quad::hit / tri::hit
+        using namespace scene_file;
+        const auto& ref = prims[part];
+        double t;
+        if (ref.kind == sphere_kind) {
+            const auto& s = spheres[ref.index];
+            auto center = s.moving ? to_vec3(s.center) + r.time() * to_vec3(s.motion) : to_vec3(s.center);
+            if (!sphere::intersect(center, s.radius, r, ray_t, t))
+                return false;
+        } else {
+            const auto& q = planars[ref.index];
+            double a, b;
+            if (!quad::plane_hit(to_vec3(q.Q), to_vec3(q.u), to_vec3(q.v), to_vec3(q.w), to_vec3(q.normal), q.D,
+                                 r, ray_t, t, a, b))
+                return false;
+            auto inside = q.shape == triangle_shape ? a >= 0 && b >= 0 && a + b <= 1
+                                                    : interval(0, 1).contains(a) && interval(0, 1).contains(b);
+            if (!inside)
+                return false;
+            rec.u = a;
+            rec.v = b;
+        }
+        rec.t = t;
+        rec.set_primitive(this);
+        rec.part = part;
+        return true;
+    }
+};
+
+namespace scene_file {
+    class compiler {
+      // Reads the text form into records and writes the binary form (see the top of this file)
+      public:
+        bool read(const std::string& path) {
+            std::ifstream in(path);
+            if (!in) {
+                std::cerr << "ERROR: Could not open scene file '" << path << "'.\n";
+                return false;
+            }
+            cam = camera_settings(camera());
+
+            std::string line;
+            for (int number = 1; std::getline(in, line); number++) {
+                auto comment = line.find('#');
+                if (comment != std::string::npos)
+                    line.erase(comment);
+                std::istringstream words(line);
+                std::string command;
+                if (!(words >> command))
+                    continue;
+                auto ok = parse(command, words);
+                std::string extra;
+                if (ok && words >> extra)
+                    ok = fail("unexpected '" + extra + "'");
+                if (!ok) {
+                    std::cerr << "ERROR: " << path << ":" << number << ": " << error << "\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool write(const std::string& path) {
+            // Through a temporary file, so a reader never sees half of one
+            build_bvh();
+            header h = {};
+            std::memcpy(h.magic, magic, sizeof(magic));
+            h.version = version;
+            h.byte_order = byte_order;
+
+            std::vector<char> out(sizeof(header));
+            auto add = [&](section_id id, const void* data, size_t count, size_t size) {
+                out.resize((out.size() + section_align - 1) / section_align * section_align);
+                h.sections[id] = { out.size(), count };
+                auto p = static_cast<const char*>(data);
+                out.insert(out.end(), p, p + count * size);
+            };
+            add(camera_section, &cam, 1, sizeof(cam));
+            add(string_section, strings.data(), strings.size(), 1);
+            add(texture_section, textures.data(), textures.size(), sizeof(texture_record));
+            add(material_section, materials.data(), materials.size(), sizeof(material_record));
+            add(sphere_section, spheres.data(), spheres.size(), sizeof(sphere_record));
+            add(planar_section, planars.data(), planars.size(), sizeof(planar_record));
+            add(node_section, nodes.data(), nodes.size(), sizeof(node_record));
+            add(prim_section, prims.data(), prims.size(), sizeof(prim_ref));
+            add(emitter_section, emitters.data(), emitters.size(), sizeof(prim_ref));
+            std::memcpy(out.data(), &h, sizeof(h));
+
+            auto temporary = path + ".partial";
+            std::ofstream file(temporary, std::ios::binary);
+            file.write(out.data(), std::streamsize(out.size()));
+            file.close();
+            std::error_code ec;
+            if (file)
+                std::filesystem::rename(temporary, path, ec);
+            if (!file || ec) {
+                std::filesystem::remove(temporary, ec);
+                std::cerr << "ERROR: Could not write scene file '" << path << "'.\n";
+                return false;
+            }
+            return true;
+        }
+
+      private:
+        camera_record cam;
+        std::string strings;
+        std::vector<texture_record> textures;
+        std::vector<material_record> materials;
+        std::vector<sphere_record> spheres;
+        std::vector<planar_record> planars;
+        std::vector<node_record> nodes;
+        std::vector<prim_ref> prims;      // Everything but the emitters, in BVH order once built
+        std::vector<prim_ref> emitters;
+        std::map<std::string, std::int32_t> texture_names, material_names;
+        std::string error;
+
+        bool fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        bool number(std::istream& words, double& x) { return read_number(words, x, error); }
+        bool vector(std::istream& words, vec3& v) { return read_vector(words, v, error); }
+
+        bool parse(const std::string& command, std::istringstream& words) {
+            if (command == "camera")
+                return parse_camera(words);
+            if (command == "texture")
+                return parse_texture(words);
+            if (command == "material")
+                return parse_material(words);
+            if (command == "sphere" || command == "quad" || command == "triangle" || command == "box")
+                return parse_shape(command, words);
+            return fail("unknown command '" + command + "'");
+        }
+
+        bool parse_camera(std::istream& words) {
+            std::string key;
+            while (words >> key)
+                if (!read_camera_setting(key, words, cam, error))
+                    return false;
+            return true;
+        }
+
+        bool parse_texture(std::istringstream& words) {
+            std::string name, kind;
+            if (!(words >> name >> kind))
+                return fail("texture needs a name and a kind");
+            texture_record t = {};
+            t.even = t.odd = -1;
+            vec3 c;
+            if (kind == "solid") {
+                t.kind = solid_kind;
+                if (!vector(words, c))
+                    return false;
+                store(t.color_a, c);
+            } else if (kind == "checker") {
+                t.kind = checker_kind;
+                if (!number(words, t.scale))
+                    return false;
+                // Each side is one token if it names a texture, else three numbers
+                std::string even, odd;
+                if (!(words >> even))
+                    return fail("checker needs two sides");
+                if (!side(even, words, t.color_a, t.even))
+                    return false;
+                if (!(words >> odd))
+                    return fail("checker needs two sides");
+                if (!side(odd, words, t.color_b, t.odd))
+                    return false;
+            } else if (kind == "image" || kind == "paged") {
+                t.kind = kind == "image" ? image_kind : paged_kind;
+                std::string file;
+                if (!(words >> file))
+                    return fail("image needs a file name");
+                t.name = std::uint32_t(strings.size());
+                strings += file;
+                strings += '\0';
+            } else if (kind == "noise") {
+                t.kind = noise_kind;
+                if (!number(words, t.scale))
+                    return false;
+                std::string option;
+                if (words >> option) {
+                    if (option != "bake")
+                        return fail("unexpected '" + option + "'");
+                    vec3 lo, hi;
+                    if (!vector(words, lo) || !vector(words, hi) || !number(words, t.bake_mb))
+                        return false;
+                    if (!(t.bake_mb > 0 && t.bake_mb <= max_bake_mb))
+                        return fail("bake needs a budget above 0 and at most " + std::to_string(max_bake_mb) + " MB");
+                    store(t.bake_lo, lo);
+                    store(t.bake_hi, hi);
+                }
+            } else {
+                return fail("unknown texture kind '" + kind + "'");
+            }
+            texture_names[name] = std::int32_t(textures.size());
+            textures.push_back(t);
+            return true;
+        }
+
+        bool side(const std::string& first, std::istream& words, double* c, std::int32_t& tex) {
+            auto found = texture_names.find(first);
+            if (found != texture_names.end()) {
+                tex = found->second;
+                return true;
+            }
+            double y, z;
+            char* end;
+            auto x = std::strtod(first.c_str(), &end);
+            if (*end != '\0')
+                return fail("'" + first + "' is neither a color nor a texture");
+            if (!number(words, y) || !number(words, z))
+                return false;
+            store(c, vec3(x, y, z));
+            tex = -1;
+            return true;
+        }
+
+        bool parse_material(std::istringstream& words) {
+            std::string name, kind;
+            if (!(words >> name >> kind))
+                return fail("material needs a name and a kind");
+            material_record m = {};
+            m.tex = -1;
+            std::string first;
+            if (kind == "lambertian" || kind == "light") {
+                m.kind = kind == "light" ? light_kind : lambertian_kind;
+                if (!(words >> first))
+                    return fail("missing a color or texture");
+                if (!side(first, words, m.albedo, m.tex))
+                    return false;
+            } else if (kind == "metal") {
+                m.kind = metal_kind;
+                vec3 c;
+                if (!vector(words, c) || !number(words, m.param))
+                    return false;
+                store(m.albedo, c);
+            } else if (kind == "dielectric") {
+                m.kind = dielectric_kind;
+                if (!number(words, m.param))
+                    return false;
+            } else {
+                return fail("unknown material kind '" + kind + "'");
+            }
+            material_names[name] = std::int32_t(materials.size());
+            materials.push_back(m);
+            return true;
+        }
+
+        struct placement {
+            // The transforms after a shape, as one rotation matrix and an offset
+            double m[3][3] = { {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
+            vec3 offset = vec3(0, 0, 0);
+
+            vec3 direction(const vec3& v) const {
+                return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                            m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                            m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+            }
+
+            point3 point(const point3& p) const { return direction(p) + offset; }
+
+            void rotate(int axis, double degrees) {
+                // Then turns it as rotate_x, rotate_y or rotate_z in hittable.h would
+                auto radians = degrees_to_radians(degrees);
+                auto s = sin(radians), c = cos(radians);
+                double r[3][3] = { {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
+                auto a = axis == 0 ? 1 : 0, b = axis == 2 ? 1 : 2;
+                r[a][a] = c;  r[a][b] = s;
+                r[b][a] = -s; r[b][b] = c;
+                double out[3][3];
+                for (int i = 0; i < 3; i++)
+                    for (int j = 0; j < 3; j++)
+                        out[i][j] = r[i][0]*m[0][j] + r[i][1]*m[1][j] + r[i][2]*m[2][j];
+                std::memcpy(m, out, sizeof(m));
+                offset = vec3(r[0][0]*offset[0] + r[0][1]*offset[1] + r[0][2]*offset[2],
+                              r[1][0]*offset[0] + r[1][1]*offset[1] + r[1][2]*offset[2],
+                              r[2][0]*offset[0] + r[2][1]*offset[1] + r[2][2]*offset[2]);
+            }
+        };
+
+        bool parse_shape(const std::string& shape, std::istringstream& words) {
+            std::string mat_name;
+            if (!(words >> mat_name))
+                return fail(shape + " needs a material");
+            auto found = material_names.find(mat_name);
+            if (found == material_names.end())
+                return fail("unknown material '" + mat_name + "'");
+            auto mat = std::uint32_t(found->second);
+
+            vec3 a, b, c;
+            double radius = 0;
+            bool moving = false;
+            if (shape == "sphere") {
+                if (!vector(words, a) || !number(words, radius))
+                    return false;
+            } else if (shape == "box") {
+                if (!vector(words, a) || !vector(words, b))
+                    return false;
+            } else if (!vector(words, a) || !vector(words, b) || !vector(words, c)) {
+                return false;
+            }
+
+            placement place;
+            std::string word;
+            while (words >> word) {
+                double degrees;
+                vec3 v;
+                if (word == "to" && shape == "sphere") {
+                    if (!vector(words, b))
+                        return false;
+                    moving = true;
+                } else if (word == "rotate_x" || word == "rotate_y" || word == "rotate_z") {
+                    if (!number(words, degrees))
+                        return false;
+                    place.rotate(word.back() - 'x', degrees);
+                } else if (word == "translate") {
+                    if (!vector(words, v))
+                        return false;
+                    place.offset += v;
+                } else {
+                    return fail("unexpected '" + word + "'");
+                }
+            }
+
+            auto emits = materials[mat].kind == light_kind;
+            if (shape == "sphere") {
+                sphere_record s = {};
+                store(s.center, place.point(a));
+                store(s.motion, moving ? place.direction(b - a) : vec3(0, 0, 0));
+                s.radius = fmax(0, radius);
+                s.mat = mat;
+                s.moving = moving;
+                add(sphere_kind, spheres, s, emits);
+            } else if (shape == "box") {
+                // The six sides of box() in quad.h
+                auto lo = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
+                auto hi = point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
+                auto dx = vec3(hi.x() - lo.x(), 0, 0);
+                auto dy = vec3(0, hi.y() - lo.y(), 0);
+                auto dz = vec3(0, 0, hi.z() - lo.z());
+                add_planar(place, point3(lo.x(), lo.y(), hi.z()),  dx,  dy, mat, parallelogram_shape, emits);
+                add_planar(place, point3(hi.x(), lo.y(), hi.z()), -dz,  dy, mat, parallelogram_shape, emits);
+                add_planar(place, point3(hi.x(), lo.y(), lo.z()), -dx,  dy, mat, parallelogram_shape, emits);
+                add_planar(place, point3(lo.x(), lo.y(), lo.z()),  dz,  dy, mat, parallelogram_shape, emits);
+                add_planar(place, point3(lo.x(), hi.y(), hi.z()),  dx, -dz, mat, parallelogram_shape, emits);
+                add_planar(place, point3(lo.x(), lo.y(), lo.z()),  dx,  dz, mat, parallelogram_shape, emits);
+            } else {
+                add_planar(place, a, b, c, mat, shape == "triangle" ? triangle_shape : parallelogram_shape, emits);
+            }
+            return true;
+        }
+
+        void add_planar(const placement& place, const point3& Q, const vec3& u, const vec3& v,
+                        std::uint32_t mat, planar_shape shape, bool emits) {
+            // As the quad constructor
+            planar_record q = {};
+            auto pq = place.point(Q), pu = place.direction(u), pv = place.direction(v);
+            auto n = cross(pu, pv);
+            auto normal = unit_vector(n);
+            store(q.Q, pq);
+            store(q.u, pu);
+            store(q.v, pv);
+            store(q.w, n / dot(n, n));
+            store(q.normal, normal);
+            q.D = dot(normal, pq);
+            q.mat = mat;
+            q.shape = shape;
+            add(planar_kind, planars, q, emits);
+        }
+
+        template <typename T>
+        void add(prim_kind kind, std::vector<T>& records, const T& record, bool emits) {
+            (emits ? emitters : prims).push_back(prim_ref{ kind, std::uint32_t(records.size()) });
+            records.push_back(record);
+        }
+
+        aabb prim_bounds(const prim_ref& ref) const {
+            return ref.kind == sphere_kind ? bounds(spheres[ref.index]) : bounds(planars[ref.index]);
+        }
+
+        void build_bvh() {
+            nodes.clear();
+            if (prims.empty())
+                return;
+            std::vector<aabb> boxes(prims.size());
+            for (size_t i = 0; i < prims.size(); i++)
+                boxes[i] = prim_bounds(prims[i]);
+            std::vector<size_t> order(prims.size());
+            for (size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            build(order, boxes, 0, order.size());
+
+            std::vector<prim_ref> sorted(prims.size());
+            for (size_t i = 0; i < order.size(); i++)
+                sorted[i] = prims[order[i]];
+            prims = sorted;
+        }
+
+        void build(std::vector<size_t>& order, const std::vector<aabb>& boxes, size_t start, size_t end) {
+            // The split bvh_node makes: the median along the longest axis of the bounds, by
+            // the boxes' low sides, down to leaves of one or two
+            auto bbox = aabb::empty;
+            for (size_t i = start; i < end; i++)
+                bbox = aabb(bbox, boxes[order[i]]);
+            auto axis = bbox.longest_axis();
+
+            auto index = nodes.size();
+            nodes.push_back(node_record{});
+            for (int a = 0; a < 3; a++) {
+                nodes[index].lo[a] = round_down(bbox.axis_interval(a).min);
+                nodes[index].hi[a] = round_up(bbox.axis_interval(a).max);
+            }
+
+            if (end - start <= 2) {
+                nodes[index].offset = std::uint32_t(start);
+                nodes[index].count = std::uint16_t(end - start);
+                return;
+            }
+            std::sort(order.begin() + start, order.begin() + end, [&](size_t a, size_t b) {
+                return boxes[a].axis_interval(axis).min < boxes[b].axis_interval(axis).min;
+            });
+            auto mid = start + (end - start) / 2;
+            build(order, boxes, start, mid);
+            nodes[index].offset = std::uint32_t(nodes.size());
+            nodes[index].axis = std::uint16_t(axis);
+            build(order, boxes, mid, end);
+        }
+
+        static float round_down(double x) {
+            auto f = float(x);
+            return f > x ? std::nextafter(f, -INFINITY) : f;
+        }
+
+        static float round_up(double x) {
+            auto f = float(x);
+            return f < x ? std::nextafter(f, INFINITY) : f;
+        }
+    };
+
+    template <typename T>
+    bool fits(const mapped_file& file, const section& s) {
+        return s.offset % section_align == 0 && s.offset <= file.size()
+            && s.count <= (file.size() - s.offset) / sizeof(T);
+    }
+
+    inline bool current_format(const header& h) {
+        return std::memcmp(h.magic, magic, sizeof(magic)) == 0 && h.version == version && h.byte_order == byte_order;
+    }
+
+    inline bool current_format(const std::string& path) {
+        // True if the file at path starts with the header of a scene file this code can read
+        std::ifstream in(path, std::ios::binary);
+        header h;
+        return in.read(reinterpret_cast<char*>(&h), sizeof(h)) && current_format(h);
+    }
+
+    inline bool sound_camera(const camera_record& c) {
+        // The settings read_camera_setting() would have accepted, where the renderer needs them
+        return c.image_width >= 1 && c.samples_per_pixel >= 1 && c.max_depth >= 1 && c.texture_memory_mb >= 1
+            && c.aspect_ratio > 0 && std::isfinite(c.aspect_ratio);
+    }
+
+    inline bool sound_primitives(const mapped_file& file) {
+        // Checks everything mapped_scene follows without checking, once, for a file whose
+        // sections fit: the materials of the primitives, the kind and index of every prim_ref,
+        // and the BVH's links. Leaves must hold prim_refs of the file; inner nodes must link
+        // forward in the array, so traversal ends, and no deeper than max_bvh_depth.
+        auto h = reinterpret_cast<const header*>(file.data());
+        const auto& sec = h->sections;
+        auto at = [&](section_id id) { return file.data() + sec[id].offset; };
+        auto material_count = sec[material_section].count;
+
+        auto spheres = reinterpret_cast<const sphere_record*>(at(sphere_section));
+        for (std::uint64_t i = 0; i < sec[sphere_section].count; i++)
+            if (spheres[i].mat >= material_count)
+                return false;
+        auto planars = reinterpret_cast<const planar_record*>(at(planar_section));
+        for (std::uint64_t i = 0; i < sec[planar_section].count; i++)
+            if (planars[i].mat >= material_count)
+                return false;
+
+        auto prims = reinterpret_cast<const prim_ref*>(at(prim_section));
+        for (std::uint64_t i = 0; i < sec[prim_section].count; i++) {
+            const auto& ref = prims[i];
+            if (!(ref.kind == sphere_kind && ref.index < sec[sphere_section].count)
+                && !(ref.kind == planar_kind && ref.index < sec[planar_section].count))
+                return false;
+        }
+
+        auto nodes = reinterpret_cast<const node_record*>(at(node_section));
+        auto node_count = sec[node_section].count;
+        std::vector<std::uint8_t> depth(size_t(node_count), 0);
+        for (std::uint64_t i = 0; i < node_count; i++) {
+            const auto& n = nodes[i];
+            if (n.count > 0) {
+                if (std::uint64_t(n.offset) + n.count > sec[prim_section].count)
+                    return false;
+                continue;
+            }
+            if (n.axis > 2 || i + 1 >= node_count || n.offset <= i || n.offset >= node_count
+                || depth[i] >= max_bvh_depth)
+                return false;
+            for (auto child : { i + 1, std::uint64_t(n.offset) })
+                depth[child] = std::max<std::uint8_t>(depth[child], std::uint8_t(depth[i] + 1));
+        }
+        return true;
+    }
+}
+
+inline bool compile_scene(const std::string& text_path, const std::string& binary_path) {
+    // Compiles the text scene at text_path into the binary scene file at binary_path
+    scene_file::compiler c;
+    return c.read(text_path) && c.write(binary_path);
+}
+
+inline std::string compiled_scene(const std::string& text_path) {
+    // The binary scene next to text_path (name.rtscene for name.txt), compiled first if there
+    // is none, the text is newer or it was written by another version of this code; empty if
+    // it could not be compiled
+    namespace fs = std::filesystem;
+    auto binary = fs::path(text_path).replace_extension(".rtscene").string();
+    std::error_code ec;
+    auto current = fs::exists(binary, ec) && fs::last_write_time(binary, ec) >= fs::last_write_time(text_path, ec)
+                && scene_file::current_format(binary);
+    if (!current && !compile_scene(text_path, binary))
+        return std::string();
+    return binary;
+}
+
+inline bool load_scene(const std::string& binary_path, scene& scn, camera& cam) {
+    // Adds the scene in a binary scene file to scn and sets cam's view and quality from it.
+    // The primitives stay in the file, which stays mapped for the life of scn.
+    using namespace scene_file;
+    mapped_file file(binary_path);
+    auto bad = [&](const char* what) {
+        std::cerr << "ERROR: Scene file '" << binary_path << "' " << what << ".\n";
+        return false;
+    };
+    if (!file)
+        return bad("could not be read");
+    if (file.size() < sizeof(header))
+        return bad("is too short");
+    auto h = reinterpret_cast<const header*>(file.data());
+    if (!current_format(*h))
+        return bad("is not a scene file of this version and byte order");
+    const auto& sec = h->sections;
+    if (!fits<camera_record>(file, sec[camera_section]) || sec[camera_section].count != 1
+        || !fits<char>(file, sec[string_section]) || !fits<texture_record>(file, sec[texture_section])
+        || !fits<material_record>(file, sec[material_section]) || !fits<sphere_record>(file, sec[sphere_section])
+        || !fits<planar_record>(file, sec[planar_section]) || !fits<node_record>(file, sec[node_section])
+        || !fits<prim_ref>(file, sec[prim_section]) || !fits<prim_ref>(file, sec[emitter_section])
+        || !sound_camera(*reinterpret_cast<const camera_record*>(file.data() + sec[camera_section].offset))
+        || !sound_primitives(file))
+        return bad("is damaged");
+    auto at = [&](section_id id) { return file.data() + sec[id].offset; };
+
+    // Textures refer to earlier ones and materials to textures, by their index in the file
+    auto strings = reinterpret_cast<const char*>(at(string_section));
+    auto string_count = sec[string_section].count;
+    auto tex = reinterpret_cast<const texture_record*>(at(texture_section));
+    std::vector<const texture*> textures;
+    for (std::uint64_t i = 0; i < sec[texture_section].count; i++) {
+        const auto& t = tex[i];
+        auto side = [&](std::int32_t index, const double* c) {
+            return index >= 0 ? textures[size_t(index)] : scn.textures.add<solid_color>(to_vec3(c));
+        };
+        if ((t.even >= 0 && std::uint64_t(t.even) >= i) || (t.odd >= 0 && std::uint64_t(t.odd) >= i))
+            return bad("is damaged");
+        if ((t.kind == image_kind || t.kind == paged_kind)
+            && (t.name >= string_count || !std::memchr(strings + t.name, '\0', string_count - t.name)))
+            return bad("is damaged");
+        if (t.kind == noise_kind && !(t.bake_mb >= 0 && t.bake_mb <= max_bake_mb))
+            return bad("is damaged");
+        switch (t.kind) {
+            case solid_kind:   textures.push_back(scn.textures.add<solid_color>(to_vec3(t.color_a))); break;
+            case image_kind:   textures.push_back(scn.textures.add<image_texture>(strings + t.name)); break;
+            case paged_kind:   textures.push_back(scn.textures.add<paged_texture>(strings + t.name)); break;
+            case noise_kind:
+                if (t.bake_mb > 0)
+                    textures.push_back(scn.textures.add<noise_texture>(
+                        t.scale, aabb(to_vec3(t.bake_lo), to_vec3(t.bake_hi)), size_t(t.bake_mb * 1024 * 1024)));
+                else
+                    textures.push_back(scn.textures.add<noise_texture>(t.scale));
+                break;
+            case checker_kind:
+                if (t.even < 0 && t.odd < 0)
+                    textures.push_back(scn.textures.add<checker_texture>(t.scale, to_vec3(t.color_a), to_vec3(t.color_b)));
+                else
+                    textures.push_back(scn.textures.add<checker_texture>(t.scale, side(t.even, t.color_a), side(t.odd, t.color_b)));
+                break;
+            default: return bad("is damaged");
+        }
+    }
+
+    auto base = material_id(scn.materials.size());
+    auto mats = reinterpret_cast<const material_record*>(at(material_section));
+    auto material_count = sec[material_section].count;
+    for (std::uint64_t i = 0; i < material_count; i++) {
+        const auto& m = mats[i];
+        if (m.tex >= 0 && size_t(m.tex) >= textures.size())
+            return bad("is damaged");
+        auto albedo = to_vec3(m.albedo);
+        switch (m.kind) {
+            case lambertian_kind:
+                m.tex >= 0 ? scn.materials.add<lambertian>(textures[size_t(m.tex)]) : scn.materials.add<lambertian>(albedo);
+                break;
+            case light_kind:
+                m.tex >= 0 ? scn.materials.add<diffuse_light>(textures[size_t(m.tex)]) : scn.materials.add<diffuse_light>(albedo);
+                break;
+            case metal_kind:      scn.materials.add<metal>(albedo, m.param); break;
+            case dielectric_kind: scn.materials.add<dielectric>(m.param); break;
+            default: return bad("is damaged");
+        }
+    }
+
+    // Emitters are sampled as lights, which needs objects of their own
+    auto spheres = reinterpret_cast<const sphere_record*>(at(sphere_section));
+    auto planars = reinterpret_cast<const planar_record*>(at(planar_section));
+    auto emitters = reinterpret_cast<const prim_ref*>(at(emitter_section));
+    for (std::uint64_t i = 0; i < sec[emitter_section].count; i++) {
+        const auto& ref = emitters[i];
+        if (ref.kind == sphere_kind && ref.index < sec[sphere_section].count && spheres[ref.index].mat < material_count) {
+            const auto& s = spheres[ref.index];
+            auto center = to_vec3(s.center);
+            if (s.moving)
+                scn.world.add(scn.make<sphere>(center, center + to_vec3(s.motion), s.radius, base + s.mat));
+            else
+                scn.world.add(scn.make<sphere>(center, s.radius, base + s.mat));
+        } else if (ref.kind == planar_kind && ref.index < sec[planar_section].count && planars[ref.index].mat < material_count) {
+            const auto& q = planars[ref.index];
+            if (q.shape == triangle_shape)
+                scn.world.add(scn.make<tri>(to_vec3(q.Q), to_vec3(q.u), to_vec3(q.v), base + q.mat));
+            else
+                scn.world.add(scn.make<quad>(to_vec3(q.Q), to_vec3(q.u), to_vec3(q.v), base + q.mat));
+        } else {
+            return bad("is damaged");
+        }
+    }
+
+    apply_camera_settings(*reinterpret_cast<const camera_record*>(at(camera_section)), cam);
+
+    if (sec[node_section].count > 0)
+        scn.world.add(scn.make<mapped_scene>(std::move(file), base));
+    return true;
+}
+
+inline bool load_scene_file(const std::string& text_path, scene& scn, camera& cam) {
+    // load_scene() of the text scene at text_path, compiled first if need be
+    auto binary = compiled_scene(text_path);
+    return !binary.empty() && load_scene(binary, scn, cam);
+}
+
+#endif
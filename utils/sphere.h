@@ -2,6 +2,9 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "light.h"
+#include "onb.h"
+#include "stats.h"
 #include "vec3.h"
 
 class sphere : public hittable
@@ -9,14 +12,14 @@ class sphere : public hittable
 public:
   // Define a sphere with a center, a radius and a material
   // Not moving
-  sphere(point3 _center, double _radius, shared_ptr<material> _material)
+  sphere(point3 _center, double _radius, material_id _material)
       : center1(_center), radius(fmax(0, _radius)), mat(_material), is_moving(false)
   { //A sphere bounding box is easy, just draw a cube with sidelength = radius
     auto rvec = vec3(radius, radius, radius);
     bbox = aabb(center1 - rvec, center1 + rvec);
   }
 
-  sphere(point3 _center1, point3 _center2, double _radius, shared_ptr<material> _material)
+  sphere(point3 _center1, point3 _center2, double _radius, material_id _material)
       : center1(_center1), radius(fmax(0, _radius)), mat(_material), is_moving(true)
   {
     //Moving sphere bounding box just take the start and end points, whole box
@@ -30,9 +33,20 @@ public:
 
   // Define a hit function for a sphere
   bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+  {
+    double root;
+    if (!intersect(is_moving ? sphere_center(r.time()) : center1, radius, r, ray_t, root))
+      return false;
+
+    rec.t = root;
+    rec.set_primitive(this);
+
+    return true;
+  }
+
+  static bool intersect(const point3 &center, double radius, const ray &r, interval ray_t, double &root)
   {
     // we can solve the equation for a ray and a sphere to find the intersection points
-    point3 center = is_moving ? sphere_center(r.time()) : center1;
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -44,7 +58,7 @@ public:
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
 
     if (!ray_t.surrounds(root))
     {                               // root is outside of the acceptable range
@@ -53,31 +67,77 @@ public:
         return false;
     }
 
-    rec.t = root;
+    return true;
+  }
+
+  void finalize(const ray &r, hit_record &rec) const override
+  {
+    point3 center = is_moving ? sphere_center(r.time()) : center1;
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius; // we can skip square root because we know the radius
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
     rec.mat = mat;
-
-    return true;
   }
 
   aabb bounding_box() const override {return bbox;}
 
-private:
-  point3 center1;
-  double radius;
-  shared_ptr<material> mat;
-  bool is_moving;
-  vec3 center_vec;  
-  aabb bbox;
+  vec3 random(const point3 &origin, double time, const point2 &u) const override
+  {
+    // Uniform over the cone of directions that see the sphere from origin
+    vec3 direction = (is_moving ? sphere_center(time) : center1) - origin;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+      return sample_uniform_sphere(u); // origin inside, pdf_value() is 0
+    onb uvw(direction);
+    return uvw.transform(random_to_sphere(radius, distance_squared, u));
+  }
 
-  point3 sphere_center(double time) const
+  double pdf_value(const point3 &origin, const vec3 &direction, double time) const override
   {
-    // Linearly interpolate from center1 to center2 according to time, where t=0 yields
-    // center1, and t=1 yields center2.
-    return center1 + time * center_vec;
+    hit_record rec;
+    if (!hit(ray(origin, direction, time), interval(0.001, infinity), rec))
+      return 0;
+
+    auto distance_squared = ((is_moving ? sphere_center(time) : center1) - origin).length_squared();
+    if (distance_squared <= radius * radius)
+      return 0;
+    auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+    return 1 / solid_angle;
+  }
+
+  double sample_surface(const point2 &u, double time, hit_record &rec) const override
+  {
+    auto n = sample_uniform_sphere(u);
+    rec.p = (is_moving ? sphere_center(time) : center1) + radius * n;
+    rec.normal = n;
+    rec.front_face = true;
+    get_sphere_uv(n, rec.u, rec.v);
+    rec.mat = mat;
+    return 1 / (4 * pi * radius * radius);
+  }
+
+  void collect_lights(light_list &lights) const override
+  {
+    // Emits in every direction from its whole surface
+    light_bounds b;
+    b.bounds = bbox;
+    b.phi = 4 * pi * radius * radius;
+    b.cos_theta_o = -1;
+    lights.add(this, mat, b);
+  }
+
+  bool has_motion() const override { return is_moving; }
+
+  aabb bounding_box_at(double time) const override
+  {
+    if (!is_moving)
+      return bbox;
+    auto rvec = vec3(radius, radius, radius);
+    auto center = sphere_center(time);
+    return aabb(center - rvec, center + rvec);
   }
 
   static void get_sphere_uv(const point3 &p, double &u, double &v)
@@ -85,12 +145,28 @@ private:
     // p is a point on the unit sphere centered at the origin.
     // return a u and v value using the spherical coordinates of p
     // u and v lie between 0 and 1
+    RT_STAT(transcendentals);
     auto theta = acos(-p.y());
     auto phi = atan2(-p.z(), p.x()) + pi;
 
     u = phi / (2 * pi);
     v = theta / pi;
   }
+
+private:
+  point3 center1;
+  double radius;
+  material_id mat;
+  bool is_moving;
+  vec3 center_vec;  
+  aabb bbox;
+
+  point3 sphere_center(double time) const
+  {
+    // Linearly interpolate from center1 to center2 according to time, where t=0 yields
+    // center1, and t=1 yields center2.
+    return center1 + time * center_vec;
+  }
 };
 
 #endif
\ No newline at end of file
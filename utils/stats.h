@@ -0,0 +1,40 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <iostream>
+
+// Render counters, for measuring what the acceleration structures and shading code actually do.
+// They only count when the build defines RT_STATS (e.g. g++ -DRT_STATS ...); otherwise the
+// RT_STAT macro compiles away and the hot loops are untouched. The render's worker threads all
+// count into the same totals, so each increment is a relaxed atomic add.
+
+namespace stats {
+    inline std::atomic<unsigned long long> rays{0};            // rays traced against the world
+    inline std::atomic<unsigned long long> shadow_rays{0};     // next event estimation rays
+    inline std::atomic<unsigned long long> bvh_node_visits{0}; // bvh_node::hit calls
+    inline std::atomic<unsigned long long> transcendentals{0}; // acos/atan2 etc. spent on surface coordinates
+    inline std::atomic<unsigned long long> cache_lookups{0};   // irradiance cache lookups
+    inline std::atomic<unsigned long long> cache_hits{0};      // of those, answered by the cache
+
+    inline void report(std::ostream& out) {
+#ifdef RT_STATS
+        auto traced = rays.load() + shadow_rays.load();
+        auto per_ray = [&](unsigned long long n) { return traced ? double(n) / traced : 0.0; };
+        out << "Rays traced:         " << rays.load() << '\n'
+            << "Shadow rays:         " << shadow_rays.load() << '\n'
+            << "BVH nodes per ray:   " << per_ray(bvh_node_visits.load()) << '\n'
+            << "Transcendentals/ray: " << per_ray(transcendentals.load()) << '\n';
+        if (cache_lookups.load())
+            out << "Cache hits:          " << cache_hits.load() << " of " << cache_lookups.load() << '\n';
+#endif
+    }
+}
+
+#ifdef RT_STATS
+    #define RT_STAT(counter) (stats::counter.fetch_add(1, std::memory_order_relaxed))
+#else
+    #define RT_STAT(counter) ((void)0)
+#endif
+
+#endif
@@ -2,93 +2,292 @@
 #define TEXTURE_H
 #include "rtw_stg_image.h"
 #include "rtweekend.h"
+#include "mipmap.h"
 #include "perlin.h"
+#include "texture_cache.h"
+#include "thread_pool.h"
 
-class texture {
-  public:
-    virtual ~texture() = default;
+#include <array>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
 
-    virtual color value(double u, double v, const point3& p) const = 0;
-};
+// Textures form a closed set, like materials: each is a plain class, and texture (at the end
+// of this file) holds one of them in a std::variant. Lookups switch on the kind of texture
+// instead of making a virtual call, so the compiler can inline them into the material.
+//
+// du and dv are how much of the texture's u and v the lookup covers: the footprint of a
+// camera pixel, or 0 where that is not known. Textures that can filter use them.
+//
+// Once a scene is built its textures are compiled into one texture_program (at the end of
+// this file), and lookups go through that instead.
+
+class texture;
+class texture_program;
 
-class solid_color : public texture {
+class solid_color {
   public:
     solid_color(const color& albedo) : albedo(albedo) {}
 
     solid_color(double red, double green, double blue) : solid_color(color(red,green,blue)) {}
 
-    color value(double u, double v, const point3& p) const override {
+    color value(double u, double v, const point3& p, double du, double dv) const {
         return albedo;
     }
 
   private:
+    friend class texture_program;
     color albedo;
 };
 
-class checker_texture : public texture {
+class checker_texture {
   public:
   //we can use other texture as part of the checker texture
-  checker_texture(double scale, shared_ptr<texture> even, shared_ptr<texture> odd)
+  checker_texture(double scale, const texture* even, const texture* odd)
   : inv_scale(1.0/scale), even(even), odd(odd) {}
 
+  //plain colors are kept inline rather than as solid_color textures
   checker_texture(double scale, const color& c1, const color& c2)
-  : inv_scale(1.0/scale),
-  even(make_shared<solid_color>(c1)),
-  odd(make_shared<solid_color>(c2)) {}
+  : inv_scale(1.0/scale), even_color(c1), odd_color(c2), even(nullptr), odd(nullptr) {}
 
-  color value(double u, double v, const point3& p) const override {
+  color value(double u, double v, const point3& p, double du, double dv) const; // Below texture, which even and odd are
+
+  static bool is_even(double inv_scale, const point3& p) {
     //Divide the coords and take the left side floor. Use either even or odd texture
     auto xInt = int(std::floor(inv_scale * p.x()));
     auto yInt = int(std::floor(inv_scale * p.y()));
     auto zInt = int(std::floor(inv_scale * p.z()));
 
-    bool isEven = (xInt + yInt + zInt) % 2 == 0;
-
-    return isEven ? even->value(u, v, p) : odd->value(u,v,p);
+    return (xInt + yInt + zInt) % 2 == 0;
   }
 
   private:
+    friend class texture_program;
     double inv_scale;
-    shared_ptr<texture> even;
-    shared_ptr<texture> odd;
+    color even_color, odd_color;
+    const texture* even;
+    const texture* odd;
 };
 
-class image_texture : public texture {
+class image_texture {
   public:
-  image_texture(const char* filename) : image(filename) {}
+  // The image is decoded and its mip pyramid built on the shared thread pool, while the scene
+  // goes on being built; wait() (through texture_table::finish_loading) before the first
+  // lookup. The pyramid is all the texture keeps of the image. The job holds this texture's
+  // address, so it cannot be copied or moved.
+  image_texture(const char* filename)
+    : loading(thread_pool::shared().submit([this, name = std::string(filename)] {
+          texels = mipmap(rtw_image(name.c_str(), rtw_image::linear_bytes));
+      })) {}
 
-  color value(double u, double v, const point3& p) const override {
-    // Return cyan if no image data found
-    if (image.height() <= 0 || image.width() <= 0) return color(0,1,1);
+  image_texture(const image_texture&) = delete;
+  image_texture& operator=(const image_texture&) = delete;
 
-    u = interval(0.0, 1.0).clamp(u);
-    v = 1.0 - interval(0.0, 1.0).clamp(v); // flip v coords
+  ~image_texture() { wait(); }
 
-    auto i = static_cast<int>(u * image.width());
-    auto j = static_cast<int>(v * image.height());
-    auto pixel = image.pixel_data(i, j);
+  void wait() const { if (loading.valid()) loading.wait(); }
 
-    auto color_scale = 1.0 / 255.0;
-    return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+  color value(double u, double v, const point3& p, double du, double dv) const {
+    // Return cyan if no image data found
+    if (texels.empty()) return color(0,1,1);
+    return texels.lookup(u, v, du, dv);
   }
 
   private:
-    rtw_image image;
+    mipmap texels;
+    std::future<void> loading;
 
 };
 
-class noise_texture : public texture {
+class paged_texture {
+  public:
+  // An image texture read through the shared texture cache, a tile at a time as lookups need
+  // them; images that are never looked up are never read
+  paged_texture(const char* filename) : id(texture_cache::shared().add(filename)) {}
+
+  color value(double u, double v, const point3& p, double du, double dv) const {
+    return texture_cache::shared().lookup(id, u, v, du, dv);
+  }
+
+  private:
+    int id;
+};
+
+class noise_texture {
   public:
   noise_texture() {}
   noise_texture(double scale) : scale(scale) {}
-  color value(double u, double v, const point3& p) const override {
-    return color(.5, .5, .5) * (1 + sin(scale * p.z() + 10 * noise.turb(p,7)));
+
+  // Bakes the turbulence inside region into a noise_volume of at most memory_budget bytes
+  noise_texture(double scale, const aabb& region, size_t memory_budget)
+    : scale(scale), baked(noise, region, depth, memory_budget) {}
+
+  color value(double u, double v, const point3& p, double du, double dv) const {
+    auto turbulence = baked.empty() ? noise.turb(p, depth) : baked.turb(noise, p);
+    return color(.5, .5, .5) * (1 + sin(scale * p.z() + 10 * turbulence));
   }
 
 
   private:
+  static const int depth = 7;
   perlin noise;
   double scale;
+  noise_volume baked;
 };
 
+class texture {
+  // One of the textures above, in the scene's arena (see scene.h)
+  public:
+    template <typename T, typename... Args>
+    explicit texture(std::in_place_type_t<T> type, Args&&... args) : impl(type, std::forward<Args>(args)...) {}
+
+    color value(double u, double v, const point3& p, double du = 0, double dv = 0) const; // Below texture_program
+
+    void finish_loading() const {
+        // Waits for an image texture's background load
+        if (auto image = std::get_if<image_texture>(&impl))
+            image->wait();
+    }
+
+  private:
+    friend class texture_program;
+    std::variant<solid_color, checker_texture, image_texture, paged_texture, noise_texture> impl;
+    const texture_program* program = nullptr; // Set when the scene's textures are compiled
+    std::uint32_t root = 0;                   // This texture's node in program
+};
+
+class texture_program {
+  // A scene's textures, flattened into one array of nodes that refer to each other by index.
+  // Plain colors become constant nodes inside the nodes that use them; equal constants are
+  // one node; a checker whose two squares compile to the same node is that node; and a checker
+  // inside a square of a checker of the same size, which can only ever pick the same square
+  // again, is replaced by that square. A texture used in several places is compiled once.
+  //
+  // Only checkers choose between other nodes, so a lookup walks one path from a texture's
+  // root down to a constant, image or noise node in a loop, with no recursion and no virtual
+  // or variant dispatch on the way.
+  public:
+    void compile(const std::vector<texture*>& textures) {
+        // Compiles textures, and makes each look itself up through this program
+        nodes.clear();
+        constants.clear();
+        compiled.clear();
+        for (auto t : textures)
+            t->root = add(t);
+        for (auto t : textures)
+            t->program = this;
+    }
+
+    size_t size() const { return nodes.size(); }
+
+    color evaluate(std::uint32_t at, double u, double v, const point3& p, double du, double dv) const {
+        for (;;) {
+            const auto& n = nodes[at];
+            switch (n.op) {
+              case node::constant:   return n.value;
+              case node::checker:    at = checker_texture::is_even(n.inv_scale, p) ? n.even : n.odd; break;
+              case node::image_leaf: return n.image->value(u, v, p, du, dv);
+              case node::paged_leaf: return n.paged->value(u, v, p, du, dv);
+              case node::noise_leaf: return n.noise->value(u, v, p, du, dv);
+            }
+        }
+    }
+
+  private:
+    struct node {
+        enum kind : std::uint8_t { constant, checker, image_leaf, paged_leaf, noise_leaf } op;
+        std::uint32_t even = 0, odd = 0;        // checker: the nodes of its two kinds of square
+        double inv_scale = 0;                   // checker
+        color value;                            // constant
+        const image_texture* image = nullptr;   // Leaves: the texture to call
+        const paged_texture* paged = nullptr;
+        const noise_texture* noise = nullptr;
+    };
+
+    std::vector<node> nodes;
+    std::map<std::array<double, 3>, std::uint32_t> constants;
+    std::unordered_map<const texture*, std::uint32_t> compiled;
+
+    std::uint32_t push(const node& n) {
+        nodes.push_back(n);
+        return std::uint32_t(nodes.size() - 1);
+    }
+
+    std::uint32_t add(const texture* t) {
+        auto found = compiled.find(t);
+        if (found != compiled.end())
+            return found->second;
+        auto at = std::visit([&](const auto& alternative) { return add(alternative); }, t->impl);
+        compiled[t] = at;
+        return at;
+    }
+
+    std::uint32_t add_constant(const color& c) {
+        auto found = constants.find({c.x(), c.y(), c.z()});
+        if (found != constants.end())
+            return found->second;
+        node n;
+        n.op = node::constant;
+        n.value = c;
+        return constants[{c.x(), c.y(), c.z()}] = push(n);
+    }
+
+    std::uint32_t add(const solid_color& t) { return add_constant(t.albedo); }
+
+    std::uint32_t add(const checker_texture& t) {
+        auto even = t.even ? add(t.even) : add_constant(t.even_color);
+        auto odd = t.odd ? add(t.odd) : add_constant(t.odd_color);
+        if (nodes[even].op == node::checker && nodes[even].inv_scale == t.inv_scale)
+            even = nodes[even].even;
+        if (nodes[odd].op == node::checker && nodes[odd].inv_scale == t.inv_scale)
+            odd = nodes[odd].odd;
+        if (even == odd)
+            return even;
+        node n;
+        n.op = node::checker;
+        n.even = even;
+        n.odd = odd;
+        n.inv_scale = t.inv_scale;
+        return push(n);
+    }
+
+    std::uint32_t add(const image_texture& t) {
+        node n;
+        n.op = node::image_leaf;
+        n.image = &t;
+        return push(n);
+    }
+
+    std::uint32_t add(const paged_texture& t) {
+        node n;
+        n.op = node::paged_leaf;
+        n.paged = &t;
+        return push(n);
+    }
+
+    std::uint32_t add(const noise_texture& t) {
+        node n;
+        n.op = node::noise_leaf;
+        n.noise = &t;
+        return push(n);
+    }
+};
+
+inline color texture::value(double u, double v, const point3& p, double du, double dv) const {
+    if (program)
+        return program->evaluate(root, u, v, p, du, dv);
+    return std::visit([&](const auto& t) { return t.value(u, v, p, du, dv); }, impl);
+}
+
+inline color checker_texture::value(double u, double v, const point3& p, double du, double dv) const {
+    if (is_even(inv_scale, p))
+      return even ? even->value(u, v, p, du, dv) : even_color;
+    return odd ? odd->value(u, v, p, du, dv) : odd_color;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,308 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "mipmap.h"
+#include "rtw_stg_image.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+// Out-of-core textures. Each source image is converted once into a tiled file next to it
+// (image.jpg.tiles): its whole mip pyramid, cut into 32x32 texel tiles of 4 KB each, RGB plus
+// a pad byte, at page aligned offsets after a one page header. A tile is then one page, so
+// the file can be read or memory-mapped a tile at a time.
+//
+// The cache reads tiles as lookups first need them and keeps at most memory_limit() bytes
+// of them, dropping the least recently used. Nothing of an image is read until it is first
+// looked up, so textures that are never seen cost nothing but their name. It is shared by the
+// whole process and split into shards, each with its own lock and LRU list, so threads
+// looking up different tiles rarely wait on each other.
+
+class texture_cache {
+  public:
+    static texture_cache& shared() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    void set_memory_limit(size_t bytes) { limit = bytes; }
+    size_t memory_limit() const { return limit; }
+
+    int add(const char* filename) {
+        // Registers an image and returns its id; call while building the scene, before rendering.
+        // An image added again, by a later scene in the same process, keeps its id, its open
+        // file and its tiles.
+        std::lock_guard<std::mutex> guard(registry);
+        auto found = ids.find(filename);
+        if (found != ids.end())
+            return found->second;
+        files.emplace_back(filename);
+        return ids[filename] = int(files.size() - 1);
+    }
+
+    color lookup(int id, double u, double v, double du, double dv) {
+        // Trilinear filtered color of image id at (u, v) for a footprint du by dv wide (see
+        // mipmap.h), or cyan if the image could not be loaded
+        auto& f = files[size_t(id)];
+        std::call_once(f.opened, [&] { open(f); });
+        if (f.levels.empty())
+            return color(0,1,1);
+        return mip::trilinear(f.width, f.height, int(f.levels.size()), u, v, du, dv,
+                              [&](int l, int x, int y) { return texel(id, f, l, x, y); });
+    }
+
+    void report(std::ostream& out) {
+        // Hits and misses so far, if any image was looked up
+        std::uint64_t hits = 0, misses = 0, evictions = 0;
+        size_t resident = 0;
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            hits += s.hits;
+            misses += s.misses;
+            evictions += s.evictions;
+            resident += s.lru.size() * tile_bytes;
+        }
+        if (hits + misses == 0)
+            return;
+        out << "Texture cache:       " << hits << " hits, " << misses << " misses ("
+            << 100.0 * hits / (hits + misses) << "% hits), " << evictions << " evictions, "
+            << resident / 1024 << " KB of " << limit / 1024 << " KB\n";
+    }
+
+  private:
+    static constexpr int tile_size = 32;                               // Texels per side
+    static constexpr size_t tile_bytes = tile_size * tile_size * 4;    // One page
+    static constexpr size_t header_bytes = 4096;
+    static constexpr char magic[8] = { 'R', 'T', 'T', 'I', 'L', 'E', 'S', '2' };
+    static constexpr int shard_count = 16;
+    static constexpr std::uint32_t max_levels = 64;                    // Enough for 2^32 texels a side
+
+    struct level_info {
+        std::uint32_t width, height, tiles_x, tiles_y;
+        std::uint64_t first_tile;   // Index of its first tile in the file
+    };
+
+    struct tiled_file {
+        explicit tiled_file(const char* source) : source(source) {}
+        std::string source;
+        std::once_flag opened;
+        int width = 0, height = 0;
+        std::vector<level_info> levels;   // Empty if the image could not be loaded
+        std::ifstream in;
+        std::mutex reading;
+    };
+
+    struct entry {
+        std::uint64_t key;                 // Image id and tile index
+        std::vector<unsigned char> texels;
+    };
+
+    struct shard {
+        std::mutex lock;
+        std::list<entry> lru;              // Most recently used first
+        std::unordered_map<std::uint64_t, std::list<entry>::iterator> index;
+        std::uint64_t hits = 0, misses = 0, evictions = 0;
+    };
+
+    std::atomic<size_t> limit{256 * 1024 * 1024};
+    std::mutex registry;
+    std::deque<tiled_file> files;          // Never moves an element, unlike a vector
+    std::unordered_map<std::string, int> ids;   // Of files, by the name they were added with
+    shard shards[shard_count];
+
+    color texel(int id, tiled_file& f, int level, int x, int y) {
+        const auto& lv = f.levels[level];
+        auto tile = lv.first_tile + std::uint64_t(y / tile_size) * lv.tiles_x + x / tile_size;
+        auto key = (std::uint64_t(id) << 40) | tile;
+        auto& s = shards[(key * 0x9e3779b97f4a7c15ull) >> 60]; // 16 shards: the top 4 bits
+        auto offset = (size_t(y % tile_size) * tile_size + x % tile_size) * 4;
+
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            auto found = s.index.find(key);
+            if (found != s.index.end()) {
+                s.hits++;
+                s.lru.splice(s.lru.begin(), s.lru, found->second);
+                auto p = &s.lru.front().texels[offset];
+                return color(p[0], p[1], p[2]) / 255.0;
+            }
+        }
+
+        // Read the tile without holding the shard, so lookups of tiles already in it go on
+        // meanwhile, then put it in. Another thread may have read the same tile by then; the
+        // copy already there is used and this one dropped.
+        thread_local std::vector<unsigned char> texels;
+        read_tile(f, tile, texels);
+
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.misses++;
+        auto found = s.index.find(key);
+        if (found != s.index.end())
+            s.lru.splice(s.lru.begin(), s.lru, found->second);
+        else
+            insert(s, key, texels);
+        auto p = &s.lru.front().texels[offset];
+        return color(p[0], p[1], p[2]) / 255.0;
+    }
+
+    static void read_tile(tiled_file& f, std::uint64_t tile, std::vector<unsigned char>& texels) {
+        texels.resize(tile_bytes);
+        std::lock_guard<std::mutex> guard(f.reading);
+        f.in.clear();
+        f.in.seekg(std::streamoff(header_bytes + tile * tile_bytes));
+        if (!f.in.read(reinterpret_cast<char*>(texels.data()), tile_bytes))
+            std::fill(texels.begin(), texels.end(), 0);
+    }
+
+    void insert(shard& s, std::uint64_t key, std::vector<unsigned char>& texels) {
+        // Puts a tile read into texels at the front of s, dropping the least recently used
+        // ones once s holds its share of the limit. texels gets the memory of the last one
+        // dropped, or is left empty, to be reused for the next read.
+        auto capacity = std::max<size_t>(1, limit / tile_bytes / shard_count);
+        while (s.lru.size() > capacity) {
+            s.index.erase(s.lru.back().key);
+            s.lru.pop_back();
+            s.evictions++;
+        }
+        if (s.lru.size() == capacity) {
+            s.index.erase(s.lru.back().key);
+            s.lru.splice(s.lru.begin(), s.lru, std::prev(s.lru.end()));
+            s.lru.front().texels.swap(texels);
+            s.evictions++;
+        } else {
+            s.lru.push_front(entry{key, std::move(texels)});
+            texels.clear();
+        }
+        s.lru.front().key = key;
+        s.index[key] = s.lru.begin();
+    }
+
+    static void open(tiled_file& f) {
+        // Finds the tiled file of f's image, converting the image first if there is none or
+        // the image is newer. Where the image's directory cannot be written, the tiled file
+        // goes in the temporary directory.
+        auto source = rtw_image::locate(f.source.c_str());
+        if (source.empty()) {
+            std::cerr << "ERROR: Could not load image file '" << f.source << "'.\n";
+            return;
+        }
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        auto absolute = fs::absolute(source, ec).string();
+        std::string paths[2] = {
+            source + ".tiles",
+            (fs::temp_directory_path(ec) / (std::to_string(std::hash<std::string>()(absolute))
+                                            + "_" + fs::path(source).filename().string() + ".tiles")).string()
+        };
+        for (const auto& path : paths) {
+            auto current = fs::exists(path, ec) && fs::last_write_time(path, ec) >= fs::last_write_time(source, ec);
+            if (current && read_header(path, f))
+                return;
+            if (convert(source, path) && read_header(path, f))
+                return;
+        }
+        std::cerr << "ERROR: Could not write a tiled copy of image file '" << source << "'.\n";
+    }
+
+    static bool read_header(const std::string& path, tiled_file& f) {
+        f.in.close();
+        f.in.clear();
+        f.in.open(path, std::ios::binary);
+        char header[header_bytes];
+        std::uint32_t sizes[3];
+        if (!f.in.read(header, header_bytes) || std::memcmp(header, magic, sizeof(magic)) != 0)
+            return false;
+        std::memcpy(sizes, header + sizeof(magic), sizeof(sizes));
+        if (sizes[2] > max_levels)
+            return false;
+        f.width = int(sizes[0]);
+        f.height = int(sizes[1]);
+        f.levels.resize(sizes[2]);
+        std::memcpy(f.levels.data(), header + sizeof(magic) + sizeof(sizes), sizes[2] * sizeof(level_info));
+        return true;
+    }
+
+    static bool convert(const std::string& source, const std::string& path) {
+        // Decodes the image and writes its tiled pyramid to path, through a temporary file so
+        // a reader never sees half of one
+        rtw_image image(source.c_str(), rtw_image::linear_bytes);
+        auto w = image.width(), h = image.height();
+        if (w <= 0 || h <= 0)
+            return false;
+
+        auto count = mip::level_count(w, h);
+        std::vector<level_info> levels(count);
+        std::uint64_t tiles = 0;
+        for (int l = 0; l < count; l++) {
+            auto& lv = levels[l];
+            lv.width = std::uint32_t(mip::level_size(w, l));
+            lv.height = std::uint32_t(mip::level_size(h, l));
+            lv.tiles_x = (lv.width + tile_size - 1) / tile_size;
+            lv.tiles_y = (lv.height + tile_size - 1) / tile_size;
+            lv.first_tile = tiles;
+            tiles += std::uint64_t(lv.tiles_x) * lv.tiles_y;
+        }
+
+        auto temporary = path + ".partial";
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out)
+            return false;
+        std::vector<char> header(header_bytes, 0);
+        std::uint32_t sizes[3] = { std::uint32_t(w), std::uint32_t(h), std::uint32_t(count) };
+        std::memcpy(header.data(), magic, sizeof(magic));
+        std::memcpy(header.data() + sizeof(magic), sizes, sizeof(sizes));
+        std::memcpy(header.data() + sizeof(magic) + sizeof(sizes), levels.data(), count * sizeof(level_info));
+        out.write(header.data(), header_bytes);
+
+        auto pixels = mip::read_image(image);
+        std::vector<unsigned char> tile(tile_bytes);
+        for (int l = 0; l < count; l++) {
+            const auto& lv = levels[l];
+            int lw = int(lv.width), lh = int(lv.height);
+            for (std::uint32_t ty = 0; ty < lv.tiles_y; ty++) {
+                for (std::uint32_t tx = 0; tx < lv.tiles_x; tx++) {
+                    std::fill(tile.begin(), tile.end(), 0);
+                    for (int y = 0; y < tile_size; y++) {
+                        auto py = int(ty) * tile_size + y;
+                        for (int x = 0; x < tile_size; x++) {
+                            auto px = int(tx) * tile_size + x;
+                            if (px >= lw || py >= lh)
+                                continue;
+                            for (int c = 0; c < 3; c++)
+                                tile[(size_t(y) * tile_size + x) * 4 + c] = pixels[(size_t(py) * lw + px) * 3 + c];
+                        }
+                    }
+                    out.write(reinterpret_cast<const char*>(tile.data()), tile_bytes);
+                }
+            }
+            if (l + 1 < count)
+                pixels = mip::downsample(pixels, lw, lh);
+        }
+
+        out.close();
+        std::error_code ec;
+        if (out)
+            std::filesystem::rename(temporary, path, ec);
+        if (!out || ec) {
+            std::filesystem::remove(temporary, ec);
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class thread_pool {
+  // A fixed set of worker threads running jobs in the order they were submitted. Work that can
+  // overlap with the caller, like decoding images while the rest of the scene is built, goes
+  // here instead of each job starting a thread of its own.
+  public:
+    static thread_pool& shared() {
+        // One worker per hardware thread, started on first use and joined at exit
+        static thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    explicit thread_pool(unsigned count) {
+        for (unsigned i = 0; i < count; i++)
+            workers.emplace_back([this] { work(); });
+    }
+
+    ~thread_pool() {
+        // Finishes the jobs already submitted
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    template <typename F>
+    std::future<void> submit(F&& job) {
+        // Queues job() and returns a future that is ready once it has run; an exception it
+        // throws comes out of the future's get()
+        std::packaged_task<void()> task(std::forward<F>(job));
+        auto done = task.get_future();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(std::move(task));
+        }
+        wake.notify_one();
+        return done;
+    }
+
+  private:
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::packaged_task<void()>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void work() {
+        for (;;) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                task = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+#endif
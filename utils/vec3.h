@@ -1,17 +1,19 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include "simd.h"
+
 #include <cmath>
 #include <iostream>
 
 using std::sqrt;
 
-class vec3 {
+class alignas(RT_SIMD_ALIGN) vec3 {
   public:
-    double e[3];
+    double e[4]; // x, y, z, and a zero pad lane so the vector fills one SIMD register
 
-    vec3() : e{0,0,0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3() : e{0,0,0,0} {}
+    vec3(double e0, double e1, double e2) : e{e0, e1, e2, 0} {}
 
     double x() const { return e[0]; }
     double y() const { return e[1]; }
@@ -22,16 +24,12 @@ class vec3 {
     double& operator[](int i) { return e[i]; }
 
     vec3& operator+=(const vec3 &v) {
-        e[0] += v.e[0];
-        e[1] += v.e[1];
-        e[2] += v.e[2];
+        simd::add(e, v.e, e);
         return *this;
     }
 
     vec3& operator*=(double t) {
-        e[0] *= t;
-        e[1] *= t;
-        e[2] *= t;
+        simd::scale(e, t, e);
         return *this;
     }
 
@@ -44,7 +42,7 @@ class vec3 {
     }
 
     double length_squared() const {
-        return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
+        return simd::dot(e, e);
     }
 
     bool near_zero() const {
@@ -73,19 +71,27 @@ inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
 }
 
 inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    vec3 out;
+    simd::add(u.e, v.e, out.e);
+    return out;
 }
 
 inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    vec3 out;
+    simd::sub(u.e, v.e, out.e);
+    return out;
 }
 
 inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    vec3 out;
+    simd::mul(u.e, v.e, out.e);
+    return out;
 }
 
 inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+    vec3 out;
+    simd::scale(v.e, t, out.e);
+    return out;
 }
 
 inline vec3 operator*(const vec3 &v, double t) {
@@ -99,31 +105,75 @@ inline vec3 operator/(vec3 v, double t) {
 
 
 inline double dot(const vec3 &u, const vec3 &v) {
-    return u.e[0] * v.e[0]
-         + u.e[1] * v.e[1]
-         + u.e[2] * v.e[2];
+    return simd::dot(u.e, v.e);
 }
 
 inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+    vec3 out;
+    simd::cross(u.e, v.e, out.e);
+    return out;
 }
 
-inline vec3 unit_vector(vec3 v) {
-    return v / v.length();
+inline vec3 unit_vector(const vec3 &v) {
+    vec3 out;
+    simd::normalize(v.e, out.e);
+    return out;
 }
 
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() < 1)
-            return p;
+inline vec3 fast_unit_vector(const vec3 &v) {
+    // Normalize with an approximate reciprocal square root. Good to about 1e-7, so only use it
+    // where float precision is enough and the length fits in a float.
+    vec3 out;
+    simd::fast_normalize(v.e, out.e);
+    return out;
+}
+
+// A pair of sample values in [0,1)^2, as drawn from a sampler (see sampler.h)
+struct point2 {
+    double x, y;
+};
+
+// Closed form warps from the unit square. Each maps a uniform point in [0,1)^2 to a uniform
+// (or cosine weighted) point in the target domain, and keeps nearby inputs nearby, so
+// well distributed sample points stay well distributed after warping.
+
+inline vec3 sample_uniform_sphere(const point2& u) {
+    auto z = 1 - 2*u.x;
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*u.y;
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+inline vec3 sample_concentric_disk(const point2& u) {
+    // Shirley and Chiu's mapping of concentric squares to concentric circles
+    auto a = 2*u.x - 1;
+    auto b = 2*u.y - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    double r, phi;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = (pi/2) - (pi/4) * (a/b);
     }
+    return vec3(r*cos(phi), r*sin(phi), 0);
+}
+
+inline vec3 sample_cosine_hemisphere(const point2& u) {
+    // Around +z: a uniform disk point lifted onto the hemisphere
+    auto d = sample_concentric_disk(u);
+    auto z = sqrt(fmax(0.0, 1 - d.x()*d.x() - d.y()*d.y()));
+    return vec3(d.x(), d.y(), z);
 }
 
 inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    return sample_uniform_sphere(point2{random_double(), random_double()});
+}
+
+inline vec3 random_in_unit_sphere() {
+    return random_unit_vector() * std::cbrt(random_double());
 }
 
 inline vec3 random_on_hemisphere(const vec3& normal) {
@@ -145,12 +195,8 @@ inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
     return r_out_perp + r_out_parallel;
 }
 
-inline vec3 random_in_unit_disk() { //Rejection sampling 
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
+inline vec3 random_in_unit_disk() {
+    return sample_concentric_disk(point2{random_double(), random_double()});
 }
 
 #endif
\ No newline at end of file